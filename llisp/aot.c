@@ -0,0 +1,612 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aot.h"
+#include "cps.h"
+#include "gc.h"
+#include "globals.h"
+#include "macroexpander.h"
+#include "print.h"
+#include "vm.h"
+
+/*
+ * Ahead-of-time compilation (--compile-to-c). We expand and compile the stdlib
+ * and the program to bytecode like --vm would, and write out a C program with
+ * a function for each bytecode body. Each instruction turns into a few lines
+ * of C that do what execute would (see the macros in aot.h), so there's no
+ * dispatch; calls and returns between bodies go through the same helpers the
+ * VM uses, which keeps proper tail calls, and anything that needs a real
+ * continuation (call/cc, OP_EVAL, a failure) gets handed back to execute and
+ * the trampoline just like the JIT does.
+ *
+ * The constants, and the bytecode itself, which the interpreter still needs,
+ * get rebuilt from a list of instructions for aot_main when the program
+ * starts. Builtins are looked up by name, and anything else that can't be
+ * written down (a closure or continuation a macro put in the code) can't be
+ * compiled.
+ *
+ * Nothing in the program runs while it's being compiled except `defmacro'
+ * forms, so a macro can only use the stdlib and the macros before it.
+ *
+ * The output includes aot.h and links against everything here but main.c.
+ */
+
+_Bool compile_to_c = 0;
+
+static const struct {
+	const char *name;
+	const char *op;
+} int_ops[AOT_NUM_INT_OPS] = {
+	[AOT_ADD] = { "+", "AOT_ADD" },
+	[AOT_SUB] = { "-", "AOT_SUB" },
+	[AOT_EQ] = { "=", "AOT_EQ" },
+	[AOT_LT] = { "<", "AOT_LT" },
+	[AOT_GT] = { ">", "AOT_GT" },
+	[AOT_LE] = { "<=", "AOT_LE" },
+	[AOT_GE] = { ">=", "AOT_GE" },
+};
+
+/* How many words each instruction takes up, operands and all */
+static const uint32_t op_words[NUM_OPCODES] = {
+	[OP_CONST] = 2,
+	[OP_LOCAL] = 4,
+	[OP_GLOBAL] = 2,
+	[OP_DEFINE] = 2,
+	[OP_SET] = 2,
+	[OP_CLOSURE] = 2,
+	[OP_POP] = 1,
+	[OP_JUMP] = 2,
+	[OP_JUMP_IF_FALSE] = 2,
+	[OP_CALL] = 2,
+	[OP_TAIL_CALL] = 2,
+	[OP_RETURN] = 1,
+	[OP_EVAL] = 2,
+};
+
+struct words {
+	uint32_t *w;
+	size_t len, cap;
+};
+
+static void add_word(struct words *ws, uint32_t w) {
+	if (ws->len == ws->cap) {
+		ws->cap = ws->cap ? ws->cap * 2 : 256;
+		ws->w = realloc(ws->w, ws->cap * sizeof(*ws->w));
+		if (!ws->w) {
+			fputs("Out of memory\n", stderr);
+			abort();
+		}
+	}
+	ws->w[ws->len++] = w;
+}
+
+static FILE *out;
+/* for aot_main, every body's instructions one after another, and each body's
+ * offset into them, len, nconsts and maxstack */
+static struct words load, code_words, bodies;
+static struct aot_string *strings;
+static size_t nstrings, strings_cap;
+
+static uint32_t add_string(const char *str, size_t len) {
+	if (nstrings == strings_cap) {
+		strings_cap = strings_cap ? strings_cap * 2 : 64;
+		strings = realloc(strings, strings_cap * sizeof(*strings));
+		if (!strings) {
+			fputs("Out of memory\n", stderr);
+			abort();
+		}
+	}
+	char *copy = malloc(len ? len : 1);
+	if (!copy) {
+		fputs("Out of memory\n", stderr);
+		abort();
+	}
+	memcpy(copy, str, len);
+	strings[nstrings].str = copy;
+	strings[nstrings].len = len;
+	return (uint32_t)nstrings++;
+}
+
+static void load_string(enum aot_load_op op, struct string *s) {
+	add_word(&load, op);
+	add_word(&load, add_string(s->str, s->len));
+}
+
+static void load_bits(enum aot_load_op op, uint64_t bits) {
+	add_word(&load, op);
+	add_word(&load, (uint32_t)(bits >> 32));
+	add_word(&load, (uint32_t)bits);
+}
+
+/* Something for a comment: `name' without anything that could end it early */
+static void write_name(struct string *name) {
+	char prev = 0;
+	for (size_t i = 0; i < name->len; ++i) {
+		char ch = name->str[i];
+		if (ch < ' ' || ch > '~') ch = '?';
+		if (prev == '*' && ch == '/') fputc(' ', out);
+		fputc(ch, out);
+		prev = ch;
+	}
+}
+
+/* If the two-argument call whose function was pushed at `fn_pc' looks like
+ * it's to one of int_ops, which one (otherwise -1) */
+static int guess_int_op(struct bytecode *code, uint32_t fn_pc) {
+	const uint32_t *w = BYTECODE_WORDS(code);
+	if (w[fn_pc] != OP_GLOBAL) return -1;
+	struct string *name = AS_GLOBAL_REF(code->consts[w[fn_pc + 1]])->name;
+	for (int i = 0; i < AOT_NUM_INT_OPS; ++i) {
+		if (name->len == strlen(int_ops[i].name) && memcmp(name->str, int_ops[i].name, name->len) == 0) return i;
+	}
+	return -1;
+}
+
+/* Write body `index''s function, for `code', which is called `name' (or NULL) */
+static void write_body(struct bytecode *code, uint32_t index, struct string *name) {
+	const uint32_t *w = BYTECODE_WORDS(code);
+	/* 1 for where native code can be started (see RUN_NATIVE), 2 for jump targets */
+	unsigned char *marks = calloc(code->len + 1, 1);
+	if (!marks) {
+		fputs("Out of memory\n", stderr);
+		abort();
+	}
+	marks[0] = 1;
+	for (uint32_t pc = 0; pc < code->len; pc += op_words[w[pc]]) {
+		switch (w[pc]) {
+		case OP_CALL:
+		case OP_TAIL_CALL:
+		case OP_EVAL:
+			marks[pc + 2] |= 1;
+			break;
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+			marks[w[pc + 1]] |= 2;
+			break;
+		}
+	}
+
+	fputs("\n/* ", out);
+	if (name) {
+		write_name(name);
+	} else {
+		fputs(code->scope == NIL ? "a top-level form" : "a lambda", out);
+	}
+	fprintf(out, " */\nstatic uint32_t run_%" PRIu32 "(struct vm *vm, struct obj ***sp, uint32_t pc) {\n", index);
+	fputs("\tstruct obj **top = *sp;\n\tswitch (pc) {\n", out);
+	for (uint32_t pc = 0; pc < code->len; ++pc) {
+		if (marks[pc] & 1) fprintf(out, "\tcase %" PRIu32 ": goto pc_%" PRIu32 ";\n", pc, pc);
+	}
+	fputs("\tdefault: return pc;\n\t}\n", out);
+
+	/* where the last three instructions started, oldest first */
+	uint32_t prev[3] = { 0, 0, 0 };
+	for (uint32_t pc = 0; pc < code->len; pc += op_words[w[pc]]) {
+		if (marks[pc]) fprintf(out, "pc_%" PRIu32 ":\n", pc);
+		const uint32_t *ip = &w[pc + 1];
+		switch (w[pc]) {
+		case OP_CONST:
+			fprintf(out, "\tAOT_CONST(%" PRIu32 ");\n", ip[0]);
+			break;
+		case OP_LOCAL:
+			fprintf(out, "\tAOT_LOCAL(%" PRIu32 ", %" PRIu32 ", %" PRIu32 ");\n", ip[0], ip[1], pc);
+			break;
+		case OP_GLOBAL:
+			fprintf(out, "\tAOT_GLOBAL(%" PRIu32 ", %" PRIu32 ");\n", ip[0], pc);
+			break;
+		case OP_DEFINE:
+			fprintf(out, "\tAOT_DEFINE(%" PRIu32 ");\n", ip[0]);
+			break;
+		case OP_SET:
+			fprintf(out, "\tAOT_SET(%" PRIu32 ", %" PRIu32 ");\n", ip[0], pc);
+			break;
+		case OP_CLOSURE:
+			fprintf(out, "\tAOT_CLOSURE(%" PRIu32 ");\n", ip[0]);
+			break;
+		case OP_POP:
+			fputs("\tAOT_POP();\n", out);
+			break;
+		case OP_JUMP:
+			fprintf(out, "\tgoto pc_%" PRIu32 ";\n", ip[0]);
+			break;
+		case OP_JUMP_IF_FALSE:
+			fprintf(out, "\tAOT_JUMP_IF_FALSE(pc_%" PRIu32 ");\n", ip[0]);
+			break;
+		case OP_CALL:
+		case OP_TAIL_CALL: {
+			int tail = w[pc] == OP_TAIL_CALL;
+			int op = ip[0] == 2 ? guess_int_op(code, prev[0]) : -1;
+			if (op >= 0) {
+				fprintf(out, "\tAOT_INT_CALL(%s, %d, %" PRIu32 ");\n", int_ops[op].op, tail, pc + 2);
+			} else {
+				fprintf(out, "\tAOT_CALL(%" PRIu32 ", %d, %" PRIu32 ");\n", ip[0], tail, pc + 2);
+			}
+			break;
+		}
+		case OP_RETURN:
+			fputs("\tAOT_RETURN();\n", out);
+			break;
+		case OP_EVAL:
+			fprintf(out, "\tAOT_EXIT(%" PRIu32 ");\n", pc);
+			break;
+		}
+		prev[0] = prev[1];
+		prev[1] = prev[2];
+		prev[2] = pc;
+	}
+	fputs("}\n", out);
+	free(marks);
+
+	add_word(&bodies, (uint32_t)code_words.len);
+	add_word(&bodies, code->len);
+	add_word(&bodies, code->nconsts);
+	add_word(&bodies, code->maxstack);
+	for (uint32_t i = 0; i < code->len; ++i) {
+		add_word(&code_words, w[i]);
+	}
+}
+
+static _Bool load_obj(struct obj *obj, struct string *name);
+
+/* The name `code''s constant k gets defined as, if it's a lambda body that
+ * gets defined right away */
+static struct string *closure_name(struct bytecode *code, uint32_t k) {
+	const uint32_t *w = BYTECODE_WORDS(code);
+	for (uint32_t pc = 0; pc < code->len; pc += op_words[w[pc]]) {
+		if (w[pc] != OP_CLOSURE || w[pc + 1] != k) continue;
+		uint32_t next = pc + op_words[OP_CLOSURE];
+		if (next < code->len && w[next] == OP_DEFINE) {
+			struct obj *var = code->consts[w[next + 1]];
+			return TYPE(var) == LOCALREF ? AS_LOCAL_REF(var)->name : AS_SYMBOL(var);
+		}
+	}
+	return NULL;
+}
+
+static _Bool load_bytecode(struct bytecode *code, struct string *name) {
+	_Bool ok = load_obj(code->scope, NULL);
+	for (uint32_t k = 0; k < code->nconsts; ++k) {
+		struct obj *c = code->consts[k];
+		ok &= load_obj(c, TYPE(c) == BYTECODE ? closure_name(code, k) : NULL);
+	}
+	uint32_t index = (uint32_t)(bodies.len / 4);
+	write_body(code, index, name);
+	add_word(&load, LOAD_BYTECODE);
+	add_word(&load, index);
+	return ok;
+}
+
+/* Add instructions for aot_main that push obj */
+static _Bool load_obj(struct obj *obj, struct string *name) {
+	switch (TYPE(obj)) {
+	case CELL: {
+		/* push the elements and whatever ends the list, then cons them up */
+		_Bool ok = 1;
+		uint32_t n = 0;
+		for (; TYPE(obj) == CELL; obj = CDR(obj), ++n) {
+			ok &= load_obj(CAR(obj), NULL);
+		}
+		ok &= load_obj(obj, NULL);
+		while (n--) add_word(&load, LOAD_CONS);
+		return ok;
+	}
+	case NUM:
+		if (IS_INT(obj)) {
+			load_bits(LOAD_INT, (uint64_t)AS_INT(obj));
+		} else {
+			union { double d; uint64_t bits; } u = { AS_DOUBLE(obj) };
+			load_bits(LOAD_DOUBLE, u.bits);
+		}
+		return 1;
+	case SYMBOL:
+		load_string(LOAD_SYMBOL, AS_SYMBOL(obj));
+		return 1;
+	case STRING:
+		load_string(LOAD_STRING, AS_STRING(obj));
+		return 1;
+	case BUILTIN:
+		add_word(&load, obj == NIL ? LOAD_NIL : obj == TRUE ? LOAD_TRUE : LOAD_FALSE);
+		return 1;
+	case FN:
+	case SPECFORM:
+		/* aot_main makes sure it's still there */
+		add_word(&load, LOAD_FN);
+		add_word(&load, add_string(AS_FN(obj)->fnname, strlen(AS_FN(obj)->fnname)));
+		return 1;
+	case GLOBALREF: {
+		_Bool ok = load_obj((struct obj *)AS_GLOBAL_REF(obj)->name, NULL);
+		add_word(&load, LOAD_GLOBALREF);
+		return ok;
+	}
+	case LOCALREF: {
+		_Bool ok = load_obj((struct obj *)AS_LOCAL_REF(obj)->name, NULL);
+		add_word(&load, LOAD_LOCALREF);
+		add_word(&load, AS_LOCAL_REF(obj)->depth);
+		add_word(&load, AS_LOCAL_REF(obj)->slot);
+		return ok;
+	}
+	case SCOPE: {
+		_Bool ok = load_obj(AS_SCOPE(obj)->params, NULL);
+		add_word(&load, LOAD_SCOPE);
+		add_word(&load, (uint32_t)AS_SCOPE(obj)->nslots);
+		return ok;
+	}
+	case BYTECODE:
+		return load_bytecode(AS_BYTECODE(obj), name);
+	default:
+		break;
+	}
+	fputs("compile-to-c: can't write ", stderr);
+	print_on(stderr, obj, 0);
+	fputs(" into a C program\n", stderr);
+	/* keep aot_main's stack the right shape anyway */
+	add_word(&load, LOAD_NIL);
+	return 0;
+}
+
+void aot_begin(FILE *f, const char *source) {
+	out = f;
+	fputs("/* Compiled from ", out);
+	for (const char *c = source; *c; ++c) {
+		if (*c != '*' || c[1] != '/') fputc(*c, out);
+	}
+	fputs(" by llisp --compile-to-c */\n#include \"aot.h\"\n", out);
+}
+
+_Bool aot_add(struct obj *code) {
+	_Bool ok = load_obj(code, NULL);
+	add_word(&load, LOAD_RUN);
+	return ok;
+}
+
+static struct obj *run_bytecode(struct obj *code, struct env *env) {
+	struct contn *cur = make_empty_contn();
+	cur->env = env;
+	cur->data = code;
+	cur->fn = vm_run;
+	_Bool failed;
+	return trampoline(cur, code, &failed);
+}
+
+_Bool aot_add_form(struct obj *form, struct env *env) {
+	GC_PROTECT(env);
+	struct obj *expanded = macroexpand_cps(form, env);
+	if (!expanded) {
+		fputs("compile-to-c: couldn't expand ", stderr);
+		print_on(stderr, form, 0);
+		fputc('\n', stderr);
+		GC_UNPROTECT(1);
+		return 0;
+	}
+	GC_PROTECT(expanded);
+	struct obj *code = compile(expanded, env);
+	GC_PROTECT(code);
+	_Bool ok = aot_add(code);
+	struct obj *defmacro = intern_symbol(str_from_string_lit("defmacro"));
+	if (TYPE(expanded) == CELL && CAR(expanded) == defmacro) {
+		run_bytecode(code, env);
+	}
+	GC_UNPROTECT(3);
+	return ok;
+}
+
+static void write_words(const char *name, struct words *ws) {
+	fprintf(out, "\nstatic const uint32_t %s[] = {", name);
+	for (size_t i = 0; i < ws->len; ++i) {
+		fputs(i % 12 ? " " : "\n\t", out);
+		fprintf(out, "%" PRIu32 ",", ws->w[i]);
+	}
+	if (ws->len == 0) fputs("0", out);
+	fputs("\n};\n", out);
+}
+
+static void write_string(const struct aot_string *s) {
+	fputc('"', out);
+	for (size_t i = 0; i < s->len; ++i) {
+		unsigned char ch = (unsigned char)s->str[i];
+		/* no trigraphs or escapes that run into the next character */
+		if (ch < ' ' || ch > '~' || ch == '"' || ch == '\\' || ch == '?') {
+			fprintf(out, "\\%03o", ch);
+		} else {
+			fputc(ch, out);
+		}
+	}
+	fprintf(out, "\", %zu", s->len);
+}
+
+_Bool aot_finish(void) {
+	write_words("words", &code_words);
+	fputs("\nstatic const struct aot_string strings[] = {\n", out);
+	for (size_t i = 0; i < nstrings; ++i) {
+		fputs("\t{ ", out);
+		write_string(&strings[i]);
+		fputs(" },\n", out);
+	}
+	if (nstrings == 0) fputs("\t{ \"\", 0 },\n", out);
+	fputs("};\n\nstatic const struct aot_body bodies[] = {\n", out);
+	for (size_t i = 0; i < bodies.len; i += 4) {
+		fprintf(out, "\t{ words + %" PRIu32 ", %" PRIu32 ", %" PRIu32 ", %" PRIu32 ", { run_%zu } },\n",
+			bodies.w[i], bodies.w[i + 1], bodies.w[i + 2], bodies.w[i + 3], i / 4);
+	}
+	if (bodies.len == 0) fputs("\t{ words, 0, 0, 0, { NULL } },\n", out);
+	fputs("};\n", out);
+	write_words("load", &load);
+	fputs("\nstatic const struct aot_program program = { bodies, strings, load, sizeof(load) / sizeof(load[0]) };\n", out);
+	fputs("\nint main(void) {\n"
+		"\t/* make sure the GC scans everything in main */\n"
+		"\tvoid *bottom_of_stack = &bottom_of_stack;\n"
+		"\tgc_init(bottom_of_stack);\n"
+		"\treturn aot_main(&program);\n"
+		"}\n", out);
+	fflush(out);
+	if (ferror(out)) {
+		fputs("compile-to-c: error writing the program\n", stderr);
+		return 0;
+	}
+	return 1;
+}
+
+
+struct obj *(*aot_int_calls[AOT_NUM_INT_OPS])(FN_ARGS);
+
+uint32_t aot_call(struct vm *vm, struct obj ***top, uint32_t nargs, _Bool tail, uint32_t pc) {
+	uint32_t base = (uint32_t)(*top - vm->stack) - nargs - 1;
+	struct obj *fn = vm->stack[base];
+	if (TYPE(fn) == FN) {
+		struct obj *result;
+		if (!vm_call_builtin(vm, base, nargs, tail, pc, &result, &vm->leave_to)) {
+			vm->leaving = result;
+			return NATIVE_LEAVE;
+		}
+		*top = vm->stack + base;
+		*(*top)++ = result;
+		return AOT_CAME_BACK;
+	}
+	if (TYPE(fn) != LAMBDA || TYPE(AS_CLOSURE(fn)->code) != BYTECODE) {
+		/* the interpreter can make the call */
+		return pc - op_words[OP_CALL];
+	}
+	if (!vm_enter(vm, base, nargs, tail, pc)) {
+		vm->leaving = NIL;
+		vm->leave_to = &cfail;
+		return NATIVE_LEAVE;
+	}
+	*top = vm->stack;
+	return NATIVE_SWITCHED | 0;
+}
+
+uint32_t aot_return(struct vm *vm, struct obj ***top) {
+	struct obj *val = *--*top;
+	uint32_t sp, pc;
+	if (!vm_return(vm, val, &sp, &pc)) {
+		vm->leaving = val;
+		vm->leave_to = vm->next;
+		return NATIVE_LEAVE;
+	}
+	*top = vm->stack + sp;
+	return NATIVE_SWITCHED | pc;
+}
+
+static struct obj *pop(struct obj **stack) {
+	struct obj *top = CAR(*stack);
+	*stack = CDR(*stack);
+	return top;
+}
+
+static uint64_t load_u64(const uint32_t *w) {
+	return (uint64_t)w[0] << 32 | w[1];
+}
+
+static struct obj *load_str(const struct aot_program *program, uint32_t i) {
+	const struct aot_string *s = &program->strings[i];
+	return (struct obj *)make_str_from_ptr_len(s->str, s->len);
+}
+
+/* Follow the program's instructions. See enum aot_load_op. */
+static void load_program(const struct aot_program *program, struct env *globals) {
+	struct obj *stack = NIL;
+	GC_PROTECT(stack);
+	const uint32_t *w = program->load, *end = w + program->load_len;
+	while (w < end) {
+		struct obj *val = NULL;
+		switch (*w++) {
+		case LOAD_NIL:
+			val = NIL;
+			break;
+		case LOAD_TRUE:
+			val = TRUE;
+			break;
+		case LOAD_FALSE:
+			val = FALSE;
+			break;
+		case LOAD_INT:
+			val = make_int((int64_t)load_u64(w));
+			w += 2;
+			break;
+		case LOAD_DOUBLE: {
+			union { uint64_t bits; double d; } u = { load_u64(w) };
+			val = make_num(u.d);
+			w += 2;
+			break;
+		}
+		case LOAD_SYMBOL:
+			val = intern_symbol(AS_STRING(load_str(program, *w++)));
+			break;
+		case LOAD_STRING:
+			val = load_str(program, *w++);
+			break;
+		case LOAD_FN: {
+			const struct aot_string *name = &program->strings[*w];
+			val = getsym(globals, AS_SYMBOL(intern_symbol(AS_STRING(load_str(program, *w++)))));
+			if (!val || (TYPE(val) != FN && TYPE(val) != SPECFORM) ||
+				strlen(AS_FN(val)->fnname) != name->len || memcmp(AS_FN(val)->fnname, name->str, name->len) != 0) {
+				fprintf(stderr, "Builtin \"%.*s\" has been redefined\n", (int)name->len, name->str);
+				abort();
+			}
+			break;
+		}
+		case LOAD_CONS:
+			val = cons(CAR(CDR(stack)), CAR(stack));
+			stack = CDR(CDR(stack));
+			break;
+		case LOAD_GLOBALREF:
+			val = make_global_ref(AS_SYMBOL(CAR(stack)));
+			pop(&stack);
+			break;
+		case LOAD_LOCALREF:
+			val = make_local_ref(AS_SYMBOL(CAR(stack)), w[0], w[1]);
+			pop(&stack);
+			w += 2;
+			break;
+		case LOAD_SCOPE:
+			val = make_scope(CAR(stack), *w++);
+			pop(&stack);
+			break;
+		case LOAD_BYTECODE: {
+			const struct aot_body *body = &program->bodies[*w++];
+			size_t size = offsetof(struct bytecode, consts) + body->nconsts * sizeof(struct obj *) + body->len * sizeof(uint32_t);
+			struct bytecode *code = AS_BYTECODE(gc_alloc(BYTECODE, size));
+			code->nconsts = body->nconsts;
+			code->len = body->len;
+			code->maxstack = body->maxstack;
+			code->calls = 0;
+			code->native = &body->native;
+			for (uint32_t k = body->nconsts; k--; ) {
+				code->consts[k] = pop(&stack);
+			}
+			code->scope = pop(&stack);
+			memcpy(BYTECODE_WORDS(code), body->words, body->len * sizeof(uint32_t));
+			val = (struct obj *)code;
+			break;
+		}
+		case LOAD_RUN:
+			run_bytecode(pop(&stack), globals);
+			continue;
+		default:
+			abort();
+		}
+		stack = cons(val, stack);
+	}
+	GC_UNPROTECT(1);
+}
+
+_declspec(noinline)
+int aot_main(const struct aot_program *program) {
+	char *threads = getenv("LLISP_GC_THREADS");
+	if (threads) {
+		gc_set_mark_threads(strtoul(threads, NULL, 10));
+	}
+	use_vm = 1;
+
+	struct env *globals = make_env(NULL);
+	GC_PROTECT(globals);
+	add_globals(globals);
+	for (int i = 0; i < AOT_NUM_INT_OPS; ++i) {
+		struct obj *fn = getsym(globals, AS_SYMBOL(intern_symbol(make_str_from_ptr_len(int_ops[i].name, strlen(int_ops[i].name)))));
+		if (fn && TYPE(fn) == FN) aot_int_calls[i] = AS_FN(fn)->call;
+	}
+	load_program(program, globals);
+	GC_UNPROTECT(1);
+	return 0;
+}
@@ -0,0 +1,184 @@
+#pragma once
+#include <stdio.h>
+#include "bytecode.h"
+#include "env-private.h"
+#include "obj.h"
+#include "vm-private.h"
+
+/*
+ * Compiling a program to C ahead of time (--compile-to-c). See aot.c.
+ */
+
+/* Whether we're writing a C program instead of running one. run_cps still runs
+ * what it's given (the stdlib), but also hands its bytecode to aot_add. */
+extern _Bool compile_to_c;
+
+/* Start writing the C program for the llisp program `source' to `out' */
+void aot_begin(FILE *out, const char *source);
+/* Add some bytecode to run in the global environment */
+_Bool aot_add(struct obj *code);
+/* Add a top-level form from the program. It gets expanded and compiled, but
+ * only run if it's a `defmacro', since the forms after it may need it. */
+_Bool aot_add_form(struct obj *form, struct env *env);
+/* Write out the rest of the program. These all return 0 (having complained)
+ * if something couldn't be compiled or written. */
+_Bool aot_finish(void);
+
+
+/*
+ * The runtime for compiled programs. The generated C has a function for each
+ * bytecode body that does what execute would do with it, an instruction at a
+ * time, using the macros below. A compiled program is a struct aot_program.
+ */
+
+/* Instructions for aot_main, which builds each top-level form's bytecode on a
+ * stack and runs it. Operands are uint32_t like bytecode's. */
+enum aot_load_op {
+	/* push (), #t or #f */
+	LOAD_NIL,
+	LOAD_TRUE,
+	LOAD_FALSE,
+	/* hi lo: push the integer, or the double, with these 64 bits */
+	LOAD_INT,
+	LOAD_DOUBLE,
+	/* i: push strings[i] as a symbol or a string */
+	LOAD_SYMBOL,
+	LOAD_STRING,
+	/* i: push the builtin function or special form called strings[i] */
+	LOAD_FN,
+	/* pop the tail and then the head, and push (head . tail) */
+	LOAD_CONS,
+	/* pop a symbol and push a GLOBALREF to it */
+	LOAD_GLOBALREF,
+	/* depth slot: pop a symbol and push a LOCALREF to it */
+	LOAD_LOCALREF,
+	/* nslots: pop the parameters and push a SCOPE */
+	LOAD_SCOPE,
+	/* i: pop bodies[i]'s constants (the last one on top) and its scope, and
+	 * push the struct bytecode */
+	LOAD_BYTECODE,
+	/* pop a top-level form's bytecode and run it */
+	LOAD_RUN
+};
+
+struct aot_string {
+	const char *str;
+	size_t len;
+};
+
+/* A bytecode body's instructions, and its native code */
+struct aot_body {
+	const uint32_t *words;
+	uint32_t len;
+	uint32_t nconsts;
+	uint32_t maxstack;
+	struct native_code native;
+};
+
+struct aot_program {
+	const struct aot_body *bodies;
+	const struct aot_string *strings;
+	const uint32_t *load;
+	size_t load_len;
+};
+
+/* Run a compiled program. main has to call gc_init first. */
+int aot_main(const struct aot_program *program);
+
+/* OP_CALL and OP_RETURN. They return what the body has to return (see struct
+ * native_code), or AOT_CAME_BACK if a builtin came straight back with its value
+ * on the stack. */
+#define AOT_CAME_BACK (UINT32_MAX - 1)
+uint32_t aot_call(struct vm *vm, struct obj ***top, uint32_t nargs, _Bool tail, uint32_t pc);
+uint32_t aot_return(struct vm *vm, struct obj ***top);
+
+/* Builtins done inline when they get two fixnums, like the JIT does. Calls
+ * that look like they're to one of these (by name) check that the function
+ * really is the builtin, by the C function it calls. */
+enum aot_int_op {
+	AOT_ADD,
+	AOT_SUB,
+	AOT_EQ,
+	AOT_LT,
+	AOT_GT,
+	AOT_LE,
+	AOT_GE,
+	AOT_NUM_INT_OPS
+};
+extern struct obj *(*aot_int_calls[AOT_NUM_INT_OPS])(FN_ARGS);
+
+/* (op a b) with the function and its arguments on top of the stack, or NULL
+ * if it has to be called for real */
+static inline struct obj *aot_int_op(struct obj **top, enum aot_int_op op) {
+#ifdef IMMEDIATE_NUMS
+	struct obj *fn = top[-3];
+	if (!IS_INT(top[-2]) || !IS_INT(top[-1]) || TYPE(fn) != FN || AS_FN(fn)->call != aot_int_calls[op]) return NULL;
+	int64_t a = AS_INT(top[-2]), b = AS_INT(top[-1]);
+	switch (op) {
+	case AOT_ADD: return make_int(a + b);
+	case AOT_SUB: return make_int(a - b);
+	case AOT_EQ: return a == b ? TRUE : FALSE;
+	case AOT_LT: return a < b ? TRUE : FALSE;
+	case AOT_GT: return a > b ? TRUE : FALSE;
+	case AOT_LE: return a <= b ? TRUE : FALSE;
+	case AOT_GE: return a >= b ? TRUE : FALSE;
+	default: return NULL;
+	}
+#else
+	(void)top;
+	(void)op;
+	return NULL;
+#endif
+}
+
+static inline struct obj *aot_global(struct vm *vm, struct obj *ref) {
+	if (AS_GLOBAL_REF(ref)->epoch == global_epoch) return AS_GLOBAL_REF(ref)->value;
+	return getglobal(vm->env, AS_GLOBAL_REF(ref));
+}
+
+/* One for each instruction in bytecode.h. A body's function has `vm', `sp'
+ * (see struct native_code) and `top', the top of the stack. `pc' is the
+ * instruction to hand back to the interpreter if it's about to fail, or for
+ * calls the one after (like vm_enter's). */
+#define K(k) (vm->code->consts[k])
+#define AOT_EXIT(pc) do { *sp = top; return (pc); } while (0)
+#define AOT_CONST(k) (*top++ = K(k))
+#define AOT_LOCAL(depth, slot, pc) do { \
+		struct env *env_ = vm->env; \
+		for (uint32_t d_ = (depth); d_; --d_) env_ = env_->parent; \
+		if (!(*top = AS_FRAME(env_)->slots[slot])) AOT_EXIT(pc); \
+		++top; \
+	} while (0)
+#define AOT_GLOBAL(k, pc) do { \
+		if (!(*top = aot_global(vm, K(k)))) AOT_EXIT(pc); \
+		++top; \
+	} while (0)
+#define AOT_DEFINE(k) (vm_define(vm, K(k), top[-1]), top[-1] = NIL)
+#define AOT_SET(k, pc) do { \
+		if (!vm_set(vm, K(k), top[-1])) AOT_EXIT(pc); \
+		top[-1] = NIL; \
+	} while (0)
+#define AOT_CLOSURE(k) do { \
+		struct obj *closure_ = vm_closure(vm, K(k)); \
+		*top++ = closure_; \
+	} while (0)
+#define AOT_POP() (--top)
+#define AOT_JUMP_IF_FALSE(label) if (*--top == FALSE) goto label
+#define AOT_CALL(nargs, tail, pc) do { \
+		uint32_t next_ = aot_call(vm, &top, nargs, tail, pc); \
+		if (next_ != AOT_CAME_BACK) AOT_EXIT(next_); \
+	} while (0)
+/* A call with two arguments to what's probably the builtin for `op' */
+#define AOT_INT_CALL(op, tail, pc) do { \
+		struct obj *val_ = aot_int_op(top, op); \
+		if (val_) { \
+			top -= 2; \
+			top[-1] = val_; \
+		} else { \
+			AOT_CALL(2, tail, pc); \
+		} \
+	} while (0)
+#define AOT_RETURN() do { \
+		uint32_t next_ = aot_return(vm, &top); \
+		AOT_EXIT(next_); \
+	} while (0)
@@ -0,0 +1,43 @@
+#pragma once
+
+/* Instructions for the VM in vm.c. Each is one word followed by its operands,
+ * all uint32_t. `k' operands index the constants, and jump targets are counted
+ * in words from the start of the code. The VM keeps a stack of values; the
+ * comments say what each instruction does to it. */
+enum opcode {
+	/* k: push consts[k] */
+	OP_CONST,
+	/* depth slot k: push a variable from the current frames. consts[k] is its
+	 * LOCALREF, for the error message if it hasn't been defined yet */
+	OP_LOCAL,
+	/* k: push the global variable for consts[k], a GLOBALREF */
+	OP_GLOBAL,
+	/* k: bind consts[k] (a symbol or LOCALREF) to the top of the stack like
+	 * `define' or `set!' would, and replace it with () */
+	OP_DEFINE,
+	OP_SET,
+	/* k: push a new closure over the current frame for the bytecode consts[k] */
+	OP_CLOSURE,
+	/* throw away the top of the stack */
+	OP_POP,
+	/* target: go to target */
+	OP_JUMP,
+	/* target: pop, and go to target if it was #f */
+	OP_JUMP_IF_FALSE,
+	/* n: pop n arguments and the function under them, call it and push the
+	 * result. The tail version is always followed by OP_RETURN, which it skips
+	 * by reusing the current continuation when it can */
+	OP_CALL,
+	OP_TAIL_CALL,
+	/* pop a value and give it to the current continuation */
+	OP_RETURN,
+	/* k: hand the form consts[k] to eval_cps and push what it comes back with,
+	 * or just return it if the next instruction is OP_RETURN. For anything the
+	 * compiler doesn't understand (e.g. errors, `defmacro') */
+	OP_EVAL,
+	NUM_OPCODES
+};
+
+/* No bytecode needs more stack than this. compile.c falls back to OP_EVAL
+ * for calls with too many arguments. */
+#define VM_STACK_SIZE 256
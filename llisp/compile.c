@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bytecode.h"
+#include "gc.h"
+#include "globals.h"
+#include "obj.h"
+#include "vm.h"
+
+/* One lambda body (or top-level form) being compiled. The code goes in a
+ * malloc'd buffer until we know how big the struct bytecode has to be. */
+struct compiler {
+	/* Only used to recognize special forms */
+	struct env *env;
+	/* in reverse order, registered as a root */
+	struct obj *consts;
+	uint32_t nconsts;
+	uint32_t *code;
+	uint32_t len, cap;
+	/* how much stack the code so far leaves behind, and the most it ever used */
+	uint32_t depth, maxdepth;
+};
+
+static void compile_expr(struct compiler *c, struct obj *obj, _Bool tail);
+
+static void emit(struct compiler *c, uint32_t word) {
+	if (c->len == c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 16;
+		c->code = realloc(c->code, c->cap * sizeof(*c->code));
+		if (!c->code) {
+			fputs("Out of memory\n", stderr);
+			abort();
+		}
+	}
+	c->code[c->len++] = word;
+}
+
+static void grow(struct compiler *c, int n) {
+	c->depth += n;
+	if (c->depth > c->maxdepth) c->maxdepth = c->depth;
+}
+
+/* Index of obj in the constants, adding it if it isn't there yet */
+static uint32_t add_const(struct compiler *c, struct obj *obj) {
+	uint32_t i = c->nconsts;
+	for (struct obj *cur = c->consts; cur != NIL; cur = CDR(cur)) {
+		--i;
+		if (CAR(cur) == obj) return i;
+	}
+	c->consts = cons(obj, c->consts);
+	return c->nconsts++;
+}
+
+static void emit_const(struct compiler *c, struct obj *obj) {
+	emit(c, OP_CONST);
+	emit(c, add_const(c, obj));
+	grow(c, 1);
+}
+
+/* Let eval_cps deal with it */
+static void emit_eval(struct compiler *c, struct obj *obj) {
+	emit(c, OP_EVAL);
+	emit(c, add_const(c, obj));
+	grow(c, 1);
+}
+
+static struct obj *finish(struct compiler *c, struct obj *scope) {
+	GC_PROTECT(scope);
+	size_t size = offsetof(struct bytecode, consts) + c->nconsts * sizeof(struct obj *) + c->len * sizeof(uint32_t);
+	struct bytecode *ret = AS_BYTECODE(gc_alloc(BYTECODE, size));
+	GC_UNPROTECT(1);
+	ret->scope = scope;
+	ret->nconsts = c->nconsts;
+	ret->len = c->len;
+	ret->maxstack = c->maxdepth;
+	ret->calls = 0;
+	ret->native = NULL;
+	uint32_t i = c->nconsts;
+	for (struct obj *cur = c->consts; cur != NIL; cur = CDR(cur)) {
+		ret->consts[--i] = CAR(cur);
+	}
+	memcpy(BYTECODE_WORDS(ret), c->code, c->len * sizeof(uint32_t));
+	free(c->code);
+	return (struct obj *)ret;
+}
+
+/* body is a non-empty list of forms. Returns its struct bytecode. */
+static struct obj *compile_body(struct obj *scope, struct obj *body, struct env *env) {
+	struct compiler c = { env, NIL, 0, NULL, 0, 0, 0, 0 };
+	GC_PROTECT(scope);
+	GC_PROTECT(body);
+	GC_PROTECT(c.consts);
+	for (; TYPE(CDR(body)) == CELL; body = CDR(body)) {
+		compile_expr(&c, CAR(body), 0);
+		emit(&c, OP_POP);
+		grow(&c, -1);
+	}
+	compile_expr(&c, CAR(body), 1);
+	emit(&c, OP_RETURN);
+	grow(&c, -1);
+	struct obj *ret = finish(&c, scope);
+	GC_UNPROTECT(3);
+	return ret;
+}
+
+static void emit_closure(struct compiler *c, struct obj *scope, struct obj *body) {
+	struct obj *code = compile_body(scope, body, c->env);
+	GC_PROTECT(code);
+	emit(c, OP_CLOSURE);
+	emit(c, add_const(c, code));
+	GC_UNPROTECT(1);
+	grow(c, 1);
+}
+
+/* (if cond then [else]) */
+static void compile_if(struct compiler *c, struct obj *args, _Bool tail) {
+	GC_PROTECT(args);
+	compile_expr(c, CAR(args), 0);
+	emit(c, OP_JUMP_IF_FALSE);
+	uint32_t to_else = c->len;
+	emit(c, 0);
+	grow(c, -1);
+
+	compile_expr(c, CAR(CDR(args)), tail);
+	grow(c, -1);
+	uint32_t to_end = 0;
+	if (tail) {
+		emit(c, OP_RETURN);
+	} else {
+		emit(c, OP_JUMP);
+		to_end = c->len;
+		emit(c, 0);
+	}
+
+	c->code[to_else] = c->len;
+	if (CDR(CDR(args)) != NIL) {
+		compile_expr(c, CAR(CDR(CDR(args))), tail);
+	} else {
+		emit_const(c, FALSE);
+	}
+	if (!tail) c->code[to_end] = c->len;
+	GC_UNPROTECT(1);
+}
+
+static _Bool is_variable(struct obj *obj) {
+	return TYPE(obj) == SYMBOL || TYPE(obj) == LOCALREF;
+}
+
+/* Bind var to the value on top of the stack with OP_DEFINE or OP_SET */
+static void emit_binding(struct compiler *c, enum opcode op, struct obj *var) {
+	emit(c, op);
+	emit(c, add_const(c, var));
+}
+
+static void compile_form(struct compiler *c, struct obj *obj, _Bool tail) {
+	struct obj *head = CAR(obj);
+	struct obj *args = CDR(obj);
+	struct obj *headval = TYPE(head) == SYMBOL ? getsym(c->env, AS_SYMBOL(head)) : NULL;
+	int nargs = length(args);
+	if (nargs < 0) {
+		emit_eval(c, obj);
+		return;
+	}
+	GC_PROTECT(obj);
+	if (is_real_quote(head, c->env) && nargs == 1) {
+		emit_const(c, CAR(args));
+	} else if (is_real_if(head, c->env) && (nargs == 2 || nargs == 3)) {
+		compile_if(c, args, tail);
+	} else if (is_real_lambda(head, c->env) && nargs >= 2 && TYPE(CAR(args)) == SCOPE) {
+		emit_closure(c, CAR(args), CDR(args));
+	} else if (is_real_define(head, c->env) && nargs >= 2 && TYPE(CAR(args)) == CELL &&
+		is_variable(CAR(CAR(args))) && TYPE(CDR(CAR(args))) == SCOPE) {
+		/* (define (name . <scope>) . body) */
+		emit_closure(c, CDR(CAR(args)), CDR(args));
+		args = CDR(obj);
+		emit_binding(c, OP_DEFINE, CAR(CAR(args)));
+	} else if ((is_real_define(head, c->env) || is_real_set(head, c->env)) && nargs == 2 && is_variable(CAR(args))) {
+		enum opcode op = is_real_define(head, c->env) ? OP_DEFINE : OP_SET;
+		compile_expr(c, CAR(CDR(args)), 0);
+		args = CDR(obj);
+		emit_binding(c, op, CAR(args));
+	} else if (headval && (TYPE(headval) == SPECFORM || TYPE(headval) == MACRO)) {
+		/* `defmacro', or a special form used wrong */
+		emit_eval(c, obj);
+	} else if (c->depth + nargs + 1 > VM_STACK_SIZE) {
+		emit_eval(c, obj);
+	} else {
+		/* application */
+		compile_expr(c, head, 0);
+		args = CDR(obj);
+		GC_PROTECT(args);
+		for (; args != NIL; args = CDR(args)) {
+			compile_expr(c, CAR(args), 0);
+		}
+		GC_UNPROTECT(1);
+		emit(c, tail ? OP_TAIL_CALL : OP_CALL);
+		emit(c, (uint32_t)nargs);
+		grow(c, -nargs);
+	}
+	GC_UNPROTECT(1);
+}
+
+static void compile_expr(struct compiler *c, struct obj *obj, _Bool tail) {
+	switch (TYPE(obj)) {
+	default:
+		/* eval_cps will complain about it */
+		emit_eval(c, obj);
+		return;
+	case BUILTIN:
+	case NUM:
+	case SPECFORM:
+	case FN:
+	case LAMBDA:
+	case MACRO:
+	case STRING:
+	case CONTN:
+		emit_const(c, obj);
+		return;
+	case SYMBOL:
+		/* the expander leaves the names of special forms and macros alone */
+		obj = make_global_ref(AS_SYMBOL(obj));
+		/* fall through */
+	case GLOBALREF:
+		GC_PROTECT(obj);
+		emit(c, OP_GLOBAL);
+		emit(c, add_const(c, obj));
+		GC_UNPROTECT(1);
+		grow(c, 1);
+		return;
+	case LOCALREF:
+		GC_PROTECT(obj);
+		emit(c, OP_LOCAL);
+		emit(c, AS_LOCAL_REF(obj)->depth);
+		emit(c, AS_LOCAL_REF(obj)->slot);
+		emit(c, add_const(c, obj));
+		GC_UNPROTECT(1);
+		grow(c, 1);
+		return;
+	case CELL:
+		compile_form(c, obj, tail);
+		return;
+	}
+}
+
+struct obj *compile(struct obj *obj, struct env *env) {
+	GC_PROTECT(env);
+	struct obj *body = cons(obj, NIL);
+	struct obj *ret = compile_body(NIL, body, env);
+	GC_UNPROTECT(1);
+	return ret;
+}
@@ -3,14 +3,135 @@
 #include <stdlib.h>
 #include <string.h>
 #include "cps.h"
+#include "env-private.h"
 #include "gc.h"
+#include "globals.h"
 #include "macroexpander.h"
 #include "obj.h"
 #include "print.h"
+#include "vm.h"
+
+/*
+ * The control stack. Nearly every continuation is finished with as soon as
+ * something returns to the one before it, so instead of the heap they live in a
+ * stack of segments and get popped when control goes back to an older one. A
+ * full segment just links to a new one, and every so often the stack is squeezed
+ * to get rid of what tail calls leave behind (see squeeze). The only way to keep
+ * a continuation any longer is call/cc, which copies it and the rest of the
+ * chain into the heap (see capture_contn). That means a continuation on the
+ * stack is only ever pointed at by newer ones, by the trampoline and by the step
+ * it's running.
+ *
+ * The collector sees them as off-heap objects. Each step only fills in the
+ * continuations it made itself, so a minor collection only has to look at the
+ * ones made since the step that was running during the last one started.
+ */
+#define SEGMENT_CONTNS 2048
+struct segment {
+	struct segment *prev;
+	/* how many continuations are under this segment */
+	size_t bottom;
+	struct contn contns[SEGMENT_CONTNS];
+};
+static struct segment *spare_segment = NULL;
+/* The newest segment and where the next continuation in it goes */
+static struct segment *top_seg = NULL;
+static struct contn *top = NULL;
+/* Places on the stack are counted in continuations from the bottom.
+ * The current trampoline never pops below here */
+static size_t base = 0;
+/* How high the stack was when the current step started */
+static size_t step_start = 0;
+/* Continuations below here haven't changed since a minor collection last saw them */
+static size_t scanned = 0;
+
+static size_t height() {
+	return top_seg ? top_seg->bottom + (size_t)(top - top_seg->contns) : 0;
+}
+
+static void each_stack_contn(_Bool all, void (*visit)(struct obj *o, void *ctx), void *ctx) {
+	size_t from = all ? 0 : scanned;
+	for (struct segment *seg = top_seg; seg; seg = seg->prev) {
+		struct contn *end = seg == top_seg ? top : seg->contns + SEGMENT_CONTNS;
+		struct contn *start = seg->contns + (from > seg->bottom ? from - seg->bottom : 0);
+		for (struct contn *c = start; c < end; ++c) {
+			visit(&c->o, ctx);
+		}
+		if (from >= seg->bottom) break;
+	}
+	if (!all) scanned = step_start;
+}
+
+static struct segment *new_segment() {
+	struct segment *seg = spare_segment;
+	spare_segment = NULL;
+	if (!seg) {
+		seg = malloc(sizeof(*seg));
+		if (!seg) {
+			fputs("Out of memory\n", stderr);
+			abort();
+		}
+	}
+	if (!top_seg) {
+		gc_set_off_heap_objects(each_stack_contn);
+	}
+	seg->prev = top_seg;
+	seg->bottom = top_seg ? top_seg->bottom + SEGMENT_CONTNS : 0;
+	return seg;
+}
+
+/* The segment holding `c', looking down from `seg' but not below `floor' */
+static struct segment *segment_of(struct contn *c, struct segment *seg, size_t floor) {
+	for (; seg && seg->bottom + SEGMENT_CONTNS > floor; seg = seg->prev) {
+		if (c >= seg->contns && c < seg->contns + SEGMENT_CONTNS) {
+			assert(seg != top_seg || c < top);
+			return seg->bottom + (size_t)(c - seg->contns) >= floor ? seg : NULL;
+		}
+	}
+	return NULL;
+}
+
+/* How high the stack is up to and including `c', or 0 if `c' isn't on the stack
+ * above `floor' (e.g. it's in the heap or it's cend or cfail) */
+static size_t height_of(struct contn *c, size_t floor) {
+	struct segment *seg = segment_of(c, top_seg, floor);
+	return seg ? seg->bottom + (size_t)(c - seg->contns) + 1 : 0;
+}
+
+static void pop_to(size_t h) {
+	while (top_seg && h < top_seg->bottom) {
+		struct segment *seg = top_seg;
+		top_seg = seg->prev;
+		free(spare_segment);
+		spare_segment = seg;
+	}
+	top = top_seg ? top_seg->contns + (h - top_seg->bottom) : NULL;
+	if (scanned > h) scanned = h;
+	if (step_start > h) step_start = h;
+}
+
+void pop_contns(struct contn *live) {
+	/* Usually `live' is in the top segment and nothing needs freeing */
+	if (top_seg && live >= top_seg->contns && live < top) {
+		size_t h = top_seg->bottom + (size_t)(live - top_seg->contns) + 1;
+		if (h > base) {
+			top = live + 1;
+			if (scanned > h) scanned = h;
+			if (step_start > h) step_start = h;
+			return;
+		}
+	}
+	size_t h = height_of(live, base);
+	pop_to(h ? h : base);
+}
 
 struct contn *make_empty_contn() {
-	struct contn *ret = (struct contn *)gc_alloc(CONTN, sizeof(*ret));
-	ret->next = &cend;
+	if (!top_seg || top == top_seg->contns + SEGMENT_CONTNS) {
+		top_seg = new_segment();
+		top = top_seg->contns;
+	}
+	struct contn *ret = top++;
+	*ret = (struct contn) { .o.type = CONTN, .next = &cend };
 	return ret;
 }
 
@@ -20,6 +141,86 @@ struct contn *dupcontn(struct contn *c) {
 	return ret;
 }
 
+/* The segment on top of `seg' */
+static struct segment *segment_above(struct segment *seg) {
+	struct segment *above = top_seg;
+	while (above->prev != seg) {
+		above = above->prev;
+	}
+	return above;
+}
+
+/* Squeeze the stack once it gets this high */
+static size_t squeeze_at = SEGMENT_CONTNS;
+
+/*
+ * A tail call leaves the continuations of the step that made it under the ones
+ * it makes, and nothing can pop them since the new ones are newer. Every so
+ * often, move the ones `cur' still needs down over the dead ones so loops run in
+ * constant space. Returns where `cur' ended up.
+ */
+static struct contn *squeeze(struct contn *cur) {
+	static struct contn **live = NULL;
+	static size_t cap = 0;
+	size_t n = 0;
+	struct segment *seg = top_seg;
+	struct contn *c = cur;
+	while ((seg = segment_of(c, seg, base)) != NULL) {
+		if (n == cap) {
+			cap = cap ? cap * 2 : 256;
+			live = realloc(live, cap * sizeof(*live));
+			if (!live) {
+				fputs("Out of memory\n", stderr);
+				abort();
+			}
+		}
+		live[n++] = c;
+		c = c->next;
+	}
+	/* Everything else above the base is dead */
+	size_t to = base;
+	if (scanned > to) scanned = to;
+	for (seg = top_seg; seg && seg->bottom > to; seg = seg->prev);
+	struct contn *at = seg ? seg->contns + (to - seg->bottom) : NULL;
+	/* Each one moves down, so the oldest can go first without clobbering the others */
+	while (n--) {
+		if (at == seg->contns + SEGMENT_CONTNS) {
+			seg = segment_above(seg);
+			at = seg->contns;
+		}
+		if (at != live[n]) {
+			*at = *live[n];
+		}
+		at->next = c;
+		c = at++;
+		++to;
+	}
+	pop_to(to);
+	squeeze_at = to + (to - base) + SEGMENT_CONTNS;
+	return c;
+}
+
+struct contn *capture_contn(struct contn *c) {
+	struct contn *ret = c;
+	struct contn *last = NULL;
+	GC_PROTECT(ret);
+	GC_PROTECT(last);
+	while (height_of(c, 0)) {
+		struct contn *copy = (struct contn *)gc_alloc(CONTN, sizeof(*copy));
+		memcpy(&copy->data, &c->data, sizeof(*copy) - offsetof(struct contn, data));
+		if (last) {
+			gc_write_barrier(last);
+			last->next = copy;
+		} else {
+			ret = copy;
+		}
+		last = copy;
+		c = c->next;
+	}
+	GC_UNPROTECT(2);
+	return ret;
+}
+
 static int is_callable(enum objtype type) {
 	return type == MACRO ||
 		type == LAMBDA ||
@@ -28,8 +229,8 @@ static int is_callable(enum objtype type) {
 		type == CONTN;
 }
 
-struct contn cend = { NULL };
-struct contn cfail = { NULL };
+struct contn cend = { 0 };
+struct contn cfail = { 0 };
 
 /* Eval an object */
 struct obj *eval_cps(CPS_ARGS);
@@ -46,6 +247,10 @@ static struct obj *evallist_cons(CPS_ARGS);
 
 static struct obj *run_closure(CPS_ARGS);
 
+/* How many arguments to a builtin can go in a C array instead of the heap */
+#define LOCAL_ARGS 8
+static struct obj *call_local_args(struct contn *self, struct fn *fn, int argc, struct obj **argv, struct contn **ret);
+
 _Bool direct_eval(struct obj *obj, struct env *env, struct obj **result) {
 	if (!result) return 0;
 	switch (TYPE(obj)) {
@@ -69,6 +274,22 @@ _Bool direct_eval(struct obj *obj, struct env *env, struct obj **result) {
 		*result = value;
 		return 1;
 	}
+	case LOCALREF: {
+		struct obj *value = getslot(env, AS_LOCAL_REF(obj));
+		if (value == NULL) {
+			return 0;
+		}
+		*result = value;
+		return 1;
+	}
+	case GLOBALREF: {
+		struct obj *value = getglobal(env, AS_GLOBAL_REF(obj));
+		if (value == NULL) {
+			return 0;
+		}
+		*result = value;
+		return 1;
+	}
 	case CELL:
 		return 0;
 	}
@@ -91,11 +312,24 @@ struct obj *eval_cps(CPS_ARGS) {
 	case CONTN:
 		*ret = self->next;
 		return obj;
-	case SYMBOL: {
-		struct obj *value = getsym(self->env, AS_SYMBOL(obj));
+	case SYMBOL:
+	case LOCALREF:
+	case GLOBALREF: {
+		struct obj *value;
+		struct string *name;
+		if (TYPE(obj) == SYMBOL) {
+			value = getsym(self->env, AS_SYMBOL(obj));
+			name = AS_SYMBOL(obj);
+		} else if (TYPE(obj) == LOCALREF) {
+			value = getslot(self->env, AS_LOCAL_REF(obj));
+			name = AS_LOCAL_REF(obj)->name;
+		} else {
+			value = getglobal(self->env, AS_GLOBAL_REF(obj));
+			name = AS_GLOBAL_REF(obj)->name;
+		}
 		if (value == NULL) {
 			fputs("eval: unknown symbol \"", stderr);
-			print_str_escaped(stderr, AS_SYMBOL(obj));
+			print_str_escaped(stderr, name);
 			fputs("\"\n", stderr);
 			*ret = &cfail;
 			return NIL;
@@ -121,7 +355,9 @@ struct obj *eval_cps(CPS_ARGS) {
 		}
 
 		/* direct evaluation failed - eval obj->head */
+		GC_PROTECT(doapply);
 		*ret = dupcontn(self);
+		GC_UNPROTECT(1);
 		(*ret)->next = doapply;
 		return CAR(obj);
 	}
@@ -139,11 +375,30 @@ static struct obj *eval_doapply(CPS_ARGS) {
 		return NIL;
 	}
 
+	if (TYPE(obj) == FN) {
+		/* If all the arguments can be evaluated right away, there's no need
+		 * for a list of them */
+		struct obj *argv[LOCAL_ARGS];
+		int argc = 0;
+		struct obj *args = CDR(self->data);
+		for (; args != NIL && argc < LOCAL_ARGS; args = CDR(args)) {
+			if (!direct_eval(CAR(args), self->env, &argv[argc])) break;
+			++argc;
+		}
+		if (args == NIL) {
+			return call_local_args(self, AS_FN(obj), argc, argv, ret);
+		}
+	}
+
 	struct contn *appcnt = dupcontn(self);
+	GC_PROTECT(appcnt);
 	if (TYPE(obj) == CONTN) {
 		appcnt->data = obj;
 		appcnt->fn = apply_contn;
-	} else if (TYPE(obj) == FN || TYPE(obj) == SPECFORM) {
+	} else if (TYPE(obj) == FN) {
+		appcnt->data = obj;
+		appcnt->fn = apply_fn;
+	} else if (TYPE(obj) == SPECFORM) {
 		/* Just call the function */
 		appcnt->data = NIL;
 		appcnt->fn = AS_FN(obj)->fn;
@@ -165,13 +420,16 @@ static struct obj *eval_doapply(CPS_ARGS) {
 		if (TYPE(obj) == MACRO) {
 			fputs("apply: warning: applying a macro. This is now unexpected.\n", stderr);
 
-			/* expand the macro in place and reeval afterwards */
+			/* expand the macro in place and reeval afterwards. appcnt has to be
+			 * newer than the continuation it goes on to, so make another one. */
 			struct contn *expand = dupcontn(self);
 			expand->fn = eval_macroreeval;
-			appcnt->next = expand;
+			*ret = dupcontn(appcnt);
+			(*ret)->next = expand;
 		}
 	}
 
+	GC_UNPROTECT(1);
 	return CDR(self->data);
 }
 
@@ -210,7 +468,9 @@ static struct obj *evallist(CPS_ARGS) {
 		return result;
 	}
 
+	GC_PROTECT(tailcons);
 	*ret = dupcontn(self);
+	GC_UNPROTECT(1);
 	(*ret)->next = tailcons;
 	(*ret)->fn = eval_cps;
 	return CAR(obj);
@@ -221,7 +481,9 @@ static struct obj *evallist_tailcons(CPS_ARGS) {
 	docons->data = obj;
 	docons->fn = evallist_cons;
 
+	GC_PROTECT(docons);
 	*ret = dupcontn(self);
+	GC_UNPROTECT(1);
 	(*ret)->data = NIL;
 	(*ret)->next = docons;
 	(*ret)->fn = evallist;
@@ -239,12 +501,30 @@ struct obj *apply_closure(CPS_ARGS) {
 	/* set up environment */
 	assert(TYPE(self->data) == LAMBDA || TYPE(self->data) == MACRO);
 	struct closure *cdata = AS_CLOSURE(self->data);
-	struct env *appenv = make_env(cdata->env);
-	struct obj *params = cdata->args;
+	GC_PROTECT(cdata);
+	/* Expanded lambdas keep their variables in a frame, if they have any */
+	struct scope *scope = TYPE(cdata->args) == SCOPE ? AS_SCOPE(cdata->args) : NULL;
+	struct env *appenv;
+	if (!scope) {
+		appenv = make_env(cdata->env);
+	} else if (scope->nslots != 0) {
+		appenv = make_frame(cdata->env, scope->nslots);
+	} else {
+		appenv = cdata->env;
+	}
+	GC_PROTECT(appenv);
+	struct obj *params = scope ? AS_SCOPE(cdata->args)->params : cdata->args;
+	GC_PROTECT(params);
+	GC_PROTECT(obj);
+	size_t slot = 0;
 	for (;;) {
 		if (params == NIL && obj == NIL) break;
 		if (TYPE(params) == SYMBOL) {
-			definesym(appenv, AS_SYMBOL(params), obj);
+			if (scope) {
+				initslot(appenv, slot, AS_SYMBOL(params), obj);
+			} else {
+				definesym(appenv, AS_SYMBOL(params), obj);
+			}
 			params = NIL;
 			break;
 		}
@@ -265,10 +545,15 @@ struct obj *apply_closure(CPS_ARGS) {
 				fputs("apply", stderr);
 			}
 			fputs(": too few arguments given\n", stderr);
+			GC_UNPROTECT(4);
 			*ret = &cfail;
 			return NIL;
 		}
-		definesym(appenv, AS_SYMBOL(CAR(params)), CAR(obj));
+		if (scope) {
+			initslot(appenv, slot++, AS_SYMBOL(CAR(params)), CAR(obj));
+		} else {
+			definesym(appenv, AS_SYMBOL(CAR(params)), CAR(obj));
+		}
 		params = CDR(params);
 		obj = CDR(obj);
 	}
@@ -276,7 +561,8 @@ struct obj *apply_closure(CPS_ARGS) {
 	*ret = dupcontn(self);
 	(*ret)->data = cdata->code;
 	(*ret)->env = appenv;
-	(*ret)->fn = run_closure;
+	(*ret)->fn = TYPE(cdata->code) == BYTECODE ? vm_run : run_closure;
+	GC_UNPROTECT(4);
 	return NIL;
 }
 
@@ -284,18 +570,75 @@ struct obj *apply_closure(CPS_ARGS) {
 static struct obj *run_closure(CPS_ARGS) {
 	(void)obj;
 
+	struct contn *next = self->next;
+	if (TYPE(CDR(self->data)) == CELL) {
+		/* more code to run after this... */
+		next = dupcontn(self);
+		next->data = CDR(self->data);
+	}
+
 	*ret = dupcontn(self);
 	(*ret)->data = NIL;
+	(*ret)->next = next;
 	(*ret)->fn = eval_cps;
 
-	if (TYPE(CDR(self->data)) == CELL) {
-		/* more code to run after this... */
-		struct contn *finish = dupcontn(self);
-		finish->data = CDR(self->data);
-		(*ret)->next = finish;
+	return CAR(self->data);
+}
+
+struct obj *call_fn(struct contn *self, struct fn *fn, int argc, struct obj **argv, struct contn **ret) {
+	if (argc < fn->min_args || (fn->max_args != ANY_ARGS && argc > fn->max_args)) {
+		if (fn->max_args == fn->min_args) {
+			fprintf(stderr, "%s: expected %d args, got %d\n", fn->fnname, fn->min_args, argc);
+		} else if (fn->max_args == ANY_ARGS) {
+			fprintf(stderr, "%s: expected at least %d args, got %d\n", fn->fnname, fn->min_args, argc);
+		} else if (fn->max_args == fn->min_args + 1) {
+			fprintf(stderr, "%s: expected %d or %d args, got %d\n", fn->fnname, fn->min_args, fn->max_args, argc);
+		} else {
+			fprintf(stderr, "%s: expected %d to %d args, got %d\n", fn->fnname, fn->min_args, fn->max_args, argc);
+		}
+		*ret = &cfail;
+		return NIL;
 	}
+	return fn->call(self, argc, argv, ret);
+}
 
-	return CAR(self->data);
+/* call_fn, with `argv' somewhere the collector can't see */
+static struct obj *call_local_args(struct contn *self, struct fn *fn, int argc, struct obj **argv, struct contn **ret) {
+	for (int i = 0; i < argc; ++i) {
+		GC_PROTECT(argv[i]);
+	}
+	struct obj *result = call_fn(self, fn, argc, argv, ret);
+	GC_UNPROTECT(argc);
+	return result;
+}
+
+/* obj = args, self->data = fn, return self->next(fn(args...)) */
+struct obj *apply_fn(CPS_ARGS) {
+	int argc = length(obj);
+	if (argc < 0) {
+		fprintf(stderr, "%s: args must be a proper list\n", AS_FN(self->data)->fnname);
+		*ret = &cfail;
+		return NIL;
+	}
+	if (argc <= LOCAL_ARGS) {
+		struct obj *argv[LOCAL_ARGS];
+		for (int i = 0; i < argc; ++i, obj = CDR(obj)) {
+			argv[i] = CAR(obj);
+		}
+		return call_local_args(self, AS_FN(self->data), argc, argv, ret);
+	}
+	/* Too many to keep here. A frame holds them just as well. */
+	GC_PROTECT(obj);
+	struct env *frame = make_frame(NULL, (size_t)argc);
+	GC_UNPROTECT(1);
+	struct obj **argv = AS_FRAME(frame)->slots;
+	for (int i = 0; i < argc; ++i, obj = CDR(obj)) {
+		argv[i] = CAR(obj);
+	}
+	GC_PROTECT(frame);
+	struct obj *result = call_fn(self, AS_FN(self->data), argc, argv, ret);
+	GC_UNPROTECT(1);
+	return result;
 }
 
 /* obj = args, self->data = contnp, return contnp(args) */
@@ -307,29 +650,68 @@ struct obj *apply_contn(CPS_ARGS) {
 	return CAR(obj);
 }
 
+struct obj *trampoline(struct contn *cur, struct obj *obj, _Bool *failed) {
+	struct contn *next = NULL;
+	GC_PROTECT(cur);
+	GC_PROTECT(obj);
+	GC_PROTECT(next);
+	/* We might be inside somebody else's step, so leave its continuations alone */
+	size_t outer_base = base;
+	size_t outer_step = step_start;
+	base = height();
+	size_t nroots = gc_nroots;
+	(void)nroots;
+	while (cur != &cend && cur != &cfail) {
+		/* Nothing newer than cur can be reached any more */
+		pop_contns(cur);
+		if (height() >= squeeze_at) {
+			cur = next = squeeze(cur);
+		}
+		step_start = height();
+		obj = cur->fn(cur, obj, &next);
+		assert(gc_nroots == nroots);
+		cur = next;
+		gc_step();
+	}
+	pop_to(base);
+	base = outer_base;
+	step_start = outer_step;
+	if (scanned > step_start) scanned = step_start;
+	GC_UNPROTECT(3);
+	*failed = cur == &cfail;
+	return obj;
+}
+
 struct obj *run_cps(struct obj *obj, struct env *env, _Bool* failed) {
+	GC_PROTECT(env);
 	// First macroexpand this puppy
 	obj = macroexpand_cps(obj, env);
 	if (!obj) {
+		GC_UNPROTECT(1);
 		return NULL;
 	}
 	// Now run it for real
+	if (use_vm) {
+		obj = compile(obj, env);
+	}
 	struct contn *cur = make_empty_contn();
 	cur->env = env;
 	cur->fn = eval_cps;
-	struct contn *next = NULL;
-	while (cur != &cend && cur != &cfail) {
-		obj = cur->fn(cur, obj, &next);
-		cur = next;
+	if (use_vm) {
+		cur->data = obj;
+		cur->fn = vm_run;
 	}
-	if (cur == &cfail) {
+	_Bool did_fail;
+	obj = trampoline(cur, obj, &did_fail);
+	GC_UNPROTECT(1);
+	if (did_fail) {
 		/* If we got `(obj)`, just return `obj`. */
 		if (TYPE(obj) == CELL && CDR(obj) == NIL) {
 			obj = CAR(obj);
 		}
 	}
 	if (failed != NULL) {
-		*failed = cur == &cfail;
+		*failed = did_fail;
 	}
 	return obj;
 }
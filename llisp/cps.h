@@ -8,6 +8,22 @@ struct obj *eval_cps(CPS_ARGS);
 struct obj* apply_closure(CPS_ARGS);
 /* Apply a continuation */
 struct obj* apply_contn(CPS_ARGS);
+/* Apply a builtin function (self->data) to a list of arguments */
+struct obj *apply_fn(CPS_ARGS);
+/* Call builtin function `fn', or complain if it can't take `argc' arguments.
+ * `argv' has to be safe from the collector already. */
+struct obj *call_fn(struct contn *self, struct fn *fn, int argc, struct obj **argv, struct contn **ret);
+
+/* Run cur(obj), and whatever continuation that goes on to, and so on until one
+ * gets to cend or cfail. Returns the final value. */
+struct obj *trampoline(struct contn *cur, struct obj *obj, _Bool *failed);
+/* Throw away every continuation on the control stack newer than `live', which
+ * the current step is done with. Only for code that keeps going without
+ * returning to the trampoline, like the VM. */
+void pop_contns(struct contn *live);
+/* A copy of `c' (and the continuations after it) that lives in the heap, so it
+ * can be kept around as a value */
+struct contn *capture_contn(struct contn *c);
 
 /* Evaluate obj in env in a continuation-passing style
  * Suitable for calling at the top-level outside of any other
@@ -8,3 +8,16 @@ struct env {
 	struct env *parent;
 	struct hashtab table;
 };
+
+/* The variables of one call to an expanded lambda, by slot. It goes anywhere a
+ * struct env can, and `parent' is in the same place. */
+struct frame {
+	struct obj o;
+	struct env *parent;
+	size_t nslots;
+	struct obj *slots[1];
+};
+#define AS_FRAME(o) ((struct frame*)(o))
+
+/* See "Global variable caches" in env.c */
+extern size_t global_epoch;
@@ -1,3 +1,4 @@
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,7 +7,9 @@
 #include "obj.h"
 
 struct env *make_env(struct env *parent) {
+	GC_PROTECT(parent);
 	struct env *ret = (struct env *) gc_alloc(ENV, sizeof(*ret));
+	GC_UNPROTECT(1);
 	ret->parent = parent;
 	init_hashtab(&ret->table);
 	return ret;
@@ -14,18 +17,45 @@ struct env *make_env(struct env *parent) {
 
 static void set_name_if_necessary(struct string *name, struct obj *value) {
 	if (value != NULL && (TYPE(value) == LAMBDA || TYPE(value) == MACRO) && !AS_CLOSURE(value)->closurename) {
+		gc_write_barrier(value);
 		AS_CLOSURE(value)->closurename = name;
 	}
 }
 
+static _Bool is_frame(struct env *env) {
+	return TYPE(&env->o) == FRAME;
+}
+
+/* Global variable caches
+ *
+ * A global_ref keeps the value it looked up last time along with the epoch it
+ * did so in. Every change to a binding in the global environment (the one with
+ * no parent) starts a new epoch, so a cached value is still right as long as
+ * the epoch is the same. We cache values rather than pointers into the table
+ * because a hash table's entries move when it grows.
+ *
+ * Expanded code only ever runs in frames on top of the global environment, so
+ * a value found there is the same for every use of the reference. Anything
+ * found some other way isn't cached. */
+size_t global_epoch = 1;
+
+static void changing_global(struct env *env) {
+	if (env->parent == NULL) ++global_epoch;
+}
+
 void definesym(struct env *env, struct string *name, struct obj *value) {
+	assert(TYPE(&name->o) == SYMBOL);
+	while (is_frame(env)) env = env->parent;
+	changing_global(env);
 	set_name_if_necessary(name, value);
 	hashtab_put(&env->table, name, value);
 }
 
 _Bool setsym(struct env *env, struct string *name, struct obj *value) {
 	for (; env != NULL; env = env->parent) {
+		if (is_frame(env)) continue;
 		if (hashtab_exists(&env->table, name)) {
+			changing_global(env);
 			set_name_if_necessary(name, value);
 			hashtab_put(&env->table, name, value);
 			return 1;
@@ -36,8 +66,63 @@ _Bool setsym(struct env *env, struct string *name, struct obj *value) {
 
 struct obj *getsym(struct env *env, struct string *name) {
 	for (; env != NULL; env = env->parent) {
+		if (is_frame(env)) continue;
 		struct obj *o = hashtab_get(&env->table, name);
 		if (o) return o;
 	}
 	return NULL;
 }
+
+struct obj *getglobal(struct env *env, struct global_ref *ref) {
+	if (ref->epoch == global_epoch) return ref->value;
+	while (is_frame(env)) env = env->parent;
+	struct obj *value = getsym(env, ref->name);
+	if (value && env->parent == NULL) {
+		gc_write_barrier(ref);
+		ref->value = value;
+		ref->epoch = global_epoch;
+	}
+	return value;
+}
+
+struct env *make_frame(struct env *parent, size_t nslots) {
+	GC_PROTECT(parent);
+	struct frame *ret = AS_FRAME(gc_alloc(FRAME, offsetof(struct frame, slots) + nslots * sizeof(struct obj *)));
+	GC_UNPROTECT(1);
+	ret->parent = parent;
+	ret->nslots = nslots;
+	return (struct env *)ret;
+}
+
+void initslot(struct env *frame, size_t slot, struct string *name, struct obj *value) {
+	assert(slot < AS_FRAME(frame)->nslots);
+	set_name_if_necessary(name, value);
+	AS_FRAME(frame)->slots[slot] = value;
+}
+
+static struct frame *frame_at(struct env *env, uint32_t depth) {
+	while (depth--) env = env->parent;
+	assert(is_frame(env));
+	return AS_FRAME(env);
+}
+
+void defineslot(struct env *env, struct local_ref *ref, struct obj *value) {
+	struct frame *frame = frame_at(env, ref->depth);
+	set_name_if_necessary(ref->name, value);
+	gc_write_barrier(frame);
+	frame->slots[ref->slot] = value;
+}
+
+_Bool setslot(struct env *env, struct local_ref *ref, struct obj *value) {
+	struct frame *frame = frame_at(env, ref->depth);
+	/* not defined yet */
+	if (!frame->slots[ref->slot]) return 0;
+	set_name_if_necessary(ref->name, value);
+	gc_write_barrier(frame);
+	frame->slots[ref->slot] = value;
+	return 1;
+}
+
+struct obj *getslot(struct env *env, struct local_ref *ref) {
+	return frame_at(env, ref->depth)->slots[ref->slot];
+}
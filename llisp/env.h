@@ -2,6 +2,8 @@
 #include <stdint.h>
 
 struct env;
+struct global_ref;
+struct local_ref;
 struct obj;
 struct string;
 
@@ -16,3 +18,14 @@ void definesym(struct env *env, struct string *name, struct obj *value);
  * Acts like (set! name value) */
 _Bool setsym(struct env *env, struct string *name, struct obj *value);
 struct obj *getsym(struct env *env, struct string *name);
+/* getsym for a reference in expanded code, which caches what it finds */
+struct obj *getglobal(struct env *env, struct global_ref *ref);
+
+/* Frames hold a lambda's variables by slot. The functions above skip them. */
+struct env *make_frame(struct env *parent, size_t nslots);
+/* Set a slot in a fresh frame, naming closures like definesym does */
+void initslot(struct env *frame, size_t slot, struct string *name, struct obj *value);
+/* The same as definesym, setsym and getsym for variables with a slot */
+void defineslot(struct env *env, struct local_ref *ref, struct obj *value);
+_Bool setslot(struct env *env, struct local_ref *ref, struct obj *value);
+struct obj *getslot(struct env *env, struct local_ref *ref);
@@ -1,138 +1,709 @@
 #include <assert.h>
+#include <math.h>
 #include <setjmp.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <xmmintrin.h>
 #include "cps.h"
 #include "env-private.h"
-#include "gc-private.h"
-#include "hashtab.h"
+#include "gc.h"
+#include "hashtab-private.h"
 #include "obj.h"
-#ifdef GC_STATS
 #include "perf.h"
-#endif
+#include "thread.h"
 
-static uintptr_t *all_allocations = NULL;
-static uintptr_t *all_allocations_end = NULL;
-static size_t all_allocations_capacity = 0;
-
-static uintptr_t* all_allocations_find_slot(uintptr_t ptr) {
-	if (all_allocations == all_allocations_end) return all_allocations;
-	if (ptr < all_allocations[0]) return all_allocations;
-	if (ptr > *(all_allocations_end - 1)) return all_allocations_end;
-	uintptr_t *min = all_allocations;
-	uintptr_t *max = all_allocations_end - 1;
-	while (min < max) {
-		uintptr_t *mid = min + (max - min) / 2;
-		if (ptr == *mid) {
-			return mid;
-		} else if (ptr < *mid) {
-			max = mid;
-		} else {
-			min = mid + 1;
+/* The heap is split into a young generation and an old generation.
+ *
+ * New objects are bump-allocated in the nursery, a contiguous run of pages. When
+ * it fills up we do a minor collection: everything reachable from the roots or
+ * from old objects that have been written to since the last minor collection is
+ * copied into the old generation and the nursery is reset. Old objects the roots
+ * point at count as written to, so code filling in a fresh object doesn't need
+ * to worry about it being promoted halfway through. Objects the roots point at
+ * directly don't move, since C code may have made copies of the pointer. They're
+ * pinned instead: they're promoted in place and later nursery allocation bumps
+ * around them.
+ *
+ * The roots are the variables registered with GC_PROTECT. Alternatively we can
+ * scan the C stack conservatively: anything on it that looks like a pointer into
+ * the heap counts. That's slower and keeps garbage alive through stale stack
+ * slots, but it doesn't rely on everything being registered.
+ *
+ * Old small objects live in PAGE_SIZE pages aligned to PAGE_SIZE. Every page holds
+ * objects of exactly one size class, so finding the page header for a pointer is
+ * a mask and checking whether it points at an object is a bit of arithmetic.
+ * The size classes go up in steps of 8 bytes through 64 so that cells, nums,
+ * continuations, environments and closures each get an exact fit.
+ *
+ * Anything bigger (long strings, hashtable arrays) goes in the large object space,
+ * where each object gets its own malloc block. Those are allocated directly in
+ * the old generation.
+ *
+ * The old generation is collected by mark and sweep. That can either happen all
+ * at once or, if there's a pause budget, in slices between evaluation steps. An
+ * incremental collection marks the snapshot of the heap as it was when marking
+ * started: the write barrier marks an old object before it gets changed, and
+ * anything promoted or allocated in the old generation while marking is in
+ * progress is marked right away. Objects allocated in a page the sweeper hasn't
+ * gotten to yet are marked too, so the sweeper doesn't free them.
+ *
+ * Mark bits don't live in the objects: each page points at a bitmap with a bit
+ * for every granule, kept off to the side with the rest of its chunk's bitmaps,
+ * and each large object has a mark word in its header. Marking only reads the
+ * objects it scans, and it works through an explicit stack rather than a list
+ * threaded through the objects, prefetching objects a few at a time as they come
+ * off the stack.
+ *
+ * Sweeping is lazy. Once marking is done, a size class that runs out of free
+ * slots sweeps its own pages until it finds one, and the rest gets swept a bit at
+ * a time after each minor collection. */
+#define PAGE_SHIFT 16
+#define PAGE_SIZE ((uintptr_t)1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define PAGES_PER_CHUNK 16
+#define GRANULE 8
+#define MAX_SMALL_SIZE 512
+#define NURSERY_PAGES 32
+#define NURSERY_BYTES (NURSERY_PAGES * PAGE_SIZE)
+#define MIN_MAJOR_TRIGGER ((size_t)8 << 20)
+
+enum page_kind {
+	PAGE_FREE,
+	/* old generation, one size class */
+	PAGE_SMALL,
+	/* young generation, bump allocated, plus anything pinned in place */
+	PAGE_NURSERY
+};
+
+struct page {
+	enum page_kind kind;
+	/* has an old object on this page been written to since the last minor collection? */
+	_Bool dirty;
+	/* are we moving everything off this page? (only while compacting) */
+	_Bool evacuate;
+	/* the last major collection that swept this page */
+	unsigned swept_epoch;
+	/* next page in this size class, or in the pool of empty pages */
+	struct page *next;
+	/* next page in this size class with free slots */
+	struct page *next_avail;
+	struct page *next_dirty;
+	/* free slots */
+	struct free_slot *freelist;
+	char *objs;
+	/* bump allocation pointer and the end of the current free run in a nursery page */
+	char *top;
+	char *limit;
+	size_t objsize;
+	size_t nobjs;
+	size_t nfree;
+	/* For PAGE_SMALL, one bit per slot: is there an object here?
+	 * For PAGE_NURSERY, one bit per granule: does an object start here? */
+	uint64_t allocated[PAGE_SIZE / GRANULE / 64];
+	/* For PAGE_NURSERY, one bit per granule: is the object starting here pinned from
+	 * an earlier minor collection (and so part of the old generation)? */
+	uint64_t old[PAGE_SIZE / GRANULE / 64];
+	/* One bit per granule: is the object starting here marked? On a nursery page
+	 * this means pinned for a young object. Each chunk keeps its pages' bitmaps
+	 * together somewhere else; if they were all at the same offset in their pages
+	 * they'd compete for the same few cache sets. */
+	uint64_t *marks;
+};
+#define MARK_BITMAP_SIZE (PAGE_SIZE / GRANULE / 8)
+/* The first word of a slot on a small page that's free */
+struct free_slot {
+	struct free_slot *next;
+};
+#define PAGE_END(page) ((char *)(page) + PAGE_SIZE)
+#define GRANULE_IDX(page, p) ((size_t)((char *)(p) - (page)->objs) / GRANULE)
+#define PAGE_HEADER_SIZE ((sizeof(struct page) + 15) & ~(size_t)15)
+#define PAGE_OF(p) ((struct page *)((uintptr_t)(p) & ~PAGE_MASK))
+#define SLOT_BIT(bits, i) ((bits)[(i) / 64] & ((uint64_t)1 << ((i) % 64)))
+#define SET_SLOT_BIT(bits, i) ((bits)[(i) / 64] |= ((uint64_t)1 << ((i) % 64)))
+#define CLEAR_SLOT_BIT(bits, i) ((bits)[(i) / 64] &= ~((uint64_t)1 << ((i) % 64)))
+
+struct size_class {
+	size_t objsize;
+	/* every page in this class */
+	struct page *pages;
+	/* pages with at least one free slot */
+	struct page *avail;
+	/* where the sweeper is up to in `pages', or NULL once it's done */
+	struct page **sweep_link;
+};
+#define SIZE_CLASS(size) { size, NULL, NULL, NULL }
+static struct size_class size_classes[] = {
+	SIZE_CLASS(16), SIZE_CLASS(24), SIZE_CLASS(32), SIZE_CLASS(40), SIZE_CLASS(48), SIZE_CLASS(56), SIZE_CLASS(64),
+	SIZE_CLASS(96), SIZE_CLASS(128), SIZE_CLASS(192), SIZE_CLASS(256),
+	/* small hashtable arrays */
+	SIZE_CLASS(320), SIZE_CLASS(416), SIZE_CLASS(MAX_SMALL_SIZE)
+};
+#undef SIZE_CLASS
+#define NUM_SIZE_CLASSES (sizeof(size_classes) / sizeof(size_classes[0]))
+
+/* Empty pages not currently owned by any size class */
+static struct page *free_pages = NULL;
+
+/* The blocks we got pages from, so we can give them back once they're empty */
+struct chunk {
+	char *raw;
+	uintptr_t first;
+	uint64_t *marks;
+	struct chunk *next;
+};
+static struct chunk *chunks = NULL;
+
+/* Header for an object in the large object space. The object follows immediately. */
+struct large_obj {
+	struct large_obj *next;
+	struct large_obj *next_dirty;
+	size_t size;
+	_Bool dirty;
+	/* the mark bit and the one after it (see struct mark_bit) */
+	uint64_t marks;
+	unsigned swept_epoch;
+};
+#define LARGE_OBJ_HEADER_SIZE ((sizeof(struct large_obj) + 15) & ~(size_t)15)
+#define LARGE_OBJ_OF(o) ((struct large_obj *)((char *)(o) - LARGE_OBJ_HEADER_SIZE))
+#define OBJ_OF_LARGE(lo) ((struct obj *)((char *)(lo) + LARGE_OBJ_HEADER_SIZE))
+static struct large_obj *large_objects = NULL;
+
+enum gc_phase {
+	GC_IDLE,
+	GC_MARKING,
+	GC_SWEEPING
+};
+static enum gc_phase phase = GC_IDLE;
+/* Bumped every time we start sweeping */
+static unsigned sweep_epoch = 0;
+/* How long an incremental slice may take, or 0 to collect all at once */
+static double pause_budget = 0.;
+
+/* Bytes in the old generation, and how big it can get before we start a major collection */
+static size_t old_bytes = 0;
+static size_t next_major_at = MIN_MAJOR_TRIGGER;
+/* How much the old generation may grow after a major collection before the next one */
+static double heap_growth = 2.;
+static size_t live_after_major = 0;
+/* The most the heap (nursery included) may ever hold, or 0 for no limit */
+static size_t max_heap = 0;
+/* With compaction on, a major collection that leaves the old generation
+ * fragmented sets `compact_soon' so that the next one compacts */
+static _Bool compaction = 0;
+static _Bool compact_soon = 0;
+
+/* Old objects that may point into the nursery */
+static struct page *dirty_pages = NULL;
+static struct large_obj *dirty_large_objects = NULL;
+
+/* The nursery is NURSERY_PAGES contiguous pages so "is this young" is a range check
+ * plus a look at the page header. */
+static uintptr_t nursery_lo = 0;
+static uintptr_t nursery_hi = 0;
+/* The page we're currently bump-allocating in, or NULL if the nursery is full */
+static struct page *nursery_page = NULL;
+
+/* An open-addressed set of addresses. We keep one for the base of every page and
+ * one for every large object so that looking up an arbitrary word is O(1). */
+struct ptrset {
+	uintptr_t *slots;
+	size_t cap;
+	size_t size;
+};
+static struct ptrset all_pages = { NULL, 0, 0 };
+static struct ptrset all_large_objects = { NULL, 0, 0 };
+/* Bounds of everything we've ever allocated, to quickly reject most non-pointers */
+static uintptr_t heap_min = UINTPTR_MAX;
+static uintptr_t heap_max = 0;
+
+static size_t ptrset_hash(uintptr_t p, size_t cap) {
+	/* Fibonacci hashing. The bottom bits are always zero so drop them. */
+	return (size_t)(((uint64_t)(p >> 4) * UINT64_C(11400714819323198485)) >> 32) & (cap - 1);
+}
+static _Bool ptrset_contains(struct ptrset *set, uintptr_t p) {
+	if (set->size == 0) return 0;
+	for (size_t i = ptrset_hash(p, set->cap);; i = (i + 1) & (set->cap - 1)) {
+		if (set->slots[i] == p) return 1;
+		if (set->slots[i] == 0) return 0;
+	}
+}
+static void ptrset_add(struct ptrset *set, uintptr_t p);
+static void ptrset_grow(struct ptrset *set) {
+	size_t oldcap = set->cap;
+	uintptr_t *old = set->slots;
+	set->cap = oldcap ? oldcap * 2 : 64;
+	set->slots = calloc(set->cap, sizeof(uintptr_t));
+	if (!set->slots) {
+		fputs("Out of memory\n", stderr);
+		abort();
+	}
+	set->size = 0;
+	for (size_t i = 0; i < oldcap; ++i) {
+		if (old[i]) ptrset_add(set, old[i]);
+	}
+	free(old);
+}
+static void ptrset_add(struct ptrset *set, uintptr_t p) {
+	if ((set->size + 1) * 2 > set->cap) ptrset_grow(set);
+	size_t i = ptrset_hash(p, set->cap);
+	while (set->slots[i] != 0) {
+		if (set->slots[i] == p) return;
+		i = (i + 1) & (set->cap - 1);
+	}
+	set->slots[i] = p;
+	++set->size;
+}
+static void ptrset_del(struct ptrset *set, uintptr_t p) {
+	if (set->size == 0) return;
+	size_t mask = set->cap - 1;
+	size_t i = ptrset_hash(p, set->cap);
+	while (set->slots[i] != p) {
+		if (set->slots[i] == 0) return;
+		i = (i + 1) & mask;
+	}
+	/* Backward-shift deletion, so we don't need tombstones */
+	for (size_t j = (i + 1) & mask; set->slots[j] != 0; j = (j + 1) & mask) {
+		size_t home = ptrset_hash(set->slots[j], set->cap);
+		/* Can slots[j] move into the hole at i? Only if its home isn't in (i, j]. */
+		if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+			set->slots[i] = set->slots[j];
+			i = j;
 		}
 	}
-	return min;
+	set->slots[i] = 0;
+	--set->size;
+}
+
+static void note_heap_range(uintptr_t lo, uintptr_t hi) {
+	if (lo < heap_min) heap_min = lo;
+	if (hi > heap_max) heap_max = hi;
+}
+
+/* Grab a chunk of memory from the system and carve it into empty pages. */
+static _Bool add_chunk() {
+	struct chunk *chunk = malloc(sizeof(*chunk));
+	if (!chunk) return 0;
+	char *raw = malloc((PAGES_PER_CHUNK + 1) * PAGE_SIZE);
+	uint64_t *marks = calloc(PAGES_PER_CHUNK, MARK_BITMAP_SIZE);
+	if (!raw || !marks) {
+		free(raw);
+		free(marks);
+		free(chunk);
+		return 0;
+	}
+	uintptr_t first = ((uintptr_t)raw + PAGE_MASK) & ~PAGE_MASK;
+	chunk->raw = raw;
+	chunk->first = first;
+	chunk->marks = marks;
+	chunk->next = chunks;
+	chunks = chunk;
+#ifdef GC_STATS
+	gc_heap_bytes += (PAGES_PER_CHUNK + 1) * PAGE_SIZE + PAGES_PER_CHUNK * MARK_BITMAP_SIZE;
+#endif
+	for (int i = 0; i < PAGES_PER_CHUNK; ++i) {
+		struct page *page = (struct page *)(first + i * PAGE_SIZE);
+		memset(page, 0, sizeof(*page));
+		page->marks = marks + i * (MARK_BITMAP_SIZE / sizeof(*marks));
+		page->next = free_pages;
+		free_pages = page;
+		ptrset_add(&all_pages, (uintptr_t)page);
+	}
+	note_heap_range(first, first + PAGES_PER_CHUNK * PAGE_SIZE);
+	return 1;
 }
 
-static void add_allocation(uintptr_t ptr) {
-	if (all_allocations_capacity == 0) {
-		all_allocations = all_allocations_end = malloc(4 * sizeof(uintptr_t));
-		all_allocations_capacity = 4;
-	} else if (all_allocations_end == all_allocations + all_allocations_capacity) {
-		size_t new_cap = all_allocations_capacity + all_allocations_capacity / 2;
-		size_t num_objects = all_allocations_end - all_allocations;
-		void *tmp = realloc(all_allocations, new_cap * sizeof(uintptr_t));
-		if (!tmp) abort();
-		all_allocations = tmp;
-		all_allocations_end = all_allocations + num_objects;
-		all_allocations_capacity = new_cap;
+static struct page *new_page(struct size_class *sc) {
+	if (!free_pages && !add_chunk()) return NULL;
+	struct page *page = free_pages;
+	free_pages = page->next;
+
+	uint64_t *marks = page->marks;
+	memset(page, 0, sizeof(*page));
+	page->marks = marks;
+	page->kind = PAGE_SMALL;
+	page->swept_epoch = sweep_epoch;
+	page->objs = (char *)page + PAGE_HEADER_SIZE;
+	page->objsize = sc->objsize;
+	page->nobjs = (PAGE_SIZE - PAGE_HEADER_SIZE) / sc->objsize;
+	page->nfree = page->nobjs;
+	for (size_t i = page->nobjs; i-- > 0;) {
+		struct free_slot *slot = (struct free_slot *)(page->objs + i * page->objsize);
+		slot->next = page->freelist;
+		page->freelist = slot;
 	}
 
-	uintptr_t *slot = all_allocations_find_slot(ptr);
-	if (slot == NULL) abort();
-	if (slot != all_allocations_end) {
-		if (*slot == ptr) {
-			// already there
-			return;
+	page->next = sc->pages;
+	sc->pages = page;
+	page->next_avail = sc->avail;
+	sc->avail = page;
+	return page;
+}
+
+static struct size_class *size_class_for(size_t size) {
+	for (size_t i = 0; i < NUM_SIZE_CLASSES; ++i) {
+		if (size <= size_classes[i].objsize) return &size_classes[i];
+	}
+	return NULL;
+}
+
+static struct page *lazy_sweep(struct size_class *sc);
+static struct obj *alloc_small(struct size_class *sc) {
+	struct page *page = sc->avail;
+	if (!page && phase == GC_SWEEPING) page = lazy_sweep(sc);
+	if (!page) {
+		page = new_page(sc);
+		if (!page) return NULL;
+	}
+	struct obj *ret = (struct obj *)page->freelist;
+	page->freelist = page->freelist->next;
+	SET_SLOT_BIT(page->allocated, ((char *)ret - page->objs) / page->objsize);
+	if (--page->nfree == 0) {
+		sc->avail = page->next_avail;
+		page->next_avail = NULL;
+	}
+	memset(ret, 0, page->objsize);
+	old_bytes += page->objsize;
+	return ret;
+}
+
+static struct obj *alloc_large(size_t size) {
+	struct large_obj *lo = calloc(1, LARGE_OBJ_HEADER_SIZE + size);
+	if (!lo) return NULL;
+	lo->size = size;
+	lo->swept_epoch = sweep_epoch;
+	old_bytes += size;
+#ifdef GC_STATS
+	gc_heap_bytes += LARGE_OBJ_HEADER_SIZE + size;
+#endif
+	lo->next = large_objects;
+	large_objects = lo;
+	struct obj *ret = OBJ_OF_LARGE(lo);
+	ptrset_add(&all_large_objects, (uintptr_t)ret);
+	note_heap_range((uintptr_t)ret, (uintptr_t)ret + size);
+	return ret;
+}
+
+#ifdef GC_STATS
+static unsigned long long nursery_allocs = 0, nursery_copies = 0;
+#endif
+
+/* The first pinned object at or after `from' on a nursery page, or the end of the page */
+static char *next_old_object(struct page *page, char *from) {
+	for (size_t idx = GRANULE_IDX(page, from); page->objs + idx * GRANULE < PAGE_END(page); ++idx) {
+		if (page->old[idx / 64] == 0) {
+			idx |= 63;
+			continue;
 		}
-		memmove(slot + 1, slot, (all_allocations_end - slot) * sizeof(uintptr_t));
+		if (SLOT_BIT(page->old, idx)) return page->objs + idx * GRANULE;
 	}
-	*slot = ptr;
-	++all_allocations_end;
+	return PAGE_END(page);
 }
 
-static _Bool is_valid_allocation(uintptr_t ptr) {
-	assert(all_allocations);
-	uintptr_t *slot = all_allocations_find_slot(ptr);
-	return slot != all_allocations_end && *slot == ptr;
+static void rewind_nursery_page(struct page *page) {
+	page->top = page->objs;
+	page->limit = next_old_object(page, page->objs);
 }
 
-static uintptr_t gc_start_of_stack = 0;
-void gc_init(void *bottom_of_stack) {
-	uintptr_t bottom = (uintptr_t)bottom_of_stack;
-	// round down to correct alignment
-	gc_start_of_stack = bottom - bottom % _Alignof(struct obj);
+static void init_nursery() {
+	char *raw = malloc((NURSERY_PAGES + 1) * PAGE_SIZE);
+	uint64_t *marks = calloc(NURSERY_PAGES, MARK_BITMAP_SIZE);
+	if (!raw || !marks) {
+		fputs("Out of memory\n", stderr);
+		abort();
+	}
+#ifdef GC_STATS
+	gc_heap_bytes += (NURSERY_PAGES + 1) * PAGE_SIZE + NURSERY_PAGES * MARK_BITMAP_SIZE;
+#endif
+	nursery_lo = ((uintptr_t)raw + PAGE_MASK) & ~PAGE_MASK;
+	nursery_hi = nursery_lo + NURSERY_PAGES * PAGE_SIZE;
+	for (uintptr_t p = nursery_lo; p < nursery_hi; p += PAGE_SIZE) {
+		struct page *page = (struct page *)p;
+		memset(page, 0, sizeof(*page));
+		page->marks = marks + (p - nursery_lo) / PAGE_SIZE * (MARK_BITMAP_SIZE / sizeof(*marks));
+		page->kind = PAGE_NURSERY;
+		page->objs = (char *)page + PAGE_HEADER_SIZE;
+		page->swept_epoch = sweep_epoch;
+		rewind_nursery_page(page);
+		ptrset_add(&all_pages, p);
+	}
+	note_heap_range(nursery_lo, nursery_hi);
+	nursery_page = (struct page *)nursery_lo;
 }
 
-static struct obj *objs_to_mark = NULL;
+static size_t gc_object_size(struct obj *o);
 
+static struct obj *alloc_nursery(size_t size) {
+	if (!nursery_lo) init_nursery();
+	size = (size + GRANULE - 1) & ~(size_t)(GRANULE - 1);
+	while (nursery_page) {
+		struct page *page = nursery_page;
+		if ((size_t)(page->limit - page->top) >= size) {
+			struct obj *ret = (struct obj *)page->top;
+			SET_SLOT_BIT(page->allocated, GRANULE_IDX(page, ret));
+			page->top += size;
+			memset(ret, 0, size);
 #ifdef GC_STATS
-unsigned long long gc_total_allocs = 0;
-unsigned long long gc_total_frees = 0;
-double time_rootfinding = 0.;
-double time_marking = 0.;
-double time_sweeping = 0.;
+			++nursery_allocs;
 #endif
+			return ret;
+		}
+		if (page->limit != PAGE_END(page)) {
+			/* Skip over the pinned object in our way to the next free run */
+			size_t oldsize = gc_object_size((struct obj *)page->limit);
+			page->top = page->limit + ((oldsize + GRANULE - 1) & ~(size_t)(GRANULE - 1));
+			page->limit = next_old_object(page, page->top);
+			continue;
+		}
+		/* This page is full, move on to the next one */
+		uintptr_t next = (uintptr_t)page + PAGE_SIZE;
+		nursery_page = next < nursery_hi ? (struct page *)next : NULL;
+	}
+	return NULL;
+}
 
-static void gc_mark(struct obj *item);
-static void gc_queue(struct obj *obj);
+static _Bool in_nursery(struct obj *o) {
+	if ((uintptr_t)o < nursery_lo || (uintptr_t)o >= nursery_hi) return 0;
+	struct page *page = PAGE_OF(o);
+	return !SLOT_BIT(page->old, GRANULE_IDX(page, o));
+}
 
-static void gc_queue(struct obj *o) {
-	if ((uintptr_t)o < *all_allocations || (uintptr_t)o > *(all_allocations_end - 1)) return; /* null or static */
-	if (ISMARKED(o)) return;
-	if (NEXTTOMARK(o) != NULL) return; /* already in queue */
-	SETNEXTTOMARK(o, objs_to_mark);
-	objs_to_mark = o;
+static struct obj *alloc_old(size_t size) {
+	struct size_class *sc = size_class_for(size);
+	return sc ? alloc_small(sc) : alloc_large(size);
+}
+
+/* Where an object's mark bit lives: `bit' in `*word', which is either in its
+ * page's bitmap or its large object header. Nothing is smaller than two
+ * granules, so the bit after that belongs to the object too. It's set once the
+ * object is on the mark stack so it only goes on once. */
+struct mark_bit {
+	uint64_t *word;
+	uint64_t bit;
+};
+
+/* Find the mark bit for `o'. Returns 0 if `o' isn't a heap object (e.g. it's
+ * NULL or static). */
+static _Bool find_mark_bit(struct obj *o, struct mark_bit *mb) {
+	uintptr_t ptr = (uintptr_t)o;
+	if (ptr < heap_min || ptr >= heap_max) return 0;
+	uintptr_t base = ptr & ~PAGE_MASK;
+	if (ptrset_contains(&all_pages, base)) {
+		struct page *page = (struct page *)base;
+		size_t idx = GRANULE_IDX(page, o);
+		mb->word = &page->marks[idx / 64];
+		mb->bit = (uint64_t)1 << (idx % 64);
+		return 1;
+	}
+	if (!ptrset_contains(&all_large_objects, ptr)) return 0;
+	mb->word = &LARGE_OBJ_OF(o)->marks;
+	mb->bit = 1;
+	return 1;
 }
-static void gc_queue_hashtab_entry(struct string *key, struct obj *value, void *ignored) {
-	(void)ignored;
-	ADDMARK(key); /* I know it's a string */
-	gc_queue(value);
+
+/* Large objects go on the mark stack with their bottom bit set, so we can find
+ * any mark bit again without another trip through the page set */
+#define LARGE_TAG 1
+
+static struct obj *mark_entry(struct obj *o, struct mark_bit *mb) {
+	if (mb->word == &LARGE_OBJ_OF(o)->marks) return (struct obj *)((uintptr_t)o | LARGE_TAG);
+	return o;
 }
-static void gc_mark(struct obj *obj) {
-	if (ISMARKED(obj)) return;
-	ADDMARK(obj);
-	switch (TYPE(obj)) {
+
+/* Undo `mark_entry', finding the mark bit on the way */
+static struct obj *from_mark_entry(struct obj *entry, struct mark_bit *mb) {
+	uintptr_t ptr = (uintptr_t)entry;
+	if (ptr & LARGE_TAG) {
+		struct obj *o = (struct obj *)(ptr & ~(uintptr_t)LARGE_TAG);
+		mb->word = &LARGE_OBJ_OF(o)->marks;
+		mb->bit = 1;
+		return o;
+	}
+	struct page *page = PAGE_OF(entry);
+	size_t idx = GRANULE_IDX(page, entry);
+	mb->word = &page->marks[idx / 64];
+	mb->bit = (uint64_t)1 << (idx % 64);
+	return entry;
+}
+
+static _Bool mark_bit_set(struct mark_bit *mb) {
+	return (*mb->word & mb->bit) != 0;
+}
+
+/* Set a mark bit even if other threads are marking too. Returns whether it was clear before. */
+static _Bool try_set_mark_bit(struct mark_bit *mb) {
+	return atomic_set_bit(mb->word, mb->bit);
+}
+
+/* Note that the object is about to go on the mark stack. Returns 0 if it's
+ * already been marked or queued. */
+static _Bool set_queued_bit(struct mark_bit *mb) {
+	uint64_t *word = mb->word;
+	uint64_t bit = mb->bit << 1;
+	if (bit == 0) {
+		++word;
+		bit = 1;
+	}
+	if (mark_bit_set(mb) || (*word & bit)) return 0;
+	*word |= bit;
+	return 1;
+}
+
+/* These take an object that's definitely in the heap */
+static _Bool is_marked(struct obj *o) {
+	struct mark_bit mb;
+	find_mark_bit(o, &mb);
+	return mark_bit_set(&mb);
+}
+
+static void set_mark(struct obj *o) {
+	struct mark_bit mb;
+	find_mark_bit(o, &mb);
+	*mb.word |= mb.bit;
+}
+
+static void clear_mark(struct obj *o) {
+	struct mark_bit mb;
+	find_mark_bit(o, &mb);
+	*mb.word &= ~mb.bit;
+}
+
+static _Bool already_swept(struct obj *o) {
+	if (ptrset_contains(&all_pages, (uintptr_t)o & ~PAGE_MASK)) {
+		return PAGE_OF(o)->swept_epoch == sweep_epoch;
+	}
+	return LARGE_OBJ_OF(o)->swept_epoch == sweep_epoch;
+}
+
+/* Anything that shows up in the old generation during a major collection has to survive it */
+static void color_new_old_object(struct obj *o) {
+	if (phase == GC_MARKING || (phase == GC_SWEEPING && !already_swept(o))) {
+		set_mark(o);
+	}
+}
+
+/* Garbage the sweeper hasn't gotten to yet. Its fields may point at freed memory. */
+static _Bool is_dead(struct obj *o) {
+	return phase == GC_SWEEPING && !is_marked(o) && !already_swept(o);
+}
+
+/* How many bytes does this object actually use? */
+static size_t gc_object_size(struct obj *o) {
+	switch (TYPE(o)) {
+	default:
+		fprintf(stderr, "Fatal error: unknown object type %d\n", TYPE(o));
+		abort();
+	case CELL:
+		return sizeof(struct cell);
+	case NUM:
+		return sizeof(struct num);
+	case SYMBOL:
+	case STRING:
+		return offsetof(struct string, str) + AS_STRING(o)->len;
+	case BUILTIN:
+		return sizeof(struct builtin);
+	case FN:
+	case SPECFORM:
+		return sizeof(struct fn);
+	case LAMBDA:
+	case MACRO:
+		return sizeof(struct closure);
+	case CONTN:
+		return sizeof(struct contn);
+	case ENV:
+		return sizeof(struct env);
+	case WEAKTABLE:
+		return sizeof(struct weak_table);
+	case LOCALREF:
+		return sizeof(struct local_ref);
+	case GLOBALREF:
+		return sizeof(struct global_ref);
+	case SCOPE:
+		return sizeof(struct scope);
+	case FRAME:
+		return offsetof(struct frame, slots) + AS_FRAME(o)->nslots * sizeof(struct obj *);
+	case BYTECODE:
+		return offsetof(struct bytecode, consts) + AS_BYTECODE(o)->nconsts * sizeof(struct obj *) + AS_BYTECODE(o)->len * sizeof(uint32_t);
+	case VMSTATE:
+		return offsetof(struct vm_state, stack) + AS_VM_STATE(o)->sp * sizeof(struct obj *);
+	case HASHTABARR:
+	case WEAKHASHTABARR:
+		return offsetof(struct ht_entryarr, entries) + ((struct ht_entryarr *)o)->cap * sizeof(struct ht_entry);
+	}
+}
+
+/* Call `visit` on the address of every pointer in `o` */
+static void for_each_field(struct obj *o, void (*visit)(struct obj **field, void *ctx), void *ctx) {
+	switch (TYPE(o)) {
 	default:
-		fprintf(stderr, "Fatal error: unknown object type %d\n", TYPE(obj));
+		fprintf(stderr, "Fatal error: unknown object type %d\n", TYPE(o));
 		abort();
 	case STRING:
 	case SYMBOL:
 		/* no pointers in a string :) */
 		return;
-	case HASHTABARR:
-		/* Should have been queued as part of its owner, because we don't have the length here */
-		/* Could be added as part of the temp roots while allocating. Hopefully if there's
-		 * anything in it it's already in the graph, because we don't have size here. */
-		/* TODO: change this to a struct {size, array} */
+	case HASHTABARR: {
+		struct ht_entryarr *arr = (struct ht_entryarr *)o;
+		for (size_t i = 0; i < arr->cap; ++i) {
+			if (entry_has_value(&arr->entries[i])) {
+				visit((struct obj **)&arr->entries[i].key, ctx);
+				visit(&arr->entries[i].value, ctx);
+			}
+		}
+		return;
+	}
+	case WEAKHASHTABARR:
+		/* see "Weak tables" */
+		return;
+	case WEAKTABLE:
+		visit((struct obj **)&AS_WEAK_TABLE(o)->table.e, ctx);
 		return;
 	case ENV: {
-		struct env *env = (struct env *) obj;
-		/* If we allocate the environment but then need to collect when trying to allocate
-		 * the initial hashtable, we don't have anything to mark yet. */
-		if (env->table.cap) {
-			ADDMARK(env->table.e);
-			hashtab_foreach(&env->table, gc_queue_hashtab_entry, NULL);
-		}
-		gc_queue((struct obj *) env->parent);
+		struct env *env = (struct env *)o;
+		visit((struct obj **)&env->table.e, ctx);
+		visit((struct obj **)&env->parent, ctx);
+		return;
+	}
+	case LOCALREF:
+		visit((struct obj **)&AS_LOCAL_REF(o)->name, ctx);
+		return;
+	case GLOBALREF:
+		visit((struct obj **)&AS_GLOBAL_REF(o)->name, ctx);
+		visit(&AS_GLOBAL_REF(o)->value, ctx);
+		return;
+	case SCOPE:
+		visit(&AS_SCOPE(o)->params, ctx);
+		return;
+	case FRAME: {
+		struct frame *frame = AS_FRAME(o);
+		visit((struct obj **)&frame->parent, ctx);
+		for (size_t i = 0; i < frame->nslots; ++i) {
+			visit(&frame->slots[i], ctx);
+		}
+		return;
+	}
+	case BYTECODE: {
+		struct bytecode *code = AS_BYTECODE(o);
+		visit(&code->scope, ctx);
+		for (uint32_t i = 0; i < code->nconsts; ++i) {
+			visit(&code->consts[i], ctx);
+		}
+		return;
+	}
+	case VMSTATE: {
+		struct vm_state *state = AS_VM_STATE(o);
+		visit((struct obj **)&state->code, ctx);
+		for (uint32_t i = 0; i < state->sp; ++i) {
+			visit(&state->stack[i], ctx);
+		}
 		return;
 	}
 	case CONTN: {
-		struct contn *contn = (struct contn *) obj;
-		gc_queue(contn->data);
-		gc_queue((struct obj *) contn->env);
-		gc_queue((struct obj *) contn->next);
+		struct contn *contn = (struct contn *)o;
+		visit(&contn->data, ctx);
+		visit((struct obj **)&contn->env, ctx);
+		visit((struct obj **)&contn->next, ctx);
 		return;
 	}
 	case NUM:
@@ -141,31 +712,219 @@ static void gc_mark(struct obj *obj) {
 	case BUILTIN:
 		return;
 	case CELL:
-		gc_queue(CAR(obj));
-		gc_queue(CDR(obj));
+		visit(&CAR(o), ctx);
+		visit(&CDR(o), ctx);
 		return;
 	case LAMBDA:
 	case MACRO: {
-		struct closure *cobj = AS_CLOSURE(obj);
-		gc_queue(cobj->args);
-		gc_queue(cobj->code);
-		gc_queue((struct obj *) cobj->env);
-		gc_queue((struct obj *) cobj->closurename);
+		struct closure *cobj = AS_CLOSURE(o);
+		visit(&cobj->args, ctx);
+		visit(&cobj->code, ctx);
+		visit((struct obj **)&cobj->env, ctx);
+		visit((struct obj **)&cobj->closurename, ctx);
 		return;
 	}
 	}
 }
 
-struct gc_reverse_lookup_context {
-	struct obj *value;
-	struct string *key;
+static struct obj *find_old_object(uintptr_t ptr);
+static void gc_mark(struct obj *obj);
+
+void gc_write_barrier(void *obj) {
+	uintptr_t ptr = (uintptr_t)obj;
+	if (ptr < heap_min || ptr >= heap_max) return; /* static */
+	if (ptrset_contains(&all_pages, ptr & ~PAGE_MASK)) {
+		struct page *page = PAGE_OF(ptr);
+		if (page->kind == PAGE_NURSERY || phase == GC_MARKING) {
+			struct obj *o = find_old_object(ptr);
+			if (!o) return; /* young */
+			/* Keep the snapshot: everything `o' points at now stays alive */
+			if (phase == GC_MARKING && !is_marked(o)) gc_mark(o);
+		}
+		if (page->dirty) return;
+		page->dirty = 1;
+		page->next_dirty = dirty_pages;
+		dirty_pages = page;
+	} else if (ptrset_contains(&all_large_objects, ptr)) {
+		struct large_obj *lo = LARGE_OBJ_OF(obj);
+		if (phase == GC_MARKING && !is_marked(obj)) gc_mark(obj);
+		if (lo->dirty) return;
+		lo->dirty = 1;
+		lo->next_dirty = dirty_large_objects;
+		dirty_large_objects = lo;
+	}
+}
+
+void gc_read_weak(void *obj) {
+	if (phase != GC_MARKING) return;
+	struct obj *o = find_old_object((uintptr_t)obj);
+	if (o && !is_marked(o)) gc_mark(o);
+}
+
+static uintptr_t gc_start_of_stack = 0;
+void gc_init(void *bottom_of_stack) {
+	uintptr_t bottom = (uintptr_t)bottom_of_stack;
+	// round down to correct alignment
+	gc_start_of_stack = bottom - bottom % _Alignof(struct obj);
+}
+
+void **gc_roots = NULL;
+size_t gc_nroots = 0, gc_roots_cap = 0;
+void gc_grow_roots() {
+	size_t newcap = gc_roots_cap ? gc_roots_cap * 2 : 256;
+	void **roots = realloc(gc_roots, newcap * sizeof(*roots));
+	if (!roots) {
+		fputs("Out of memory\n", stderr);
+		abort();
+	}
+	gc_roots = roots;
+	gc_roots_cap = newcap;
+}
+
+static _Bool conservative_roots = 0;
+void gc_set_conservative_roots(_Bool conservative) {
+	conservative_roots = conservative;
+}
+
+static void (*off_heap_objects)(_Bool all, void (*visit)(struct obj *o, void *ctx), void *ctx) = NULL;
+void gc_set_off_heap_objects(void (*each)(_Bool all, void (*visit)(struct obj *o, void *ctx), void *ctx)) {
+	off_heap_objects = each;
+}
+static void for_each_off_heap_object(_Bool all, void (*visit)(struct obj *o, void *ctx), void *ctx) {
+	if (off_heap_objects) off_heap_objects(all, visit, ctx);
+}
+
+/* A growable stack of objects */
+struct obj_stack {
+	struct obj **items;
+	size_t n;
+	size_t cap;
 };
-static void gc_reverse_hashtab_lookup(struct string *key, struct obj *value, void *context) {
-	struct gc_reverse_lookup_context *rlc = context;
-	if (value == rlc->value) {
-		rlc->key = key;
+
+static void obj_stack_push(struct obj_stack *stack, struct obj *o) {
+	if (stack->n == stack->cap) {
+		size_t newcap = stack->cap ? stack->cap * 2 : 1024;
+		struct obj **items = realloc(stack->items, newcap * sizeof(*items));
+		if (!items) {
+			fputs("Out of memory\n", stderr);
+			abort();
+		}
+		stack->items = items;
+		stack->cap = newcap;
+	}
+	stack->items[stack->n++] = o;
+}
+
+/* Objects waiting to be marked. By the time we get to one it may have been
+ * marked already, or be in here more than once. */
+static struct obj_stack to_mark = { NULL, 0, 0 };
+
+#ifdef GC_STATS
+unsigned long long gc_total_allocs = 0;
+unsigned long long gc_total_frees = 0;
+unsigned long long gc_minor_collections = 0;
+unsigned long long gc_bytes_promoted = 0;
+double time_rootfinding = 0.;
+double time_marking = 0.;
+double time_sweeping = 0.;
+double time_lazy_sweeping = 0.;
+double time_minor = 0.;
+double time_compacting = 0.;
+size_t gc_heap_bytes = 0;
+unsigned long long gc_pause_histogram[GC_PAUSE_BUCKETS];
+double gc_max_pause = 0.;
+double gc_total_pause = 0.;
+#endif
+
+/* Pauses can nest (a major collection starts with a minor one); only the outermost counts */
+static int pause_depth = 0;
+#ifdef GC_STATS
+static double pause_start;
+#endif
+static void begin_pause() {
+#ifdef GC_STATS
+	if (pause_depth == 0) pause_start = gettime_perf();
+#endif
+	++pause_depth;
+}
+static void end_pause() {
+	if (--pause_depth != 0) return;
+#ifdef GC_STATS
+	double len = gettime_perf() - pause_start;
+	size_t bucket = 0;
+	while (bucket < GC_PAUSE_BUCKETS - 1 && len * 1e6 >= GC_PAUSE_BUCKET_LIMIT(bucket)) ++bucket;
+	++gc_pause_histogram[bucket];
+	if (len > gc_max_pause) gc_max_pause = len;
+	gc_total_pause += len;
+#endif
+}
+
+/*** Weak tables ***/
+
+/* The entries of a weak table aren't traced like other fields. Instead each
+ * collection keeps a list of the weak tables it has come across. Once everything
+ * else reachable has been found, the values of entries whose keys survived are
+ * kept too, which may find more keys, and so on. Then the entries whose keys
+ * didn't survive are deleted, all in one pass. interned_symbols is always on the
+ * list. */
+#define WEAK_LIST_END ((struct weak_table *)1)
+static struct weak_table *minor_weak_tables = WEAK_LIST_END;
+static struct weak_table *major_weak_tables = WEAK_LIST_END;
+
+/* Call `f' on every weak table the current minor (or major) collection has found */
+static void for_each_weak_table(_Bool minor, void (*f)(struct hashtab *ht)) {
+	if (interned_symbols.cap != 0) f(&interned_symbols);
+	struct weak_table *t = minor ? minor_weak_tables : major_weak_tables;
+	while (t != WEAK_LIST_END) {
+		/* It might not have its array yet */
+		if (t->table.cap != 0) f(&t->table);
+		t = minor ? t->next_minor : t->next_major;
+	}
+}
+
+/* Empty the list for the current minor (or major) collection */
+static void forget_weak_tables(_Bool minor) {
+	struct weak_table **list = minor ? &minor_weak_tables : &major_weak_tables;
+	while (*list != WEAK_LIST_END) {
+		struct weak_table *t = *list;
+		struct weak_table **link = minor ? &t->next_minor : &t->next_major;
+		*list = *link;
+		*link = NULL;
+	}
+}
+
+static void delete_weak_entry(struct hashtab *ht, struct ht_entry *e) {
+	e->key = TOMBSTONE;
+	e->value = NULL;
+	--ht->size;
+}
+
+static void gc_mark(struct obj *item);
+static void gc_queue(struct obj *obj);
+
+static void gc_queue(struct obj *o) {
+	struct mark_bit mb;
+	if (!find_mark_bit(o, &mb)) return; /* null or static */
+	if (in_nursery(o)) return; /* the nursery isn't part of a major collection */
+	if (!set_queued_bit(&mb)) return;
+	obj_stack_push(&to_mark, mark_entry(o, &mb));
+}
+static void gc_queue_field(struct obj **field, void *ctx) {
+	gc_queue(*field);
+}
+static void mark_with_bit(struct obj *obj, struct mark_bit *mb) {
+	if (mark_bit_set(mb)) return;
+	*mb->word |= mb->bit;
+	for_each_field(obj, gc_queue_field, NULL);
+	if (TYPE(obj) == WEAKTABLE) {
+		AS_WEAK_TABLE(obj)->next_major = major_weak_tables;
+		major_weak_tables = AS_WEAK_TABLE(obj);
 	}
 }
+static void gc_mark(struct obj *obj) {
+	struct mark_bit mb;
+	if (find_mark_bit(obj, &mb)) mark_with_bit(obj, &mb);
+}
 
 _declspec(noinline)
 static uintptr_t get_end_of_stack() {
@@ -176,110 +935,1216 @@ static uintptr_t get_end_of_stack() {
 	return end_of_stack;
 }
 
-void gc_collect() {
-	if (all_allocations == all_allocations_end) return;
-	/* Messing with the interned symbols hashtable can trigger another collection
-	 * but collection is not reentrant. Block it. */
-	static _Bool collection_active = 0;
-	if (collection_active) return;
-	collection_active = 1;
+/* Call `visit' on everything that might point at a live object */
+static void for_each_root(void (*visit)(uintptr_t ptr)) {
+	if (!conservative_roots) {
+		for (size_t i = 0; i < gc_nroots; ++i) {
+			visit(*(uintptr_t *)gc_roots[i]);
+		}
+		return;
+	}
 
-	/* Find roots */
-#ifdef GC_STATS
-	double start = gettime_perf();
-#endif
+	/* Get the registers onto the stack too */
 	jmp_buf jb;
 	setjmp(jb);
-
 	uintptr_t end_of_stack = get_end_of_stack();
-
 	if (gc_start_of_stack == 0) abort();
 	if (end_of_stack >= gc_start_of_stack) abort();
-
 	for (uintptr_t candidate = gc_start_of_stack; candidate > end_of_stack; candidate -= _Alignof(struct obj)) {
-		uintptr_t value_on_stack = *(uintptr_t *)candidate;
-		if (!is_valid_allocation(value_on_stack)) {
-			continue;
-		}
-		gc_queue((struct obj *)value_on_stack);
+		visit(*(uintptr_t *)candidate);
 	}
+}
 
-	/* DON'T queue this normally as it's full of weak references */
-	if (interned_symbols.cap != 0) {
-		ADDMARK(interned_symbols.e);
-	}
+/* Messing with the interned symbols hashtable can trigger another collection
+ * but collection is not reentrant. Block it. */
+static _Bool collection_active = 0;
 
-#ifdef GC_STATS
-	double end = gettime_perf();
-	time_rootfinding += end - start;
-	start = end;
-#endif
+/*** Minor collection ***/
 
-	/* mark */
-	while (objs_to_mark != NULL) {
-		struct obj *cur = objs_to_mark;
-		objs_to_mark = NEXTTOMARK(cur);
-		SETNEXTTOMARK(cur, NULL);
-		gc_mark(cur);
-	}
+/* Objects that have been copied (or pinned) but whose fields haven't been updated yet */
+static struct obj_stack to_scan = { NULL, 0, 0 };
 
-#ifdef GC_STATS
-	end = gettime_perf();
-	time_marking += end - start;
-	start = end;
-#endif
-
-	/* sweep */
-	uintptr_t *writeptr = all_allocations;
-	for (uintptr_t *curptr = all_allocations; curptr != all_allocations_end; ++curptr) {
-		struct obj *cur = (struct obj *)*curptr;
-		if (ISMARKED(cur)) {
-			DELMARK(cur);
-			*writeptr = *curptr;
-			++writeptr;
-		} else {
-			if (TYPE(cur) == SYMBOL) {
-				/* Clear out weak reference in interned_symbols if necessary
-				 * We'll have to figure out something better in case we add weak references somewhere else */
-				struct gc_reverse_lookup_context context = { NULL, NULL };
-				context.value = cur;
-				hashtab_foreach(&interned_symbols, gc_reverse_hashtab_lookup, &context);
-				if (context.key) {
-					hashtab_del(&interned_symbols, context.key);
-				}
-			}
-			free(cur);
-#ifdef GC_STATS
-			++gc_total_frees;
-#endif
+/* Objects pinned by the current minor collection */
+static struct obj **pinned = NULL;
+static size_t npinned = 0, pinned_cap = 0;
+/* Pin the nursery object containing `ptr`, if any. Unlike the old generation we
+ * honor interior pointers here, since moving an object out from under one would
+ * be a lot worse than keeping it alive a little longer. */
+static void pin_nursery_object(uintptr_t ptr) {
+	if (ptr < nursery_lo || ptr >= nursery_hi) return;
+	struct page *page = PAGE_OF(ptr);
+	if (ptr < (uintptr_t)page->objs) return;
+	/* find the closest object start at or before ptr */
+	size_t idx = GRANULE_IDX(page, ptr);
+	while (!SLOT_BIT(page->allocated, idx)) {
+		if (idx == 0) return;
+		--idx;
+	}
+	if (SLOT_BIT(page->old, idx)) return; /* already promoted */
+	struct obj *o = (struct obj *)(page->objs + idx * GRANULE);
+	if (ptr >= (uintptr_t)o + gc_object_size(o)) return;
+	if (is_marked(o)) return;
+	/* In the nursery the mark bit means "pinned" */
+	set_mark(o);
+	if (npinned == pinned_cap) {
+		pinned_cap = pinned_cap ? pinned_cap * 2 : 64;
+		pinned = realloc(pinned, pinned_cap * sizeof(*pinned));
+		if (!pinned) {
+			fputs("Out of memory\n", stderr);
+			abort();
 		}
 	}
-	all_allocations_end = writeptr;
+	pinned[npinned++] = o;
+	obj_stack_push(&to_scan, o);
+}
 
+/* What an object that's been moved leaves behind. Every object is big enough. */
+struct forwarded {
+	struct obj o;
+	struct obj *to;
+};
+#define FORWARD_OF(o) (((struct forwarded *)(o))->to)
+
+/* Returns where `o` lives after this minor collection, copying it out of the nursery if necessary */
+static struct obj *evacuate(struct obj *o) {
+	if (!in_nursery(o)) return o;
+	if (TYPE(o) == FORWARDED) return FORWARD_OF(o);
+	if (is_marked(o)) return o; /* pinned */
+
+	size_t size = gc_object_size(o);
+	struct obj *copy = alloc_old(size);
+	if (!copy) {
+		fputs("Out of memory\n", stderr);
+		abort();
+	}
+	memcpy(copy, o, size);
+	color_new_old_object(copy);
+	obj_stack_push(&to_scan, copy);
+	o->type = FORWARDED;
+	FORWARD_OF(o) = copy;
 #ifdef GC_STATS
-	end = gettime_perf();
-	time_sweeping += end - start;
+	gc_bytes_promoted += size;
+	++nursery_copies;
 #endif
-
-	collection_active = 0;
+	return copy;
+}
+static void evacuate_field(struct obj **field, void *ctx) {
+	*field = evacuate(*field);
 }
 
-struct obj *gc_alloc(enum objtype typ, size_t size) {
+static void scan_object(struct obj *o) {
+	if (is_dead(o)) return;
+	for_each_field(o, evacuate_field, NULL);
+	/* Old tables can get scanned more than once */
+	if (TYPE(o) == WEAKTABLE && AS_WEAK_TABLE(o)->next_minor == NULL) {
+		AS_WEAK_TABLE(o)->next_minor = minor_weak_tables;
+		minor_weak_tables = AS_WEAK_TABLE(o);
+	}
+}
+
+/* The old object containing `ptr', if any. Interior pointers into large objects
+ * are not recognized. */
+static struct obj *find_old_object(uintptr_t ptr) {
+	if (ptr < heap_min || ptr >= heap_max) return NULL;
+	uintptr_t base = ptr & ~PAGE_MASK;
+	if (ptrset_contains(&all_pages, base)) {
+		struct page *page = (struct page *)base;
+		if (ptr < (uintptr_t)page->objs) return NULL;
+		if (page->kind == PAGE_SMALL) {
+			size_t idx = (ptr - (uintptr_t)page->objs) / page->objsize;
+			if (idx >= page->nobjs || !SLOT_BIT(page->allocated, idx)) return NULL;
+			return (struct obj *)(page->objs + idx * page->objsize);
+		}
+		if (page->kind == PAGE_NURSERY) {
+			size_t idx = GRANULE_IDX(page, ptr);
+			while (!SLOT_BIT(page->allocated, idx)) {
+				if (idx == 0) return NULL;
+				--idx;
+			}
+			if (!SLOT_BIT(page->old, idx)) return NULL;
+			struct obj *o = (struct obj *)(page->objs + idx * GRANULE);
+			return ptr < (uintptr_t)o + gc_object_size(o) ? o : NULL;
+		}
+		return NULL;
+	}
+	return ptrset_contains(&all_large_objects, ptr) ? (struct obj *)ptr : NULL;
+}
+
+/* Off-heap objects aren't pinned or promoted, we just keep their fields up to date */
+static void scan_off_heap_object(struct obj *o, void *ctx) {
+	for_each_field(o, evacuate_field, NULL);
+}
+
+static void scan_old_root(uintptr_t ptr) {
+	struct obj *o = find_old_object(ptr);
+	if (o && !is_dead(o)) {
+		scan_object(o);
+		gc_write_barrier(o);
+	}
+}
+
+static void scan_dirty_objects() {
+	while (dirty_pages) {
+		struct page *page = dirty_pages;
+		dirty_pages = page->next_dirty;
+		page->dirty = 0;
+		page->next_dirty = NULL;
+		if (page->kind == PAGE_SMALL) {
+			for (size_t idx = 0; idx < page->nobjs; ++idx) {
+				if (SLOT_BIT(page->allocated, idx)) {
+					scan_object((struct obj *)(page->objs + idx * page->objsize));
+				}
+			}
+		} else if (page->kind == PAGE_NURSERY) {
+			for (size_t idx = 0; page->objs + idx * GRANULE < PAGE_END(page); ++idx) {
+				if (SLOT_BIT(page->old, idx)) {
+					scan_object((struct obj *)(page->objs + idx * GRANULE));
+				}
+			}
+		}
+	}
+	while (dirty_large_objects) {
+		struct large_obj *lo = dirty_large_objects;
+		dirty_large_objects = lo->next_dirty;
+		lo->dirty = 0;
+		lo->next_dirty = NULL;
+		scan_object(OBJ_OF_LARGE(lo));
+	}
+}
+
+static _Bool survives_minor(struct obj *o) {
+	return !in_nursery(o) || TYPE(o) == FORWARDED || is_marked(o); /* old, copied or pinned */
+}
+
+static void evacuate_weak_values(struct hashtab *ht) {
+	struct ht_entryarr *arr = ht->e;
+	for (size_t i = 0; i < arr->cap; ++i) {
+		struct ht_entry *e = &arr->entries[i];
+		if (!entry_has_value(e) || !survives_minor((struct obj *)e->key)) continue;
+		e->key = AS_SYMBOL(evacuate((struct obj *)e->key));
+		e->value = evacuate(e->value);
+	}
+}
+
+static void purge_weak_table_minor(struct hashtab *ht) {
+	struct ht_entryarr *arr = ht->e;
+	for (size_t i = 0; i < arr->cap; ++i) {
+		struct ht_entry *e = &arr->entries[i];
+		if (entry_has_value(e) && !survives_minor((struct obj *)e->key)) {
+			delete_weak_entry(ht, e);
+		}
+	}
+}
+
+/* Get the nursery ready to allocate again. Pinned objects are promoted in place;
+ * everything else is dead or has been copied. */
+static void reset_nursery() {
+	if (!nursery_lo) return;
+	uintptr_t used_hi = nursery_page ? (uintptr_t)nursery_page + PAGE_SIZE : nursery_hi;
+	for (uintptr_t p = nursery_lo; p < used_hi; p += PAGE_SIZE) {
+		struct page *page = (struct page *)p;
+		memcpy(page->allocated, page->old, sizeof(page->allocated));
+	}
+	for (size_t i = 0; i < npinned; ++i) {
+		struct obj *o = pinned[i];
+		struct page *page = PAGE_OF(o);
+		size_t idx = GRANULE_IDX(page, o);
+		clear_mark(o);
+		SET_SLOT_BIT(page->allocated, idx);
+		SET_SLOT_BIT(page->old, idx);
+		color_new_old_object(o);
+		old_bytes += gc_object_size(o);
+		/* It's probably still being filled in */
+		gc_write_barrier(o);
+	}
+#ifdef DEBUG_GC
+	/* Scribble over everything that died or moved so that using a pointer nobody
+	 * registered goes wrong right away */
+	for (uintptr_t p = nursery_lo; p < used_hi; p += PAGE_SIZE) {
+		struct page *page = (struct page *)p;
+		char *cur = page->objs;
+		while (cur < page->top) {
+			char *old = next_old_object(page, cur);
+			if (old > page->top) old = page->top;
+			memset(cur, 0xdb, old - cur);
+			if (old == page->top) break;
+			cur = old + ((gc_object_size((struct obj *)old) + GRANULE - 1) & ~(size_t)(GRANULE - 1));
+		}
+	}
+#endif
+	/* The major collector may have freed some pinned objects since we last looked */
+	for (uintptr_t p = nursery_lo; p < nursery_hi; p += PAGE_SIZE) {
+		rewind_nursery_page((struct page *)p);
+	}
+#ifdef GC_STATS
+	gc_total_frees += nursery_allocs - nursery_copies - npinned;
+	nursery_allocs = nursery_copies = 0;
+#endif
+	npinned = 0;
+	nursery_page = (struct page *)nursery_lo;
+}
+
+/* Set when there's collection work for gc_step to do */
+static _Bool work_pending = 0;
+
+static void collect_nursery() {
+	if (collection_active) return;
+	collection_active = 1;
+	begin_pause();
+#ifdef GC_STATS
+	double start = gettime_perf();
+	++gc_minor_collections;
+#endif
+
+	/* The roots pin anything they point at */
+	for_each_root(pin_nursery_object);
+
+	/* Old objects that might point into the nursery */
+	scan_dirty_objects();
+	for_each_off_heap_object(0, scan_off_heap_object, NULL);
+
+	/* Old objects the roots point at may be in the middle of being filled in
+	 * (possibly having been promoted since they were allocated), so treat them
+	 * as dirty, now and at the next minor collection. This has to wait until
+	 * everything is pinned. */
+	for_each_root(scan_old_root);
+
+	/* interned_symbols's array is a root but the entries are weak */
+	if (interned_symbols.cap != 0) {
+		interned_symbols.e = (struct ht_entryarr *)evacuate((struct obj *)interned_symbols.e);
+	}
+
+	for (;;) {
+		while (to_scan.n != 0) {
+			scan_object(to_scan.items[--to_scan.n]);
+		}
+		for_each_weak_table(1, evacuate_weak_values);
+		if (to_scan.n == 0) break;
+	}
+	for_each_weak_table(1, purge_weak_table_minor);
+	forget_weak_tables(1);
+	reset_nursery();
+
+	if (phase != GC_IDLE || old_bytes >= next_major_at) {
+		work_pending = 1;
+	}
+
+#ifdef GC_STATS
+	time_minor += gettime_perf() - start;
+#endif
+	end_pause();
+	collection_active = 0;
+}
+
+/*** Major collection ***/
+
+/* How many objects to mark or sweep between looking at the clock */
 #ifdef DEBUG_GC
+#define SLICE_CHECK_INTERVAL 16
+#else
+#define SLICE_CHECK_INTERVAL 256
+#endif
+
+/* Where the sweeper is up to. Each size class keeps its own place. */
+static size_t sweep_class;
+static uintptr_t sweep_nursery;
+static struct large_obj **sweep_large_link;
+
+static void mark_root(uintptr_t ptr) {
+	struct obj *o = find_old_object(ptr);
+	if (o) gc_mark(o);
+}
+
+static void mark_field(struct obj **field, void *ctx) {
+	mark_root((uintptr_t)*field);
+}
+static void mark_off_heap_object(struct obj *o, void *ctx) {
+	for_each_field(o, mark_field, NULL);
+}
+
+static void start_marking() {
+	/* Empty the nursery first so that everything left is in the old generation */
+	collect_nursery();
+	collection_active = 1;
+#ifdef GC_STATS
+	double start = gettime_perf();
+#endif
+
+	/* Roots get marked (not just queued) right away: they can change without a
+	 * write barrier. */
+	phase = GC_MARKING;
+	for_each_root(mark_root);
+	for_each_off_heap_object(1, mark_off_heap_object, NULL);
+
+	/* interned_symbols's array is a root but the entries are weak */
+	if (interned_symbols.cap != 0) {
+		gc_mark((struct obj *)interned_symbols.e);
+	}
+
+#ifdef GC_STATS
+	time_rootfinding += gettime_perf() - start;
+#endif
+	collection_active = 0;
+}
+
+/* The nursery isn't part of a major collection, so anything in it survives */
+static _Bool survives_major(struct obj *o) {
+	return in_nursery(o) || is_marked(o);
+}
+
+static void queue_weak_values(struct hashtab *ht) {
+	struct ht_entryarr *arr = ht->e;
+	for (size_t i = 0; i < arr->cap; ++i) {
+		struct ht_entry *e = &arr->entries[i];
+		if (entry_has_value(e) && survives_major((struct obj *)e->key)) gc_queue(e->value);
+	}
+}
+
+/* Entries whose keys didn't get marked are about to be swept */
+static void purge_weak_table_major(struct hashtab *ht) {
+	struct ht_entryarr *arr = ht->e;
+	for (size_t i = 0; i < arr->cap; ++i) {
+		struct ht_entry *e = &arr->entries[i];
+		if (entry_has_value(e) && !survives_major((struct obj *)e->key)) {
+			delete_weak_entry(ht, e);
+		}
+	}
+}
+
+static void start_sweeping() {
+	for_each_weak_table(0, purge_weak_table_major);
+	forget_weak_tables(0);
+	phase = GC_SWEEPING;
+	++sweep_epoch;
+	sweep_class = 0;
+	for (size_t i = 0; i < NUM_SIZE_CLASSES; ++i) {
+		size_classes[i].sweep_link = &size_classes[i].pages;
+	}
+	sweep_nursery = nursery_lo;
+	sweep_large_link = &large_objects;
+}
+
+/*** Parallel marking ***/
+
+/* With more than one mark thread, marking is shared between that many threads
+ * (this one included). Each has a stack of objects that are marked but haven't
+ * been scanned yet, and a thread that runs out steals half of somebody else's.
+ * Mark bits are set atomically so only one thread pushes any object. */
+#define MAX_MARK_THREADS 64
+
+struct mark_stack {
+	struct mutex *lock;
+	struct obj **items;
+	volatile size_t n;
+	size_t cap;
+	/* weak tables this thread has scanned, linked through next_major */
+	struct weak_table *weak_tables;
+};
+
+static unsigned mark_threads = 1;
+static struct mark_stack mark_stacks[MAX_MARK_THREADS];
+static struct semaphore *mark_start, *mark_done;
+static volatile long idle_markers;
+static volatile _Bool stop_marking;
+static double mark_deadline;
+
+/* Caller holds the lock */
+static void mark_stack_push(struct mark_stack *stack, struct obj *o) {
+	if (stack->n == stack->cap) {
+		size_t newcap = stack->cap ? stack->cap * 2 : 1024;
+		struct obj **items = realloc(stack->items, newcap * sizeof(*items));
+		if (!items) {
+			fputs("Out of memory\n", stderr);
+			abort();
+		}
+		stack->items = items;
+		stack->cap = newcap;
+	}
+	stack->items[stack->n++] = o;
+}
+
+static void push_unmarked_field(struct obj **field, void *ctx) {
+	struct obj *o = *field;
+	struct mark_bit mb;
+	if (!find_mark_bit(o, &mb) || in_nursery(o)) return;
+	if (mark_bit_set(&mb) || !try_set_mark_bit(&mb)) return;
+	_mm_prefetch((const char *)o, _MM_HINT_T0);
+	mark_stack_push(ctx, o);
+}
+
+/* Move half of somebody else's stack onto ours */
+static _Bool steal_marking_work(unsigned self) {
+	struct mark_stack *own = &mark_stacks[self];
+	for (unsigned i = 1; i < mark_threads; ++i) {
+		unsigned other = (self + i) % mark_threads;
+		struct mark_stack *victim = &mark_stacks[other];
+		if (victim->n == 0) continue;
+		/* Always lock the lower-numbered stack first so two thieves can't deadlock */
+		struct mutex *first = other < self ? victim->lock : own->lock;
+		struct mutex *second = other < self ? own->lock : victim->lock;
+		mutex_lock(first);
+		mutex_lock(second);
+		size_t take = (victim->n + 1) / 2;
+		/* Take the oldest ones; they're likely to lead to the most work */
+		for (size_t j = 0; j < take; ++j) {
+			mark_stack_push(own, victim->items[j]);
+		}
+		memmove(victim->items, victim->items + take, (victim->n - take) * sizeof(*victim->items));
+		victim->n -= take;
+		mutex_unlock(second);
+		mutex_unlock(first);
+		if (take != 0) return 1;
+	}
+	return 0;
+}
+
+static _Bool anyone_has_marking_work() {
+	for (unsigned i = 0; i < mark_threads; ++i) {
+		if (mark_stacks[i].n != 0) return 1;
+	}
+	return 0;
+}
+
+static void mark_worker(unsigned self) {
+	struct mark_stack *own = &mark_stacks[self];
+	unsigned n = 0;
+	while (!stop_marking) {
+		mutex_lock(own->lock);
+		if (own->n != 0) {
+			struct obj *o = own->items[--own->n];
+			for_each_field(o, push_unmarked_field, own);
+			if (TYPE(o) == WEAKTABLE) {
+				AS_WEAK_TABLE(o)->next_major = own->weak_tables;
+				own->weak_tables = AS_WEAK_TABLE(o);
+			}
+			mutex_unlock(own->lock);
+			if (++n % SLICE_CHECK_INTERVAL == 0 && gettime_perf() >= mark_deadline) stop_marking = 1;
+			continue;
+		}
+		mutex_unlock(own->lock);
+		if (steal_marking_work(self)) continue;
+
+		/* Nothing to do. We're finished once everyone else is too. */
+		atomic_increment(&idle_markers);
+		for (;;) {
+			if (idle_markers == (long)mark_threads || stop_marking) return;
+			if (anyone_has_marking_work()) break;
+			thread_yield();
+		}
+		atomic_decrement(&idle_markers);
+	}
+}
+
+static void mark_thread_main(void *arg) {
+	unsigned self = (unsigned)(uintptr_t)arg;
+	for (;;) {
+		semaphore_wait(mark_start);
+		mark_worker(self);
+		semaphore_post(mark_done);
+	}
+}
+
+static void start_mark_threads() {
+	if (mark_start) return;
+	mark_start = semaphore_create();
+	mark_done = semaphore_create();
+	for (unsigned i = 0; i < mark_threads; ++i) {
+		mark_stacks[i].lock = mutex_create();
+		if (!mark_start || !mark_done || !mark_stacks[i].lock) {
+			fputs("Out of memory\n", stderr);
+			abort();
+		}
+	}
+	for (unsigned i = 1; i < mark_threads; ++i) {
+		if (!thread_start(mark_thread_main, (void *)(uintptr_t)i)) {
+			/* Make do with however many we got */
+			mark_threads = i;
+			break;
+		}
+	}
+}
+
+static void parallel_mark(double deadline) {
+	start_mark_threads();
+	/* Hand out the queue */
+	unsigned next = 0;
+	while (to_mark.n != 0) {
+		struct mark_bit mb;
+		struct obj *cur = from_mark_entry(to_mark.items[--to_mark.n], &mb);
+		if (mark_bit_set(&mb)) continue;
+		*mb.word |= mb.bit;
+		mark_stack_push(&mark_stacks[next], cur);
+		next = (next + 1) % mark_threads;
+	}
+
+	stop_marking = 0;
+	idle_markers = 0;
+	mark_deadline = deadline;
+	for (unsigned i = 1; i < mark_threads; ++i) semaphore_post(mark_start);
+	mark_worker(0);
+	for (unsigned i = 1; i < mark_threads; ++i) semaphore_wait(mark_done);
+
+	/* Out of time: put anything that didn't get scanned back in the queue. The
+	 * write barrier needs unscanned objects to look unmarked. */
+	for (unsigned i = 0; i < mark_threads; ++i) {
+		struct mark_stack *stack = &mark_stacks[i];
+		for (size_t j = 0; j < stack->n; ++j) {
+			struct mark_bit mb;
+			find_mark_bit(stack->items[j], &mb);
+			*mb.word &= ~mb.bit;
+			obj_stack_push(&to_mark, mark_entry(stack->items[j], &mb));
+		}
+		stack->n = 0;
+		while (stack->weak_tables) {
+			struct weak_table *t = stack->weak_tables;
+			stack->weak_tables = t->next_major;
+			t->next_major = major_weak_tables;
+			major_weak_tables = t;
+		}
+	}
+}
+
+void gc_set_mark_threads(unsigned n) {
+	if (mark_start) return; /* too late */
+	if (n < 1) n = 1;
+	if (n > MAX_MARK_THREADS) n = MAX_MARK_THREADS;
+	mark_threads = n;
+}
+
+/* Objects come off the mark stack into a small queue and get prefetched on the
+ * way in, so by the time we scan one it's usually in the cache */
+#define PREFETCH_DISTANCE 8
+
+static void mark_until(double deadline) {
+	struct obj *prefetched[PREFETCH_DISTANCE];
+	size_t head = 0, count = 0;
+	unsigned n = 0;
+	for (;;) {
+		while (count < PREFETCH_DISTANCE && to_mark.n != 0) {
+			struct obj *o = to_mark.items[--to_mark.n];
+			_mm_prefetch((const char *)((uintptr_t)o & ~(uintptr_t)LARGE_TAG), _MM_HINT_T0);
+			prefetched[(head + count++) % PREFETCH_DISTANCE] = o;
+		}
+		if (count == 0) return;
+		struct mark_bit mb;
+		struct obj *o = from_mark_entry(prefetched[head], &mb);
+		mark_with_bit(o, &mb);
+		head = (head + 1) % PREFETCH_DISTANCE;
+		--count;
+		if (++n % SLICE_CHECK_INTERVAL == 0 && gettime_perf() >= deadline) break;
+	}
+	/* Out of time */
+	while (count != 0) {
+		obj_stack_push(&to_mark, prefetched[head]);
+		head = (head + 1) % PREFETCH_DISTANCE;
+		--count;
+	}
+}
+
+/* Returns whether marking is finished */
+static _Bool mark_slice(double deadline) {
+#ifdef GC_STATS
+	double start = gettime_perf();
+#endif
+	for (;;) {
+		if (mark_threads > 1) {
+			parallel_mark(deadline);
+		} else {
+			mark_until(deadline);
+		}
+		if (to_mark.n != 0) break; /* out of time */
+		/* Everything else reachable is marked, but weak tables may have more */
+		for_each_weak_table(0, queue_weak_values);
+		if (to_mark.n == 0 || gettime_perf() >= deadline) break;
+	}
+#ifdef GC_STATS
+	time_marking += gettime_perf() - start;
+#endif
+	return to_mark.n == 0;
+}
+
+static void forget_dead_object(size_t size) {
+	old_bytes -= size;
+#ifdef GC_STATS
+	++gc_total_frees;
+#endif
+}
+
+static void sweep_page(struct page *page) {
+	for (size_t idx = 0; idx < page->nobjs; ++idx) {
+		if (page->allocated[idx / 64] == 0) {
+			/* skip a whole empty word at once */
+			idx |= 63;
+			continue;
+		}
+		if (!SLOT_BIT(page->allocated, idx)) continue;
+		if (SLOT_BIT(page->marks, idx * page->objsize / GRANULE)) continue;
+		forget_dead_object(page->objsize);
+		CLEAR_SLOT_BIT(page->allocated, idx);
+		struct free_slot *slot = (struct free_slot *)(page->objs + idx * page->objsize);
+		slot->next = page->freelist;
+		page->freelist = slot;
+		++page->nfree;
+	}
+	memset(page->marks, 0, MARK_BITMAP_SIZE);
+	page->swept_epoch = sweep_epoch;
+}
+
+/* Objects pinned in the nursery are part of the old generation too. Their space
+ * gets reused after the next minor collection. */
+static void sweep_nursery_page(struct page *page) {
+	for (size_t idx = 0; page->objs + idx * GRANULE < PAGE_END(page); ++idx) {
+		if (page->old[idx / 64] == 0) {
+			idx |= 63;
+			continue;
+		}
+		if (!SLOT_BIT(page->old, idx) || SLOT_BIT(page->marks, idx)) continue;
+		forget_dead_object(gc_object_size((struct obj *)(page->objs + idx * GRANULE)));
+		CLEAR_SLOT_BIT(page->old, idx);
+		CLEAR_SLOT_BIT(page->allocated, idx);
+	}
+	memset(page->marks, 0, MARK_BITMAP_SIZE);
+	page->swept_epoch = sweep_epoch;
+}
+
+static void free_large_object(struct large_obj *lo) {
+	if (lo->dirty) {
+		struct large_obj **link = &dirty_large_objects;
+		while (*link != lo) link = &(*link)->next_dirty;
+		*link = lo->next_dirty;
+	}
+	forget_dead_object(lo->size);
+#ifdef GC_STATS
+	gc_heap_bytes -= LARGE_OBJ_HEADER_SIZE + lo->size;
+#endif
+	ptrset_del(&all_large_objects, (uintptr_t)OBJ_OF_LARGE(lo));
+	free(lo);
+}
+
+/* Sweep the next page in `sc' that hasn't been swept yet. Returns 0 if there isn't one. */
+static _Bool sweep_next_page(struct size_class *sc) {
+	struct page *page;
+	do {
+		if (!sc->sweep_link) return 0;
+		page = *sc->sweep_link;
+		if (!page) {
+			sc->sweep_link = NULL;
+			return 0;
+		}
+		sc->sweep_link = &page->next;
+		/* New pages start out swept */
+	} while (page->swept_epoch == sweep_epoch);
+	_Bool was_full = page->nfree == 0;
+	sweep_page(page);
+	if (was_full && page->nfree != 0) {
+		page->next_avail = sc->avail;
+		sc->avail = page;
+	}
+	return 1;
+}
+
+/* `sc' is out of free slots, so sweep its pages until one turns up */
+static struct page *lazy_sweep(struct size_class *sc) {
+#ifdef GC_STATS
+	double start = gettime_perf();
+#endif
+	while (!sc->avail && sweep_next_page(sc)) {}
+#ifdef GC_STATS
+	time_lazy_sweeping += gettime_perf() - start;
+#endif
+	return sc->avail;
+}
+
+#ifdef GC_STATS
+/* Whether sweep_slice is part of a major collection or just keeping up */
+static double *sweep_timer = &time_sweeping;
+#endif
+
+/* Sweep until `deadline' or until `quota' pages' worth of work is done.
+ * Returns whether sweeping is finished. */
+static _Bool sweep_slice(double deadline, size_t quota) {
+#ifdef GC_STATS
+	double start = gettime_perf();
+#endif
+	/* A page counts for as much as SLICE_CHECK_INTERVAL objects */
+	size_t n = 0, since_check = 0;
+	_Bool done = 0;
+	while (!done && n / SLICE_CHECK_INTERVAL < quota) {
+		if (since_check >= SLICE_CHECK_INTERVAL) {
+			if (gettime_perf() >= deadline) break;
+			since_check = 0;
+		}
+		size_t work;
+		if (sweep_class < NUM_SIZE_CLASSES) {
+			if (!sweep_next_page(&size_classes[sweep_class])) {
+				++sweep_class;
+				continue;
+			}
+			work = SLICE_CHECK_INTERVAL;
+		} else if (sweep_nursery < nursery_hi) {
+			sweep_nursery_page((struct page *)sweep_nursery);
+			sweep_nursery += PAGE_SIZE;
+			work = SLICE_CHECK_INTERVAL;
+		} else if (*sweep_large_link) {
+			work = 1;
+			struct large_obj *lo = *sweep_large_link;
+			if (lo->swept_epoch == sweep_epoch) {
+				sweep_large_link = &lo->next;
+			} else if (lo->marks & 1) {
+				lo->marks = 0;
+				lo->swept_epoch = sweep_epoch;
+				sweep_large_link = &lo->next;
+			} else {
+				*sweep_large_link = lo->next;
+				free_large_object(lo);
+			}
+		} else {
+			done = 1;
+			break;
+		}
+		n += work;
+		since_check += work;
+	}
+#ifdef GC_STATS
+	*sweep_timer += gettime_perf() - start;
+#endif
+	return done;
+}
+
+static void set_major_trigger() {
+	next_major_at = (size_t)(live_after_major * heap_growth);
+	if (next_major_at < MIN_MAJOR_TRIGGER) next_major_at = MIN_MAJOR_TRIGGER;
+	/* Better to start early than to run into the limit */
+	if (max_heap != 0 && next_major_at > max_heap - NURSERY_BYTES) next_major_at = max_heap - NURSERY_BYTES;
+}
+
+/* Not worth moving everything around for less than this */
+#define MIN_COMPACT_BYTES ((size_t)4 << 20)
+
+/* Is most of the memory set aside for small objects going unused? */
+static _Bool fragmented() {
+	size_t used = 0, capacity = 0;
+	for (size_t i = 0; i < NUM_SIZE_CLASSES; ++i) {
+		for (struct page *page = size_classes[i].pages; page; page = page->next) {
+			used += (page->nobjs - page->nfree) * page->objsize;
+			capacity += PAGE_SIZE;
+		}
+	}
+	for (struct page *page = free_pages; page; page = page->next) {
+		capacity += PAGE_SIZE;
+	}
+#ifdef DEBUG_GC
+	/* Move things around as often as possible */
+	return capacity != 0;
+#else
+	return capacity >= MIN_COMPACT_BYTES && used * 2 < capacity;
+#endif
+}
+
+/* Give completely empty pages back so any size class can use them */
+static void finish_sweeping() {
+	for (size_t i = 0; i < NUM_SIZE_CLASSES; ++i) {
+		struct size_class *sc = &size_classes[i];
+		sc->avail = NULL;
+		struct page **link = &sc->pages;
+		while (*link) {
+			struct page *page = *link;
+			if (page->nfree == page->nobjs && !page->dirty) {
+				*link = page->next;
+				page->kind = PAGE_FREE;
+				page->objsize = 0;
+				page->nobjs = 0;
+				page->next = free_pages;
+				free_pages = page;
+				continue;
+			}
+			if (page->nfree != 0) {
+				page->next_avail = sc->avail;
+				sc->avail = page;
+			}
+			link = &page->next;
+		}
+	}
+
+	phase = GC_IDLE;
+	live_after_major = old_bytes;
+	set_major_trigger();
+	if (compaction && fragmented()) {
+		compact_soon = 1;
+		work_pending = 1;
+	}
+}
+
+/* Do major collection work until `deadline', sweeping at most `sweep_quota' pages.
+ * Returns whether the collection is finished. */
+static _Bool major_slice(double deadline, size_t sweep_quota) {
+	if (phase == GC_IDLE) start_marking();
+	collection_active = 1;
+	if (phase == GC_MARKING && mark_slice(deadline)) start_sweeping();
+	if (phase == GC_SWEEPING && sweep_slice(deadline, sweep_quota)) finish_sweeping();
+	collection_active = 0;
+	return phase == GC_IDLE;
+}
+
+static void finish_major() {
+	while (!major_slice(INFINITY, SIZE_MAX)) {}
+}
+
+void gc_collect() {
+	if (all_pages.size == 0 && all_large_objects.size == 0) return;
+	if (collection_active) return;
+	begin_pause();
+	/* Finish whatever's in progress, then start over so everything that's dead now is collected */
+	if (phase != GC_IDLE) finish_major();
+	finish_major();
+	end_pause();
+}
+
+/*** Compaction ***/
+
+/* Compaction runs right after a full collection, so everything in the heap is
+ * live and unmarked. Every small object that isn't on a page a root points into
+ * gets copied to a fresh slot, in depth-first order from the roots so that (for
+ * example) the cells of a list end up next to each other. The pages it leaves
+ * behind are empty, and whole chunks of them go back to the system. Objects
+ * don't record where their pointers come from, so this is done by tracing the
+ * heap once more, using the mark bit to mean "already updated". */
+
+/* The roots' objects can't move, so neither can anything else on their pages */
+static void pin_root_page(uintptr_t ptr) {
+	struct obj *o = find_old_object(ptr);
+	if (o && ptrset_contains(&all_pages, (uintptr_t)o & ~PAGE_MASK)) {
+		PAGE_OF(o)->evacuate = 0;
+	}
+}
+
+static void push_root(uintptr_t ptr) {
+	struct obj *o = find_old_object(ptr);
+	if (o && !is_marked(o)) {
+		set_mark(o);
+		mark_stack_push(&mark_stacks[0], o);
+	}
+}
+
+/* Point `*field' at wherever its object lives now, moving it first if it's on a
+ * page being evacuated */
+static void compact_field(struct obj **field, void *ctx) {
+	struct mark_stack *stack = ctx;
+	struct obj *o = *field;
+	uintptr_t ptr = (uintptr_t)o;
+	if (ptr < heap_min || ptr >= heap_max) return;
+	if (ptrset_contains(&all_pages, ptr & ~PAGE_MASK)) {
+		struct page *page = PAGE_OF(o);
+		if (page->evacuate) {
+			if (TYPE(o) != FORWARDED) {
+				struct obj *copy = alloc_small(size_class_for(page->objsize));
+				if (!copy) {
+					fputs("Out of memory\n", stderr);
+					abort();
+				}
+				memcpy(copy, o, page->objsize);
+				o->type = FORWARDED;
+				FORWARD_OF(o) = copy;
+				set_mark(copy);
+				mark_stack_push(stack, copy);
+			}
+			*field = FORWARD_OF(o);
+			return;
+		}
+	} else if (!ptrset_contains(&all_large_objects, ptr)) {
+		return; /* not a heap object */
+	}
+	if (!is_marked(o)) {
+		set_mark(o);
+		mark_stack_push(stack, o);
+	}
+}
+
+static void compact_off_heap_object(struct obj *o, void *ctx) {
+	for_each_field(o, compact_field, ctx);
+}
+
+/* Give back any chunk whose pages are all empty */
+static void release_empty_chunks() {
+	struct chunk *released = NULL;
+	struct chunk **link = &chunks;
+	while (*link) {
+		struct chunk *chunk = *link;
+		_Bool empty = 1;
+		for (int i = 0; i < PAGES_PER_CHUNK && empty; ++i) {
+			empty = ((struct page *)(chunk->first + i * PAGE_SIZE))->kind == PAGE_FREE;
+		}
+		if (!empty) {
+			link = &chunk->next;
+			continue;
+		}
+		for (int i = 0; i < PAGES_PER_CHUNK; ++i) {
+			ptrset_del(&all_pages, chunk->first + i * PAGE_SIZE);
+		}
+		*link = chunk->next;
+		chunk->next = released;
+		released = chunk;
+	}
+	if (!released) return;
+
+	struct page **plink = &free_pages;
+	while (*plink) {
+		if (ptrset_contains(&all_pages, (uintptr_t)*plink)) {
+			plink = &(*plink)->next;
+		} else {
+			*plink = (*plink)->next;
+		}
+	}
+	while (released) {
+		struct chunk *chunk = released;
+		released = chunk->next;
+		free(chunk->raw);
+		free(chunk->marks);
+		free(chunk);
+#ifdef GC_STATS
+		gc_heap_bytes -= (PAGES_PER_CHUNK + 1) * PAGE_SIZE + PAGES_PER_CHUNK * MARK_BITMAP_SIZE;
+#endif
+	}
+}
+
+static void compact_heap() {
+	/* Moving everything needs room for a second copy */
+	if (max_heap != 0 && 2 * old_bytes + NURSERY_BYTES > max_heap) return;
+	collection_active = 1;
+#ifdef GC_STATS
+	double start = gettime_perf();
+#endif
+
+	/* Take every page we're going to empty out of its size class so nothing gets copied onto it */
+	for (size_t i = 0; i < NUM_SIZE_CLASSES; ++i) {
+		for (struct page *page = size_classes[i].pages; page; page = page->next) {
+			page->evacuate = 1;
+		}
+	}
+	for_each_root(pin_root_page);
+	struct page *evacuating = NULL;
+	for (size_t i = 0; i < NUM_SIZE_CLASSES; ++i) {
+		struct size_class *sc = &size_classes[i];
+		sc->avail = NULL;
+		struct page **link = &sc->pages;
+		while (*link) {
+			struct page *page = *link;
+			if (page->evacuate) {
+				*link = page->next;
+				page->next = evacuating;
+				evacuating = page;
+				continue;
+			}
+			if (page->nfree != 0) {
+				page->next_avail = sc->avail;
+				sc->avail = page;
+			}
+			link = &page->next;
+		}
+	}
+	struct page **dlink = &dirty_pages;
+	while (*dlink) {
+		struct page *page = *dlink;
+		if (page->evacuate) {
+			*dlink = page->next_dirty;
+			page->dirty = 0;
+			page->next_dirty = NULL;
+		} else {
+			dlink = &page->next_dirty;
+		}
+	}
+
+	struct mark_stack *stack = &mark_stacks[0];
+	for_each_root(push_root);
+	for_each_off_heap_object(1, compact_off_heap_object, stack);
+	/* interned_symbols's array isn't a heap object's field but it can move all the same */
+	compact_field((struct obj **)&interned_symbols.e, stack);
+	while (stack->n != 0) {
+		struct obj *o = stack->items[--stack->n];
+		for_each_field(o, compact_field, stack);
+		if (TYPE(o) == WEAKHASHTABARR) {
+			/* Every entry left after a full collection is alive */
+			struct ht_entryarr *arr = (struct ht_entryarr *)o;
+			for (size_t i = 0; i < arr->cap; ++i) {
+				struct ht_entry *e = &arr->entries[i];
+				if (!entry_has_value(e)) continue;
+				compact_field((struct obj **)&e->key, stack);
+				compact_field(&e->value, stack);
+			}
+		}
+	}
+
+	while (evacuating) {
+		struct page *page = evacuating;
+		evacuating = page->next;
+		old_bytes -= (page->nobjs - page->nfree) * page->objsize;
+		page->kind = PAGE_FREE;
+		page->evacuate = 0;
+		page->objsize = 0;
+		page->nobjs = 0;
+		page->next = free_pages;
+		free_pages = page;
+	}
+	for (size_t i = 0; i < NUM_SIZE_CLASSES; ++i) {
+		for (struct page *page = size_classes[i].pages; page; page = page->next) {
+			memset(page->marks, 0, MARK_BITMAP_SIZE);
+		}
+	}
+	for (uintptr_t p = nursery_lo; p < nursery_hi; p += PAGE_SIZE) {
+		memset(((struct page *)p)->marks, 0, MARK_BITMAP_SIZE);
+	}
+	for (struct large_obj *lo = large_objects; lo; lo = lo->next) {
+		lo->marks = 0;
+	}
+	release_empty_chunks();
+
+	live_after_major = old_bytes;
+	set_major_trigger();
+#ifdef GC_STATS
+	time_compacting += gettime_perf() - start;
+#endif
+	collection_active = 0;
+}
+
+void gc_compact() {
+	if (all_pages.size == 0 && all_large_objects.size == 0) return;
+	if (collection_active) return;
+	begin_pause();
+	if (phase != GC_IDLE) finish_major();
+	finish_major();
+	compact_soon = 0;
+	compact_heap();
+	end_pause();
+}
+
+void gc_set_compaction(_Bool on) {
+	compaction = on;
+}
+
+void gc_set_pause_budget(unsigned long usec) {
+	pause_budget = usec / 1e6;
+}
+
+_Bool gc_set_heap_growth(double factor) {
+	if (!(factor > 1.)) return 0;
+	heap_growth = factor;
+	if (phase == GC_IDLE) set_major_trigger();
+	return 1;
+}
+
+_Bool gc_set_max_heap(size_t bytes) {
+	if (bytes != 0) {
+		if (bytes <= NURSERY_BYTES) return 0;
+		gc_collect();
+		if (old_bytes + NURSERY_BYTES > bytes) return 0;
+	}
+	max_heap = bytes;
+	if (phase == GC_IDLE) set_major_trigger();
+	return 1;
+}
+
+/* Make sure there's room for `size' more bytes in the old generation. If there
+ * isn't, even after a full collection, give up: it's better to stop now than to
+ * take the whole machine down with us. */
+static void enforce_max_heap(size_t size) {
+	if (max_heap == 0 || collection_active) return;
+	if (old_bytes + size + NURSERY_BYTES <= max_heap) return;
 	gc_collect();
+	if (old_bytes + size + NURSERY_BYTES <= max_heap) return;
+	fprintf(stderr, "Out of memory: the heap is limited to %zu bytes\n", max_heap);
+	exit(1);
+}
+
+void gc_step() {
+	if (!work_pending || collection_active) return;
+	work_pending = 0;
+	if (compact_soon && phase == GC_IDLE) {
+		gc_compact();
+		return;
+	}
+	begin_pause();
+	if (pause_budget != 0.) {
+		major_slice(gettime_perf() + pause_budget, SIZE_MAX);
+	} else if (phase == GC_SWEEPING) {
+		/* Sweep as many pages as a minor collection can fill so we keep ahead of promotion */
+#ifdef GC_STATS
+		sweep_timer = &time_lazy_sweeping;
+#endif
+		major_slice(INFINITY, NURSERY_PAGES);
+#ifdef GC_STATS
+		sweep_timer = &time_sweeping;
 #endif
-	struct obj *ret = calloc(1, size);
+	} else {
+		/* Mark all at once and leave the sweeping for later */
+		major_slice(INFINITY, 0);
+	}
+	end_pause();
+}
+
+void gc_idle() {
+	if (compact_soon) {
+		gc_compact();
+	} else if (pause_budget == 0.) {
+		gc_collect();
+	} else if (phase == GC_IDLE) {
+		/* Start a collection; it'll make progress while the next input runs */
+		work_pending = 1;
+	}
+}
+
+struct obj *gc_alloc(enum objtype typ, size_t size) {
+#ifdef DEBUG_GC
+	static unsigned debug_allocs = 0;
+	if (++debug_allocs % 8 == 0) {
+		if (compaction) {
+			gc_compact();
+		} else if (pause_budget == 0.) {
+			gc_collect();
+		} else if (!collection_active) {
+			/* as many tiny slices as possible */
+			begin_pause();
+			major_slice(0., SIZE_MAX);
+			end_pause();
+		}
+	} else {
+		collect_nursery();
+	}
+#endif
+	struct obj *ret = NULL;
+	if (size <= MAX_SMALL_SIZE) {
+		ret = alloc_nursery(size);
+		if (ret == NULL) {
+			collect_nursery();
+			/* If we're not getting to a safe point often enough, collect now */
+			if (old_bytes >= 2 * next_major_at) {
+				begin_pause();
+				if (phase != GC_IDLE) finish_major();
+				finish_major();
+				end_pause();
+			}
+			enforce_max_heap(0);
+			ret = alloc_nursery(size);
+		}
+	}
+	_Bool old = ret == NULL;
+	if (ret == NULL) {
+		enforce_max_heap(size);
+		ret = alloc_old(size);
+		if (ret) color_new_old_object(ret);
+	}
 	if (ret == NULL) {
 		gc_collect();
-		ret = calloc(1, size);
+		ret = alloc_old(size);
 		if (ret == NULL) {
 			fputs("Out of memory\n", stderr);
 			abort();
 		}
+		color_new_old_object(ret);
 	}
-	uintptr_t retaddr = (uintptr_t)ret;
-	add_allocation(retaddr);
 	ret->type = typ;
+	/* Fresh objects get filled in without a write barrier, so one that starts out
+	 * old has to be remembered in case it's given young pointers */
+	if (old) gc_write_barrier(ret);
 #ifdef GC_STATS
 	++gc_total_allocs;
 #endif
@@ -4,15 +4,86 @@
 
 void gc_init(void *bottom_of_stack);
 
+/* Roots. Any local that holds on to a heap pointer across something that can
+ * allocate has to be registered with GC_PROTECT first and unregistered with
+ * GC_UNPROTECT before it goes out of scope, innermost first. Registering takes
+ * the variable's address, so it can keep changing afterwards. Whatever a
+ * registered variable points at is pinned, so copies of it (e.g. arguments passed
+ * down from a caller that registered them) stay good too. Pointers into the
+ * middle of an object work except for large objects. */
+extern void **gc_roots;
+extern size_t gc_nroots, gc_roots_cap;
+void gc_grow_roots();
+static inline void gc_push_root(void *slot) {
+	if (gc_nroots == gc_roots_cap) gc_grow_roots();
+	gc_roots[gc_nroots++] = slot;
+}
+#define GC_PROTECT(var) gc_push_root(&(var))
+#define GC_UNPROTECT(n) (gc_nroots -= (n))
+/* Objects that live outside the heap but point into it, i.e. the continuations
+ * on the control stack (see cps.c). Whenever the collector looks at the roots it
+ * calls `each', which has to hand every one of them that's alive to `visit'. For
+ * a minor collection `all' is 0, and it can leave out any that haven't been
+ * changed since the last time they were visited. */
+void gc_set_off_heap_objects(void (*each)(_Bool all, void (*visit)(struct obj *o, void *ctx), void *ctx));
+/* Find roots by scanning the whole C stack for anything that looks like a pointer
+ * instead, and ignore GC_PROTECT. Has to be called before the first collection. */
+void gc_set_conservative_roots(_Bool conservative);
+
 /* Allocate an object of type `typ' and size `size' */
 struct obj *gc_alloc(enum objtype typ, size_t size);
 /* Manually collect garbage. */
 void gc_collect();
+/* Spread major collections over slices of at most `usec' microseconds instead of
+ * doing them all at once. 0 (the default) turns this off. */
+void gc_set_pause_budget(unsigned long usec);
+/* Start a major collection once the old generation has grown by `factor' since
+ * the last one. Returns 0 (and does nothing) unless `factor' is more than 1. */
+_Bool gc_set_heap_growth(double factor);
+/* Never let the heap grow past `bytes'; running out is a fatal error. 0 means no
+ * limit. Returns 0 (and does nothing) if the heap is already that big. */
+_Bool gc_set_max_heap(size_t bytes);
+/* Collect everything, then move the survivors next to each other so the pages
+ * they were scattered over can go back to the system. Objects the roots point at
+ * (and everything sharing their pages) stay put. */
+void gc_compact();
+/* Compact instead of doing a normal major collection whenever the last one left
+ * more than half the old generation's pages empty */
+void gc_set_compaction(_Bool on);
+/* Share marking between `n' threads. Has to be called before the first collection. */
+void gc_set_mark_threads(unsigned n);
+/* Called by the evaluator between steps. Collection work happens here when it can. */
+void gc_step();
+/* The program is waiting for something (e.g. REPL input), so now's a good time to collect. */
+void gc_idle();
+/* Must be called before storing a pointer into `obj' unless `obj' is only
+ * reachable from the stack (e.g. it was just allocated). `obj' may point into the
+ * middle of a small object (e.g. at a struct hashtab inside a struct env) but must
+ * point at the start of a large one. */
+void gc_write_barrier(void *obj);
+/* Must be called on an object loaded out of a weak reference before it's used */
+void gc_read_weak(void *obj);
 
 #ifdef GC_STATS
 extern unsigned long long gc_total_allocs;
 extern unsigned long long gc_total_frees;
+extern unsigned long long gc_minor_collections;
+extern unsigned long long gc_bytes_promoted;
 extern double time_rootfinding;
 extern double time_marking;
+/* Sweeping done as part of a major collection, and sweeping left for later
+ * (by allocation or in small steps after minor collections) */
 extern double time_sweeping;
+extern double time_lazy_sweeping;
+extern double time_minor;
+extern double time_compacting;
+/* Memory the heap currently holds from the system */
+extern size_t gc_heap_bytes;
+/* Bucket i counts pauses shorter than GC_PAUSE_BUCKET_LIMIT(i) microseconds
+ * (and at least as long as the bucket before it); the last bucket is everything longer. */
+#define GC_PAUSE_BUCKETS 12
+#define GC_PAUSE_BUCKET_LIMIT(i) (16UL << (i))
+extern unsigned long long gc_pause_histogram[GC_PAUSE_BUCKETS];
+extern double gc_max_pause;
+extern double gc_total_pause;
 #endif
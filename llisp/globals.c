@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <math.h>
 #include <stdio.h>
@@ -7,6 +8,7 @@
 #include "env.h"
 #include "gc.h"
 #include "globals.h"
+#include "hashtab-private.h"
 #include "obj.h"
 #include "print.h"
 
@@ -60,7 +62,9 @@ static struct obj *fn_if(CPS_ARGS) {
 	resume->data = CDR(obj);
 	resume->fn = resumeif;
 
+	GC_PROTECT(resume);
 	*ret = dupcontn(self);
+	GC_UNPROTECT(1);
 	(*ret)->next = resume;
 	(*ret)->fn = eval_cps;
 	return CAR(obj);
@@ -97,18 +101,22 @@ static struct obj *fn_quote(CPS_ARGS) {
 }
 
 static struct obj *set_symbol_cps(const char *fnname, struct obj *(*next)(CPS_ARGS), struct obj *sym, struct obj *defn, struct contn *self, struct contn **ret) {
-	if (TYPE(sym) != SYMBOL) {
+	if (TYPE(sym) != SYMBOL && TYPE(sym) != LOCALREF) {
 		fprintf(stderr, "%s: must define a symbol\n", fnname);
 		*ret = &cfail;
 		return NIL;
 	}
+	GC_PROTECT(sym);
+	GC_PROTECT(defn);
 	struct contn *resume = dupcontn(self);
 	resume->data = sym;
 	resume->fn = next;
 
+	GC_PROTECT(resume);
 	*ret = dupcontn(self);
 	(*ret)->next = resume;
 	(*ret)->fn = eval_cps;
+	GC_UNPROTECT(3);
 	return defn;
 }
 
@@ -120,7 +128,12 @@ static struct obj *fn_define(CPS_ARGS) {
 		struct obj *name = CAR(CAR(obj));
 		struct obj *args = CDR(CAR(obj));
 		struct obj *body = CDR(obj);
-		struct obj *lambda = cons(intern_symbol(str_from_string_lit("lambda")), cons(args, body));
+		GC_PROTECT(name);
+		struct obj *lambda = cons(args, body);
+		GC_PROTECT(lambda);
+		struct obj *lambda_sym = intern_symbol(str_from_string_lit("lambda"));
+		lambda = cons(lambda_sym, lambda);
+		GC_UNPROTECT(2);
 		return set_symbol_cps("define", do_definesym, name, lambda, self, ret);
 	}
 	if (!check_args("define", obj, 2)) {
@@ -131,6 +144,11 @@ static struct obj *fn_define(CPS_ARGS) {
 }
 /* obj = eval(defn), self->data = sym */
 static struct obj *do_definesym(CPS_ARGS) {
+	if (TYPE(self->data) == LOCALREF) {
+		defineslot(self->env, AS_LOCAL_REF(self->data), obj);
+		*ret = self->next;
+		return NIL;
+	}
 	definesym(self->env, AS_SYMBOL(self->data), obj);
 	*ret = self->next;
 	return NIL;
@@ -148,9 +166,11 @@ static struct obj *fn_set_(CPS_ARGS) {
 }
 /* obj = eval(defn), self->data = sym */
 static struct obj *do_setsym(CPS_ARGS) {
-	if (!setsym(self->env, AS_SYMBOL(self->data), obj)) {
+	_Bool is_local = TYPE(self->data) == LOCALREF;
+	struct string *name = is_local ? AS_LOCAL_REF(self->data)->name : AS_SYMBOL(self->data);
+	if (is_local ? !setslot(self->env, AS_LOCAL_REF(self->data), obj) : !setsym(self->env, name, obj)) {
 		fputs("set!: symbol \"", stderr);
-		print_str_escaped(stderr, AS_SYMBOL(self->data));
+		print_str_escaped(stderr, name);
 		fputs("\" does not exist\n", stderr);
 		*ret = &cfail;
 		return NIL;
@@ -159,99 +179,70 @@ static struct obj *do_setsym(CPS_ARGS) {
 	return NIL;
 }
 
-static struct obj *fn_set_cell(const char* name, void (*actually_set)(struct obj *cell, struct obj *value), CPS_ARGS) {
-	if (!check_args(name, obj, 2)) {
-		*ret = &cfail;
-		return NIL;
-	}
-	if (TYPE(CAR(obj)) != CELL) {
+static struct obj *fn_set_cell(const char* name, void (*actually_set)(struct obj *cell, struct obj *value), FN_ARGS) {
+	if (TYPE(argv[0]) != CELL) {
 		fprintf(stderr, "%s: object not a pair\n", name);
 		*ret = &cfail;
 		return NIL;
 	}
-	actually_set(CAR(obj), CAR(CDR(obj)));
+	actually_set(argv[0], argv[1]);
 	*ret = self->next;
 	return NIL;
 }
 
 static void do_set_car(struct obj *cell, struct obj *value) {
+	gc_write_barrier(cell);
 	CAR(cell) = value;
 }
-static struct obj *fn_set_car_(CPS_ARGS) {
-	return fn_set_cell("set-car!", do_set_car, self, obj, ret);
+static struct obj *fn_set_car_(FN_ARGS) {
+	return fn_set_cell("set-car!", do_set_car, self, argc, argv, ret);
 }
 
 static void do_set_cdr(struct obj *cell, struct obj *value) {
+	gc_write_barrier(cell);
 	CDR(cell) = value;
 }
-static struct obj *fn_set_cdr_(CPS_ARGS) {
-	return fn_set_cell("set-cdr!", do_set_cdr, self, obj, ret);
+static struct obj *fn_set_cdr_(FN_ARGS) {
+	return fn_set_cell("set-cdr!", do_set_cdr, self, argc, argv, ret);
 }
 
-static struct obj *fn_car(CPS_ARGS) {
-	if (!check_args("car", obj, 1)) {
-		*ret = &cfail;
-		return NIL;
-	}
-	if (TYPE(CAR(obj)) != CELL) {
+static struct obj *fn_car(FN_ARGS) {
+	if (TYPE(argv[0]) != CELL) {
 		fputs("car: object not a pair\n", stderr);
 		*ret = &cfail;
 		return NIL;
 	}
 	*ret = self->next;
-	return CAR(CAR(obj));
+	return CAR(argv[0]);
 }
-static struct obj *fn_cdr(CPS_ARGS) {
-	if (!check_args("cdr", obj, 1)) {
-		*ret = &cfail;
-		return NIL;
-	}
-	if (TYPE(CAR(obj)) != CELL) {
+static struct obj *fn_cdr(FN_ARGS) {
+	if (TYPE(argv[0]) != CELL) {
 		fputs("cdr: object not a pair\n", stderr);
 		*ret = &cfail;
 		return NIL;
 	}
 	*ret = self->next;
-	return CDR(CAR(obj));
+	return CDR(argv[0]);
 }
-static struct obj *fn_cons(CPS_ARGS) {
-	if (!check_args("cons", obj, 2)) {
-		*ret = &cfail;
-		return NIL;
-	}
+static struct obj *fn_cons(FN_ARGS) {
 	*ret = self->next;
-	return cons(CAR(obj), CAR(CDR(obj)));
+	return cons(argv[0], argv[1]);
 }
 
-static struct obj *fn_pair_(CPS_ARGS) {
-	if (!check_args("pair?", obj, 1)) {
-		*ret = &cfail;
-		return NIL;
-	}
+static struct obj *fn_pair_(FN_ARGS) {
 	*ret = self->next;
-	return TYPE(CAR(obj)) == CELL ? TRUE : FALSE;
+	return TYPE(argv[0]) == CELL ? TRUE : FALSE;
 }
 
-static struct obj *fn_symbol_(CPS_ARGS) {
-	if (!check_args("symbol?", obj, 1)) {
-		*ret = &cfail;
-		return NIL;
-	}
+static struct obj *fn_symbol_(FN_ARGS) {
 	*ret = self->next;
-	return TYPE(CAR(obj)) == SYMBOL ? TRUE : FALSE;
+	return TYPE(argv[0]) == SYMBOL ? TRUE : FALSE;
 }
 
-static struct obj *fn_gensym(CPS_ARGS) {
+static struct obj *fn_gensym(FN_ARGS) {
 	static int symnum = 0;
-	int len = length(obj);
-	if (len == 1) {
+	if (argc == 1) {
 		fputs("gensym: custom prefix not yet implemented, using \" gensym\"\n", stderr);
-		len = 0;
-	}
-	if (len) {
-		fputs("gensym: expected 0 or 1 args\n", stderr);
-		*ret = &cfail;
-		return NIL;
 	}
 
 	char buf[32];
@@ -262,29 +253,23 @@ static struct obj *fn_gensym(CPS_ARGS) {
 	return intern_symbol(make_str_from_ptr_len(buf, slen));
 }
 
-static struct obj *fn_eq_(CPS_ARGS) {
-	if (!check_args("eq?", obj, 2)) {
-		*ret = &cfail;
-		return NIL;
-	}
+static struct obj *fn_eq_(FN_ARGS) {
 	*ret = self->next;
-	struct obj *a = CAR(obj);
-	struct obj *b = CAR(CDR(obj));
+	struct obj *a = argv[0];
+	struct obj *b = argv[1];
 	if (TYPE(a) == NUM && TYPE(b) == NUM) {
+		if (IS_INT(a) != IS_INT(b)) return FALSE;
+		if (IS_INT(a)) return AS_INT(a) == AS_INT(b) ? TRUE : FALSE;
 		return AS_NUM(a) == AS_NUM(b) ? TRUE : FALSE;
 	}
 	return a == b ? TRUE : FALSE;
 }
 
-static struct obj *fn_display(CPS_ARGS) {
-	if (!check_args("display", obj, 1)) {
-		*ret = &cfail;
-		return NIL;
-	}
-	display(CAR(obj));
+static struct obj *fn_display(FN_ARGS) {
+	display(argv[0]);
 	repl_needs_newline = 1;
-	if (TYPE(CAR(obj)) == STRING) {
-		struct string *s = AS_STRING(CAR(obj));
+	if (TYPE(argv[0]) == STRING) {
+		struct string *s = AS_STRING(argv[0]);
 		if (s->len > 0 && s->str[s->len - 1] == '\n') {
 			repl_needs_newline = 0;
 		}
@@ -292,64 +277,68 @@ static struct obj *fn_display(CPS_ARGS) {
 	*ret = self->next;
 	return NIL;
 }
-static struct obj *fn_write(CPS_ARGS) {
-	if (!check_args("write", obj, 1)) {
-		*ret = &cfail;
-		return NIL;
-	}
-	print(CAR(obj));
+static struct obj *fn_write(FN_ARGS) {
+	print(argv[0]);
 	repl_needs_newline = 1;
 	*ret = self->next;
 	return NIL;
 }
-static struct obj *fn_newline(CPS_ARGS) {
-	if (!check_args("newline", obj, 0)) {
-		*ret = &cfail;
-		return NIL;
-	}
+static struct obj *fn_newline(FN_ARGS) {
 	putchar('\n');
 	repl_needs_newline = 0;
 	*ret = self->next;
 	return NIL;
 }
 
-static struct obj *fn_callcc(CPS_ARGS) {
-	if (!check_args("call-with-current-continuation", obj, 1)) {
-		*ret = &cfail;
-		return NIL;
-	}
+/* obj = fn, call fn with self->next as a value */
+static struct obj *callcc_capture(CPS_ARGS) {
+	GC_PROTECT(obj);
+	struct contn *k = capture_contn(self->next);
+	GC_PROTECT(k);
+	struct obj *args = cons((struct obj *) k, NIL);
+	args = cons(obj, args);
+	GC_UNPROTECT(2);
 	*ret = dupcontn(self);
+	/* Carry on from the copy too, so capturing it again doesn't copy anything */
+	(*ret)->next = k;
 	(*ret)->fn = eval_cps;
-	return cons(CAR(obj), cons((struct obj *) self->next, NIL));
+	return args;
 }
 
-static struct obj *fn_error(CPS_ARGS) {
+static struct obj *fn_callcc(FN_ARGS) {
+	/* Capture it once we're back in the trampoline: the VM doesn't finish
+	 * self->next until we've returned */
+	*ret = dupcontn(self);
+	(*ret)->fn = callcc_capture;
+	return argv[0];
+}
+
+static struct obj *fn_error(FN_ARGS) {
 	(void)self;
 	fputs("Error", stderr);
-	if (TYPE(obj) == CELL) {
+	if (argc != 0) {
 		putc(':', stderr);
-		while (obj != NIL) {
+		for (int i = 0; i < argc; ++i) {
 			putc(' ', stderr);
-			print_on(stderr, CAR(obj), 0);
-			obj = CDR(obj);
+			print_on(stderr, argv[i], 0);
 		}
 	}
 	putc('\n', stderr);
 	*ret = &cfail;
-	return obj;
+	return NIL;
 }
 
-static struct obj *fn_apply(CPS_ARGS) {
-	if (!check_args("apply", obj, 2)) {
-		*ret = &cfail;
-		return NIL;
-	}
-	struct obj* fun = CAR(obj);
+static struct obj *fn_apply(FN_ARGS) {
 	*ret = dupcontn(self);
+	struct obj* fun = argv[0];
 	if (TYPE(fun) == CONTN) {
 		(*ret)->data = fun;
 		(*ret)->fn = apply_contn;
-	} else if (TYPE(fun) == FN || TYPE(fun) == SPECFORM) {
+	} else if (TYPE(fun) == FN) {
+		/* The list gets spread back out */
+		(*ret)->data = fun;
+		(*ret)->fn = apply_fn;
+	} else if (TYPE(fun) == SPECFORM) {
 		/* Just call the function */
 		(*ret)->data = NIL;
 		(*ret)->fn = AS_FN(fun)->fn;
@@ -357,7 +346,7 @@ static struct obj *fn_apply(CPS_ARGS) {
 		(*ret)->data = fun;
 		(*ret)->fn = apply_closure;
 	}
-	return CAR(CDR(obj));
+	return argv[1];
 }
 
 static struct obj *cons_with_true(CPS_ARGS) {
@@ -365,12 +354,8 @@ static struct obj *cons_with_true(CPS_ARGS) {
 	return cons(obj, TRUE);
 }
 
-static struct obj *fn_macroexpand_1(CPS_ARGS) {
-	if (!check_args("macroexpand-1", obj, 1)) {
-		*ret = &cfail;
-		return NIL;
-	}
-	struct obj *form = CAR(obj);
+static struct obj *fn_macroexpand_1(FN_ARGS) {
+	struct obj *form = argv[0];
 	if (TYPE(form) != CELL || TYPE(CAR(form)) != SYMBOL) {
 		// Not a simple application
 		*ret = self->next;
@@ -383,19 +368,24 @@ static struct obj *fn_macroexpand_1(CPS_ARGS) {
 		*ret = self->next;
 		return cons(form, FALSE);
 	}
+	GC_PROTECT(form);
+	GC_PROTECT(fun);
 	struct contn *finish = dupcontn(self);
 	finish->data = NIL;
 	finish->fn = cons_with_true;
 
+	GC_PROTECT(finish);
 	*ret = dupcontn(self);
 	(*ret)->data = fun;
 	(*ret)->next = finish;
 	(*ret)->fn = apply_closure;
+	GC_UNPROTECT(3);
 	return CDR(form);
 }
 
 static struct obj *make_closure_validate(const char *name, enum objtype type, struct obj *args, struct obj *body, struct env *env) {
-	if (args != NIL && TYPE(args) != SYMBOL && TYPE(args) != CELL) {
+	/* the macroexpander already checked resolved params */
+	if (TYPE(args) != SCOPE && args != NIL && TYPE(args) != SYMBOL && TYPE(args) != CELL) {
 		fprintf(stderr, "%s: expected symbol or list of symbols\n", name);
 		return NIL;
 	}
@@ -444,7 +434,9 @@ static struct obj *fn_defmacro(CPS_ARGS) {
 	struct obj *name = CAR(CAR(obj));
 	struct obj *args = CDR(CAR(obj));
 	struct obj *body = CDR(obj);
+	GC_PROTECT(name);
 	struct obj *macro = make_closure_validate("defmacro", MACRO, args, body, self->env);
+	GC_UNPROTECT(1);
 	if (!macro) {
 		*ret = &cfail;
 		return NIL;
@@ -455,64 +447,91 @@ static struct obj *fn_defmacro(CPS_ARGS) {
 	return NIL;
 }
 
-static struct obj *fn_number_(CPS_ARGS) {
-	if (!check_args("number?", obj, 1)) {
-		*ret = &cfail;
-		return NIL;
-	}
+static struct obj *fn_number_(FN_ARGS) {
 	*ret = self->next;
-	return TYPE(CAR(obj)) == NUM ? TRUE : FALSE;
+	return TYPE(argv[0]) == NUM ? TRUE : FALSE;
+}
+
+/* Exact arithmetic. These return 0 instead of overflowing (or, for division,
+ * instead of rounding) and leave `*r' alone. */
+static _Bool int_add(int64_t a, int64_t b, int64_t *r) {
+	if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) return 0;
+	*r = a + b;
+	return 1;
+}
+static _Bool int_sub(int64_t a, int64_t b, int64_t *r) {
+	if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b)) return 0;
+	*r = a - b;
+	return 1;
+}
+static _Bool int_mul(int64_t a, int64_t b, int64_t *r) {
+	if (a == 0 || b == 0) {
+		*r = 0;
+		return 1;
+	}
+	if ((a == -1 && b == INT64_MIN) || (b == -1 && a == INT64_MIN)) return 0;
+	int64_t prod = (int64_t)((uint64_t)a * (uint64_t)b);
+	if (prod / b != a) return 0;
+	*r = prod;
+	return 1;
+}
+static _Bool int_div(int64_t a, int64_t b, int64_t *r) {
+	if (b == 0 || (a == INT64_MIN && b == -1) || a % b != 0) return 0;
+	*r = a / b;
+	return 1;
 }
 
 #define ARITH_OPS(arith) \
-	arith(fn_plus, +) \
-	arith(fn_minus, -) \
-	arith(fn_times, *) \
-	arith(fn_div, /, if(AS_NUM(CAR(obj))==0.){fputs("Warning: /: divide by zero\n", stderr);})
+	arith(fn_plus, +, int_add) \
+	arith(fn_minus, -, int_sub) \
+	arith(fn_times, *, int_mul) \
+	arith(fn_div, /, int_div, if(AS_NUM(argv[i])==0.){fputs("Warning: /: divide by zero\n", stderr);})
 #define NONNUM(arg, op) \
 	if (TYPE(arg) != NUM) { \
 		fputs(#op ": argument not a number\n", stderr); \
 		*ret = &cfail; \
 		return NIL; \
 	}
-#define ARITH_FN(name, op, ...) \
-static struct obj *name(CPS_ARGS) { \
-	if (obj == NIL) { \
-		fputs(#op ": no arguments given\n", stderr); \
-		*ret = &cfail; \
-		return NIL; \
+/* Stay exact until an argument isn't or the result won't fit */
+#define ARITH_STEP(op, int_op, arg) \
+	if (exact && !(IS_INT(arg) && int_op(ival, AS_INT(arg), &ival))) { \
+		exact = 0; \
+		val = (double)ival; \
 	} \
-	NONNUM(CAR(obj), op) \
-	double val = AS_NUM(CAR(obj)); \
-	for (obj = CDR(obj); TYPE(obj) == CELL; obj = CDR(obj)) { \
-		NONNUM(CAR(obj), op) \
+	if (!exact) val = val op AS_NUM(arg);
+#define ARITH_FN(name, op, int_op, ...) \
+static struct obj *name(FN_ARGS) { \
+	NONNUM(argv[0], op) \
+	_Bool exact = IS_INT(argv[0]); \
+	int64_t ival = exact ? AS_INT(argv[0]) : 0; \
+	double val = AS_NUM(argv[0]); \
+	for (int i = 1; i < argc; ++i) { \
+		NONNUM(argv[i], op) \
 		__VA_ARGS__ \
-		val = val op AS_NUM(CAR(obj)); \
+		ARITH_STEP(op, int_op, argv[i]) \
 	} \
-	if (obj != NIL) { \
-		NONNUM(obj, op) \
-		__VA_ARGS__ \
-		val = val op AS_NUM(obj); \
-	} \
-	struct obj *retobj = make_num(val); \
+	struct obj *retobj = exact ? make_int(ival) : make_num(val); \
 	*ret = self->next; \
 	return retobj; \
 }
 ARITH_OPS(ARITH_FN)
 #undef ARITH_FN
+#undef ARITH_STEP
 #undef NONNUM
-static struct obj *fn_mod(CPS_ARGS) {
-	if (!check_args("%", obj, 2)) {
-		*ret = &cfail;
-		return NIL;
-	}
-	if (TYPE(CAR(obj)) != NUM || TYPE(CAR(CDR(obj))) != NUM) {
+static struct obj *fn_mod(FN_ARGS) {
+	if (TYPE(argv[0]) != NUM || TYPE(argv[1]) != NUM) {
 		fputs("%: argument not a number\n", stderr);
 		*ret = &cfail;
 		return NIL;
 	}
 	*ret = self->next;
-	return make_num(fmod(AS_NUM(CAR(obj)), AS_NUM(CAR(CDR(obj)))));
+	struct obj *a = argv[0];
+	struct obj *b = argv[1];
+	if (IS_INT(a) && IS_INT(b) && AS_INT(b) != 0) {
+		/* INT64_MIN % -1 overflows */
+		return make_int(AS_INT(b) == -1 ? 0 : AS_INT(a) % AS_INT(b));
+	}
+	return make_num(fmod(AS_NUM(a), AS_NUM(b)));
 }
 
 #define COMPARE_OPS(compare) \
@@ -522,164 +541,277 @@ static struct obj *fn_mod(CPS_ARGS) {
 	compare(fn_cmple, <=, <=) \
 	compare(fn_cmpge, >=, >=)
 #define COMPARE_FN(cname, lispname, op) \
-static struct obj *cname(CPS_ARGS) { \
-	if (!check_args(#lispname, obj, 2)) { \
-		*ret = &cfail; \
-		return NIL; \
-	} \
-	if (TYPE(CAR(obj)) != NUM || TYPE(CAR(CDR(obj))) != NUM) { \
+static struct obj *cname(FN_ARGS) { \
+	if (TYPE(argv[0]) != NUM || TYPE(argv[1]) != NUM) { \
 		fputs(#lispname ": argument not a number\n", stderr); \
 		*ret = &cfail; \
 		return NIL; \
 	} \
 	*ret = self->next; \
-	return (AS_NUM(CAR(obj)) op AS_NUM(CAR(CDR(obj)))) ? TRUE : FALSE; \
+	struct obj *a = argv[0]; \
+	struct obj *b = argv[1]; \
+	if (IS_INT(a) && IS_INT(b)) { \
+		return (AS_INT(a) op AS_INT(b)) ? TRUE : FALSE; \
+	} \
+	return (AS_NUM(a) op AS_NUM(b)) ? TRUE : FALSE; \
 }
 COMPARE_OPS(COMPARE_FN)
 #undef COMPARE_FN
 
-static struct obj *fn_string_(CPS_ARGS) {
-	if (!check_args("string?", obj, 1)) {
-		*ret = &cfail;
-		return NIL;
-	}
+static struct obj *fn_string_(FN_ARGS) {
 	*ret = self->next;
-	return TYPE(CAR(obj)) == STRING ? TRUE : FALSE;
+	return TYPE(argv[0]) == STRING ? TRUE : FALSE;
 }
 
-static struct obj *fn_string_append(CPS_ARGS) {
-	if (length(obj) < 0) {
-		fputs("string-append: args must be a proper list\n", stderr);
-		*ret = &cfail;
-		return NIL;
-	}
-	struct obj *cur = obj;
+static struct obj *fn_string_append(FN_ARGS) {
 	size_t cap = 0;
-	for (; cur != NIL; cur = CDR(cur)) {
-		if (TYPE(CAR(cur)) != STRING) {
+	for (int i = 0; i < argc; ++i) {
+		if (TYPE(argv[i]) != STRING) {
 			fputs("string-append: expected string, given ", stderr);
-			print_on(stderr, CAR(cur), 1);
+			print_on(stderr, argv[i], 1);
 			fputc('\n', stderr);
 			*ret = &cfail;
 			return NIL;
 		}
-		cap += AS_STRING(CAR(cur))->len;
+		cap += AS_STRING(argv[i])->len;
 	}
 	struct string *result = unsafe_make_uninitialized_str(cap);
-	cur = obj;
 	char *dest = result->str;
-	for (cur = obj; cur != NIL; cur = CDR(cur)) {
-		memcpy(dest, AS_STRING(CAR(cur))->str, AS_STRING(CAR(cur))->len);
-		dest += AS_STRING(CAR(cur))->len;
+	for (int i = 0; i < argc; ++i) {
+		memcpy(dest, AS_STRING(argv[i])->str, AS_STRING(argv[i])->len);
+		dest += AS_STRING(argv[i])->len;
 	}
 	*ret = self->next;
 	return (struct obj *) result;
 }
 
-static struct obj *fn_string_compare(CPS_ARGS) {
-	if (!check_args("string-compare", obj, 2)) {
-		*ret = &cfail;
-		return NIL;
-	}
-	if (TYPE(CAR(obj)) != STRING || TYPE(CAR(CDR(obj))) != STRING) {
+static struct obj *fn_string_compare(FN_ARGS) {
+	if (TYPE(argv[0]) != STRING || TYPE(argv[1]) != STRING) {
 		fputs("string-compare: expected string, given ", stderr);
-		if (TYPE(CAR(obj)) != STRING) {
-			print_on(stderr, CAR(obj), 1);
+		if (TYPE(argv[0]) != STRING) {
+			print_on(stderr, argv[0], 1);
 		} else {
-			print_on(stderr, CAR(CDR(obj)), 1);
+			print_on(stderr, argv[1], 1);
 		}
 		fputc('\n', stderr);
 		*ret = &cfail;
 		return NIL;
 	}
 	*ret = self->next;
-	return make_num(stringcmp(AS_STRING(CAR(obj)), AS_STRING(CAR(CDR(obj)))));
+	return make_int(stringcmp(AS_STRING(argv[0]), AS_STRING(argv[1])));
 }
 
-static struct obj *fn_string_length(CPS_ARGS) {
-	if (!check_args("string-length", obj, 1)) {
-		*ret = &cfail;
-		return NIL;
-	}
-	if (TYPE(CAR(obj)) != STRING) {
+static struct obj *fn_string_length(FN_ARGS) {
+	if (TYPE(argv[0]) != STRING) {
 		fputs("string-length: expected string, given ", stderr);
-		print_on(stderr, CAR(obj), 1);
+		print_on(stderr, argv[0], 1);
 		fputc('\n', stderr);
 		*ret = &cfail;
 		return NIL;
 	}
 	*ret = self->next;
-	return make_num((double)(AS_STRING(CAR(obj))->len));
+	return make_int((int64_t)AS_STRING(argv[0])->len);
 }
 
-static struct obj *fn_substring(CPS_ARGS) {
-	int nargs = length(obj);
-	if (nargs < 0) {
-		fputs("substring: args must be a proper list", stderr);
-		*ret = &cfail;
-		return NIL;
-	}
-	if (nargs < 2 || nargs > 3) {
-		fprintf(stderr, "substring: expected 2 or 3 args, got %d\n", nargs);
-		*ret = &cfail;
-		return NIL;
-	}
-	if (TYPE(CAR(obj)) != STRING) {
+static _Bool is_integer(struct obj *obj) {
+	return TYPE(obj) == NUM && IS_INT(obj);
+}
+
+static struct obj *fn_substring(FN_ARGS) {
+	if (TYPE(argv[0]) != STRING) {
 		fputs("substring: expected string, given ", stderr);
-		print_on(stderr, CAR(obj), 1);
+		print_on(stderr, argv[0], 1);
 		fputc('\n', stderr);
 		*ret = &cfail;
 		return NIL;
 	}
-	if (TYPE(CAR(CDR(obj))) != NUM || (nargs == 3 && TYPE(CAR(CDR(CDR(obj)))) != NUM)) {
-		fputs("substring: expected number, given ", stderr);
-		if (TYPE(CAR(CDR(obj))) != NUM) {
-			print_on(stderr, CAR(CDR(obj)), 1);
+	if (!is_integer(argv[1]) || (argc == 3 && !is_integer(argv[2]))) {
+		fputs("substring: expected integer, given ", stderr);
+		if (!is_integer(argv[1])) {
+			print_on(stderr, argv[1], 1);
 		} else {
-			print_on(stderr, CAR(CDR(CDR(obj))), 1);
+			print_on(stderr, argv[2], 1);
 		}
 		fputc('\n', stderr);
 		*ret = &cfail;
 		return NIL;
 	}
-	size_t len = AS_STRING(CAR(obj))->len;
+	size_t len = AS_STRING(argv[0])->len;
 
-	double startd = AS_NUM(CAR(CDR(obj)));
-	if (startd < 0) {
+	int64_t starti = AS_INT(argv[1]);
+	if (starti < 0) {
 		fputs("substring: given negative start\n", stderr);
 		*ret = &cfail;
 		return NIL;
 	}
-	size_t start = (size_t)startd;
-	if (startd != round(startd)) {
-		fprintf(stderr, "Warning: substring: given non-integer %f, treating as %zu\n", startd, start);
-	}
-	if (start > len) {
-		fprintf(stderr, "substring: start %zu greater than string length %zu\n", start, len);
+	size_t start = (size_t)starti;
+	if (starti > (int64_t)len) {
+		fprintf(stderr, "substring: start %" PRId64 " greater than string length %zu\n", starti, len);
 		*ret = &cfail;
 		return NIL;
 	}
 
-	size_t end = AS_STRING(CAR(obj))->len;
-	if (nargs == 3) {
-		double endd = AS_NUM(CAR(CDR(CDR(obj))));
-		end = (size_t)endd;
-		if (endd != round(endd)) {
-			fprintf(stderr, "Warning: substring: given non-integer %f, treating as %zu\n", endd, end);
+	size_t end = AS_STRING(argv[0])->len;
+	if (argc == 3) {
+		int64_t endi = AS_INT(argv[2]);
+		if (endi < starti) {
+			fprintf(stderr, "substring: end %" PRId64 " before start %zu\n", endi, start);
+			*ret = &cfail;
+			return NIL;
 		}
-		if (end < start) {
-			fprintf(stderr, "substring: end %zu before start %zu\n", end, start);
+		if (endi > (int64_t)len) {
+			fprintf(stderr, "substring: end %" PRId64 " greater than string length %zu\n", endi, len);
 			*ret = &cfail;
 			return NIL;
 		}
-		if (end > len) {
-			fprintf(stderr, "substring: end %zu greater than string length %zu\n", end, len);
+		end = (size_t)endi;
+	}
+	*ret = self->next;
+	return (struct obj *) make_str_from_ptr_len(AS_STRING(argv[0])->str + start, end - start);
+}
+
+static struct obj *fn_gc_compact(FN_ARGS) {
+	gc_compact();
+	*ret = self->next;
+	return NIL;
+}
+
+static struct obj *fn_gc_set_heap_growth_(FN_ARGS) {
+	if (TYPE(argv[0]) != NUM || !gc_set_heap_growth(AS_NUM(argv[0]))) {
+		fputs("gc-set-heap-growth!: expected a number more than 1, given ", stderr);
+		print_on(stderr, argv[0], 1);
+		fputc('\n', stderr);
+		*ret = &cfail;
+		return NIL;
+	}
+	*ret = self->next;
+	return NIL;
+}
+
+/* (gc-set-max-heap! megabytes), where 0 means no limit */
+static struct obj *fn_gc_set_max_heap_(FN_ARGS) {
+	if (TYPE(argv[0]) != NUM || AS_NUM(argv[0]) < 0) {
+		fputs("gc-set-max-heap!: expected a non-negative number, given ", stderr);
+		print_on(stderr, argv[0], 1);
+		fputc('\n', stderr);
+		*ret = &cfail;
+		return NIL;
+	}
+	if (!gc_set_max_heap((size_t)(AS_NUM(argv[0]) * (1 << 20)))) {
+		fputs("gc-set-max-heap!: the heap is already bigger than that\n", stderr);
+		*ret = &cfail;
+		return NIL;
+	}
+	*ret = self->next;
+	return NIL;
+}
+
+static struct obj *fn_make_weak_hash_table(FN_ARGS) {
+	*ret = self->next;
+	return make_weak_table();
+}
+
+static struct obj *fn_weak_hash_table_(FN_ARGS) {
+	*ret = self->next;
+	return TYPE(argv[0]) == WEAKTABLE ? TRUE : FALSE;
+}
+
+/* Make sure the args start with a weak hash table and (if there's a second arg) a symbol */
+static _Bool check_table_args(const char *fn, int argc, struct obj **argv) {
+	if (TYPE(argv[0]) != WEAKTABLE) {
+		fprintf(stderr, "%s: expected weak hash table, given ", fn);
+		print_on(stderr, argv[0], 1);
+		fputc('\n', stderr);
+		return 0;
+	}
+	if (argc > 1 && TYPE(argv[1]) != SYMBOL) {
+		fprintf(stderr, "%s: keys must be symbols, given ", fn);
+		print_on(stderr, argv[1], 1);
+		fputc('\n', stderr);
+		return 0;
+	}
+	return 1;
+}
+
+/* (hash-table-ref table key . default) */
+static struct obj *fn_hash_table_ref(FN_ARGS) {
+	if (!check_table_args("hash-table-ref", argc, argv)) {
+		*ret = &cfail;
+		return NIL;
+	}
+	struct obj *value = hashtab_get(&AS_WEAK_TABLE(argv[0])->table, AS_SYMBOL(argv[1]));
+	if (!value) {
+		if (argc == 2) {
+			fputs("hash-table-ref: no such key ", stderr);
+			print_on(stderr, argv[1], 1);
+			fputc('\n', stderr);
 			*ret = &cfail;
 			return NIL;
 		}
+		value = argv[2];
+	} else {
+		gc_read_weak(value);
 	}
 	*ret = self->next;
-	return (struct obj *) make_str_from_ptr_len(AS_STRING(CAR(obj))->str + start, end - start);
+	return value;
+}
+
+static struct obj *fn_hash_table_set_(FN_ARGS) {
+	if (!check_table_args("hash-table-set!", argc, argv)) {
+		*ret = &cfail;
+		return NIL;
+	}
+	hashtab_put(&AS_WEAK_TABLE(argv[0])->table, AS_SYMBOL(argv[1]), argv[2]);
+	*ret = self->next;
+	return NIL;
+}
+
+static struct obj *fn_hash_table_delete_(FN_ARGS) {
+	if (!check_table_args("hash-table-delete!", argc, argv)) {
+		*ret = &cfail;
+		return NIL;
+	}
+	hashtab_del(&AS_WEAK_TABLE(argv[0])->table, AS_SYMBOL(argv[1]));
+	*ret = self->next;
+	return NIL;
+}
+
+static struct obj *fn_hash_table_contains_(FN_ARGS) {
+	if (!check_table_args("hash-table-contains?", argc, argv)) {
+		*ret = &cfail;
+		return NIL;
+	}
+	*ret = self->next;
+	return hashtab_exists(&AS_WEAK_TABLE(argv[0])->table, AS_SYMBOL(argv[1])) ? TRUE : FALSE;
+}
+
+static struct obj *fn_hash_table_count(FN_ARGS) {
+	if (!check_table_args("hash-table-count", argc, argv)) {
+		*ret = &cfail;
+		return NIL;
+	}
+	*ret = self->next;
+	return make_int((int64_t)AS_WEAK_TABLE(argv[0])->table.size);
+}
+
+static struct obj *fn_hash_table_keys(FN_ARGS) {
+	if (!check_table_args("hash-table-keys", argc, argv)) {
+		*ret = &cfail;
+		return NIL;
+	}
+	struct hashtab *ht = &AS_WEAK_TABLE(argv[0])->table;
+	struct obj *keys = NIL;
+	GC_PROTECT(ht);
+	/* cons can move the entries, so look them up fresh every time */
+	for (size_t i = 0; i < ht->cap; ++i) {
+		struct ht_entry *e = &ht->e->entries[i];
+		if (!entry_has_value(e)) continue;
+		gc_read_weak(e->key);
+		keys = cons((struct obj *)e->key, keys);
+	}
+	GC_UNPROTECT(1);
+	*ret = self->next;
+	return keys;
 }
 
 static inline _Bool is_real_symbol(struct obj *obj, struct env *env, struct obj *(*fn)(CPS_ARGS)) {
@@ -699,43 +831,68 @@ _Bool is_real_defmacro(struct obj *obj, struct env *env) {
 _Bool is_real_quote(struct obj *obj, struct env *env) {
 	return is_real_symbol(obj, env, fn_quote);
 }
+_Bool is_real_if(struct obj *obj, struct env *env) {
+	return is_real_symbol(obj, env, fn_if);
+}
+_Bool is_real_set(struct obj *obj, struct env *env) {
+	return is_real_symbol(obj, env, fn_set_);
+}
+
+static void define_fn(struct env *env, const char *name, struct obj *val) {
+	GC_PROTECT(val);
+	definesym(env, AS_SYMBOL(intern_symbol(make_str_from_ptr_len(name, strlen(name)))), val);
+	GC_UNPROTECT(1);
+}
 
 void add_globals(struct env *env) {
-#define DEFSYM(name, fn, type) definesym(env, str_from_string_lit(#name), make_fn(type, fn, #name))
-	DEFSYM(apply, fn_apply, FN);
-	DEFSYM(call-with-current-continuation, fn_callcc, FN);
-	DEFSYM(car, fn_car, FN);
-	DEFSYM(cdr, fn_cdr, FN);
-	DEFSYM(cons, fn_cons, FN);
-	DEFSYM(define, fn_define, SPECFORM);
-	DEFSYM(defmacro, fn_defmacro, SPECFORM);
-	DEFSYM(display, fn_display, FN);
-	DEFSYM(eq?, fn_eq_, FN);
-	DEFSYM(error, fn_error, FN);
-	DEFSYM(gensym, fn_gensym, FN);
-	DEFSYM(if, fn_if, SPECFORM);
-	DEFSYM(lambda, fn_lambda, SPECFORM);
-	DEFSYM(macroexpand-1, fn_macroexpand_1, FN);
-	DEFSYM(newline, fn_newline, FN);
-	DEFSYM(number?, fn_number_, FN);
-	DEFSYM(pair?, fn_pair_, FN);
-	DEFSYM(quote, fn_quote, SPECFORM);
-	DEFSYM(set!, fn_set_, SPECFORM);
-	DEFSYM(set-car!, fn_set_car_, FN);
-	DEFSYM(set-cdr!, fn_set_cdr_, FN);
-	DEFSYM(string?, fn_string_, FN);
-	DEFSYM(string-append, fn_string_append, FN);
-	DEFSYM(string-compare, fn_string_compare, FN);
-	DEFSYM(string-length, fn_string_length, FN);
-	DEFSYM(substring, fn_substring, FN);
-	DEFSYM(symbol?, fn_symbol_, FN);
-	DEFSYM(write, fn_write, FN);
-#define REGISTER_FN(name, op, ...) DEFSYM(op, name, FN);
+#define DEFFN(name, fn, min_args, max_args) define_fn(env, #name, make_fn(fn, min_args, max_args, #name))
+#define DEFSPECFORM(name, fn) define_fn(env, #name, make_specform(fn, #name))
+	DEFFN(apply, fn_apply, 2, 2);
+	DEFFN(call-with-current-continuation, fn_callcc, 1, 1);
+	DEFFN(car, fn_car, 1, 1);
+	DEFFN(cdr, fn_cdr, 1, 1);
+	DEFFN(cons, fn_cons, 2, 2);
+	DEFSPECFORM(define, fn_define);
+	DEFSPECFORM(defmacro, fn_defmacro);
+	DEFFN(display, fn_display, 1, 1);
+	DEFFN(eq?, fn_eq_, 2, 2);
+	DEFFN(error, fn_error, 0, ANY_ARGS);
+	DEFFN(gc-compact, fn_gc_compact, 0, 0);
+	DEFFN(gc-set-heap-growth!, fn_gc_set_heap_growth_, 1, 1);
+	DEFFN(gc-set-max-heap!, fn_gc_set_max_heap_, 1, 1);
+	DEFFN(gensym, fn_gensym, 0, 1);
+	DEFFN(hash-table-contains?, fn_hash_table_contains_, 2, 2);
+	DEFFN(hash-table-count, fn_hash_table_count, 1, 1);
+	DEFFN(hash-table-delete!, fn_hash_table_delete_, 2, 2);
+	DEFFN(hash-table-keys, fn_hash_table_keys, 1, 1);
+	DEFFN(hash-table-ref, fn_hash_table_ref, 2, 3);
+	DEFFN(hash-table-set!, fn_hash_table_set_, 3, 3);
+	DEFSPECFORM(if, fn_if);
+	DEFSPECFORM(lambda, fn_lambda);
+	DEFFN(macroexpand-1, fn_macroexpand_1, 1, 1);
+	DEFFN(make-weak-hash-table, fn_make_weak_hash_table, 0, 0);
+	DEFFN(newline, fn_newline, 0, 0);
+	DEFFN(number?, fn_number_, 1, 1);
+	DEFFN(pair?, fn_pair_, 1, 1);
+	DEFSPECFORM(quote, fn_quote);
+	DEFSPECFORM(set!, fn_set_);
+	DEFFN(set-car!, fn_set_car_, 2, 2);
+	DEFFN(set-cdr!, fn_set_cdr_, 2, 2);
+	DEFFN(string?, fn_string_, 1, 1);
+	DEFFN(string-append, fn_string_append, 0, ANY_ARGS);
+	DEFFN(string-compare, fn_string_compare, 2, 2);
+	DEFFN(string-length, fn_string_length, 1, 1);
+	DEFFN(substring, fn_substring, 2, 3);
+	DEFFN(symbol?, fn_symbol_, 1, 1);
+	DEFFN(weak-hash-table?, fn_weak_hash_table_, 1, 1);
+	DEFFN(write, fn_write, 1, 1);
+#define REGISTER_FN(name, op, ...) DEFFN(op, name, 1, ANY_ARGS);
 	ARITH_OPS(REGISTER_FN)
 #undef REGISTER_FN
-	DEFSYM(%, fn_mod, FN);
-#define REGISTER_FN(cname, lispname, ...) DEFSYM(lispname, cname, FN);
+	DEFFN(%, fn_mod, 2, 2);
+#define REGISTER_FN(cname, lispname, ...) DEFFN(lispname, cname, 2, 2);
 	COMPARE_OPS(REGISTER_FN)
 #undef REGISTER_FN
-#undef DEFSYM
+#undef DEFSPECFORM
+#undef DEFFN
 }
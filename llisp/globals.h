@@ -8,6 +8,8 @@ _Bool is_real_lambda(struct obj *obj, struct env *env);
 _Bool is_real_define(struct obj *obj, struct env *env);
 _Bool is_real_defmacro(struct obj *obj, struct env *env);
 _Bool is_real_quote(struct obj *obj, struct env *env);
+_Bool is_real_if(struct obj *obj, struct env *env);
+_Bool is_real_set(struct obj *obj, struct env *env);
 
 /* Help the REPL be more fluent */
 extern _Bool repl_needs_newline;
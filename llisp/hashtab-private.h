@@ -0,0 +1,22 @@
+#pragma once
+#include "hashtab.h"
+#include "obj.h"
+
+#define TOMBSTONE ((struct string *)1)
+
+struct ht_entry {
+	struct string *key;
+	struct obj *value;
+};
+
+/* The backing array of a hashtable. It's a heap object in its own right so
+ * it carries its capacity for the benefit of the GC. */
+struct ht_entryarr {
+	struct obj o;
+	size_t cap;
+	struct ht_entry entries[1];
+};
+
+static inline _Bool entry_has_value(struct ht_entry *e) {
+	return e && e->key && e->key != TOMBSTONE;
+}
@@ -1,21 +1,10 @@
 #include <assert.h>
 #include "gc.h"
-#include "hashtab.h"
+#include "hashtab-private.h"
 #include "obj.h"
 
 #define INITIAL_HASHTAB_CAPACITY 16
 #define MAX_LOAD_FACTOR 0.66
-#define TOMBSTONE ((struct string *)1)
-
-struct ht_entry {
-	struct string *key;
-	struct obj *value;
-};
-
-struct ht_entryarr {
-	struct obj o;
-	struct ht_entry entries[1];
-};
 
 void init_hashtab(struct hashtab *ht) {
 	ht->size = 0;
@@ -26,7 +15,7 @@ void init_hashtab(struct hashtab *ht) {
 
 /* Implementation of Bob Jenkins's one-at-a-time hash taken from
  * https://en.wikipedia.org/wiki/Jenkins_hash_function */
-uint32_t jenkins_oaat_hash(struct string *key) {
+uint32_t string_hash(struct string *key) {
 	char *cur = key->str;
 	char *end = cur + key->len;
 	uint32_t hash = 0;
@@ -41,18 +30,15 @@ uint32_t jenkins_oaat_hash(struct string *key) {
 	return hash;
 }
 
-static inline _Bool entry_has_value(struct ht_entry *e) {
-	return e && e->key && e->key != TOMBSTONE;
-}
-
 static struct ht_entry *hashtab_find(struct ht_entry *entries, size_t cap, struct string *key) {
 	size_t target, cur;
 	struct ht_entry *first_tombstone = NULL;
 	if (cap == 0) return NULL;
-	target = cur = jenkins_oaat_hash(key) % cap;
+	_Bool is_symbol = TYPE(&key->o) == SYMBOL;
+	target = cur = (is_symbol ? key->hash : string_hash(key)) % cap;
 	do {
 		struct string *curkey = entries[cur].key;
-		if (curkey != TOMBSTONE && stringeq(key, curkey)) {
+		if (curkey == key || (!is_symbol && curkey != TOMBSTONE && stringeq(key, curkey))) {
 			/* Found the entry! */
 			return &entries[cur];
 		}
@@ -72,10 +58,28 @@ static struct ht_entry *hashtab_find(struct ht_entry *entries, size_t cap, struc
 	return first_tombstone;
 }
 
+static struct ht_entryarr *alloc_entryarr(enum objtype type, size_t cap) {
+	struct ht_entryarr *arr = (struct ht_entryarr *) gc_alloc(type, offsetof(struct ht_entryarr, entries) + cap * sizeof(struct ht_entry));
+	arr->cap = cap;
+	/* arr may have gone straight to the old generation */
+	gc_write_barrier(arr);
+	return arr;
+}
+
+void init_weak_hashtab(struct hashtab *ht) {
+	init_hashtab(ht);
+	GC_PROTECT(ht);
+	struct ht_entryarr *arr = alloc_entryarr(WEAKHASHTABARR, INITIAL_HASHTAB_CAPACITY);
+	GC_UNPROTECT(1);
+	ht->cap = INITIAL_HASHTAB_CAPACITY;
+	gc_write_barrier(ht);
+	ht->e = arr;
+}
+
 static void hashtab_embiggen(struct hashtab *ht) {
 	size_t i;
 	size_t newcap = ht->cap ? ht->cap + ht->cap / 2 : INITIAL_HASHTAB_CAPACITY;
-	struct ht_entryarr *newtab = (struct ht_entryarr *) gc_alloc(HASHTABARR, offsetof(struct ht_entryarr, entries) + newcap * sizeof(struct ht_entry));
+	struct ht_entryarr *newtab = alloc_entryarr(ht->e ? TYPE(&ht->e->o) : HASHTABARR, newcap);
 	for (i = 0; i < ht->cap; ++i) {
 		struct ht_entry *cur = &ht->e->entries[i];
 		if (entry_has_value(cur)) {
@@ -85,16 +89,25 @@ static void hashtab_embiggen(struct hashtab *ht) {
 	}
 	ht->cap = newcap;
 	ht->used_slots = ht->size;
+	gc_write_barrier(ht);
 	ht->e = newtab;
 }
 
 void hashtab_put(struct hashtab *ht, struct string *key, struct obj *value) {
 	if (ht->cap == 0 || (double)ht->used_slots / (double)ht->cap >= MAX_LOAD_FACTOR) {
+		/* `ht' is usually inside another object */
+		GC_PROTECT(ht);
+		GC_PROTECT(key);
+		GC_PROTECT(value);
 		hashtab_embiggen(ht);
+		GC_UNPROTECT(3);
 	}
 	struct ht_entry *e = hashtab_find(ht->e->entries, ht->cap, key);
 	assert(e);
 	if (!e) return;
+	gc_write_barrier(ht->e);
+	/* The GC gets to weak entries through the table, not the array */
+	if (TYPE(&ht->e->o) == WEAKHASHTABARR) gc_write_barrier(ht);
 	if (e->key == NULL) {
 		/* Took up another slot. */
 		++ht->used_slots;
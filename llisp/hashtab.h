@@ -1,4 +1,5 @@
 #pragma once
+#include <stdint.h>
 #include <stdlib.h>
 
 struct ht_entryarr;
@@ -6,7 +7,11 @@ struct obj;
 struct string;
 
 /* Hash table 
- * Supports insertion, lookup, and deletion */
+ * Supports insertion, lookup, and deletion
+ *
+ * Symbols are interned, so a symbol key only ever matches itself and lookups
+ * compare pointers and use the symbol's cached hash. Plain string keys get
+ * hashed and compared by their contents. */
 struct hashtab {
 	/* Number of entries in the hashtable */
 	size_t size;
@@ -21,6 +26,11 @@ struct hashtab {
 /* Initialize an empty hashtable */
 void init_hashtab(struct hashtab *ht);
 
+/* Initialize an empty hashtable whose keys are weak references: the GC deletes
+ * entries whose keys aren't reachable some other way. It has to live inside a
+ * struct weak_table (or be interned_symbols) for the GC to find it. */
+void init_weak_hashtab(struct hashtab *ht);
+
 /* Statically initialize hashtable */
 #define EMPTY_HASHTAB { 0, 0, 0, NULL }
 
@@ -39,3 +49,6 @@ void hashtab_del(struct hashtab *ht, struct string *key);
 typedef void(*visit_entry)(struct string *key, struct obj *value, void *context);
 /* Invoke `f` on every entry in the hashtable */
 void hashtab_foreach(struct hashtab *ht, visit_entry f, void *context);
+
+/* Hash a string's contents */
+uint32_t string_hash(struct string *s);
@@ -0,0 +1,620 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bytecode.h"
+#include "cps.h"
+#include "env-private.h"
+#include "jit.h"
+#include "print.h"
+#include "vm-private.h"
+
+_Bool use_jit = 0;
+
+#ifdef HAVE_JIT
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * A template JIT. Each instruction of a hot lambda body turns into a fixed bit
+ * of x86-64 that does the same thing the interpreter would, so there's no
+ * dispatch between them. Native code only does the instructions that don't
+ * need a continuation, plus calls to builtins and calls and returns between
+ * bytecode, which jump straight to the other code's native code if it has
+ * some. For anything else (a call to a lambda that eval_cps made, OP_EVAL, or
+ * anything that's about to fail) it hands the pc back to execute, which does
+ * that one instruction the usual way and then lets native code carry on.
+ * Native code can be started at any instruction, so `offsets' has an entry
+ * point for each. It all saves and uses the same registers, so it can jump
+ * from one lambda's code to another's.
+ *
+ * While native code runs:
+ *   rbx = the struct vm
+ *   r12 = the top of the stack, where the next push goes
+ *   r13 = vm->code->consts, reloaded after anything that could move it
+ *   r14 = where to store r12 on the way out
+ * Native code is never freed, but there's only ever one per lambda in the
+ * source. It's listed in /tmp/perf-<pid>.map so perf knows whose it is.
+ */
+struct jit_code {
+	struct native_code header;
+	unsigned char *native;
+	size_t size;
+	/* where each instruction starts in `native', by pc */
+	uint32_t offsets[1];
+};
+
+/* How native code starts: at `entry', which must be one of native's offsets */
+typedef uint32_t (*native_fn)(struct vm *vm, struct obj ***sp, const unsigned char *entry);
+
+struct asm_buf {
+	unsigned char *bytes;
+	size_t len;
+	size_t cap;
+};
+
+static void emit_bytes(struct asm_buf *b, const void *bytes, size_t n) {
+	if (b->len + n > b->cap) {
+		size_t cap = b->cap ? b->cap * 2 : 256;
+		while (cap < b->len + n) cap *= 2;
+		unsigned char *grown = realloc(b->bytes, cap);
+		if (!grown) {
+			fputs("Out of memory\n", stderr);
+			abort();
+		}
+		b->bytes = grown;
+		b->cap = cap;
+	}
+	memcpy(b->bytes + b->len, bytes, n);
+	b->len += n;
+}
+#define EMIT(b, ...) emit_bytes(b, (const unsigned char[]){ __VA_ARGS__ }, sizeof((const unsigned char[]){ __VA_ARGS__ }))
+
+static void emit_u32(struct asm_buf *b, uint32_t x) {
+	emit_bytes(b, &x, sizeof(x));
+}
+static void emit_u64(struct asm_buf *b, uint64_t x) {
+	emit_bytes(b, &x, sizeof(x));
+}
+
+/* A jump whose target is filled in later by land or land32 */
+static size_t jump32(struct asm_buf *b, unsigned char cc) {
+	if (cc == 0xE9) {
+		EMIT(b, 0xE9, 0, 0, 0, 0);
+	} else {
+		EMIT(b, 0x0F, cc, 0, 0, 0, 0);
+	}
+	return b->len - 4;
+}
+static void land32(struct asm_buf *b, size_t at) {
+	uint32_t rel = (uint32_t)(b->len - (at + 4));
+	memcpy(b->bytes + at, &rel, sizeof(rel));
+}
+#define JMP 0xE9
+#define JB 0x82
+#define JAE 0x83
+#define JNE 0x85
+
+/* A short jump whose target is filled in later by land */
+static size_t jump8(struct asm_buf *b, unsigned char opcode) {
+	EMIT(b, opcode, 0);
+	return b->len - 1;
+}
+static void land(struct asm_buf *b, size_t at) {
+	size_t dist = b->len - (at + 1);
+	if (dist > 127) {
+		fputs("jit: short jump out of range\n", stderr);
+		abort();
+	}
+	b->bytes[at] = (unsigned char)dist;
+}
+
+/* rel32 from the end of the 4 bytes at `at' to `target' */
+static void patch32(struct asm_buf *b, size_t at, size_t target) {
+	uint32_t rel = (uint32_t)((int64_t)target - (int64_t)(at + 4));
+	memcpy(b->bytes + at, &rel, sizeof(rel));
+}
+
+/* mov rax, imm64; call rax */
+static void emit_call(struct asm_buf *b, void *fn) {
+	EMIT(b, 0x48, 0xB8);
+	emit_u64(b, (uintptr_t)fn);
+	EMIT(b, 0xFF, 0xD0);
+}
+
+/* r13 = vm->code->consts */
+static void load_consts(struct asm_buf *b) {
+	EMIT(b, 0x4C, 0x8B, 0xAB); /* mov r13, [rbx + code] */
+	emit_u32(b, offsetof(struct vm, code));
+	EMIT(b, 0x49, 0x81, 0xC5); /* add r13, consts */
+	emit_u32(b, offsetof(struct bytecode, consts));
+}
+
+/* reg = consts[k], with reg's ModRM bits for [r13 + disp32] */
+static void load_const(struct asm_buf *b, unsigned char modrm, uint32_t k) {
+	EMIT(b, 0x49, 0x8B, modrm);
+	emit_u32(b, k * sizeof(struct obj *));
+}
+#define RAX_R13 0x85
+#define RSI_R13 0xB5
+
+/* push rax onto the VM's stack */
+static void push_rax(struct asm_buf *b) {
+	EMIT(b, 0x49, 0x89, 0x04, 0x24); /* mov [r12], rax */
+	EMIT(b, 0x49, 0x83, 0xC4, 0x08); /* add r12, 8 */
+}
+
+/* Return `pc' (or NATIVE_LEAVE) to jit_run */
+static void exit_at(struct asm_buf *b, uint32_t pc, size_t epilogue) {
+	EMIT(b, 0xB8); /* mov eax, pc */
+	emit_u32(b, pc);
+	EMIT(b, 0xE9); /* jmp epilogue */
+	emit_u32(b, 0);
+	patch32(b, b->len - 4, epilogue);
+}
+
+/* Call fn(vm, consts[k], top of the stack) */
+static void call_with_top(struct asm_buf *b, void *fn, uint32_t k) {
+	EMIT(b, 0x48, 0x89, 0xDF); /* mov rdi, rbx */
+	load_const(b, RSI_R13, k);
+	EMIT(b, 0x49, 0x8B, 0x54, 0x24, 0xF8); /* mov rdx, [r12 - 8] */
+	emit_call(b, fn);
+	load_consts(b);
+}
+
+/* top of the stack = () */
+static void replace_top_with_nil(struct asm_buf *b) {
+	EMIT(b, 0x48, 0xB9); /* mov rcx, NIL */
+	emit_u64(b, (uintptr_t)NIL);
+	EMIT(b, 0x49, 0x89, 0x4C, 0x24, 0xF8); /* mov [r12 - 8], rcx */
+}
+
+static void emit_local(struct asm_buf *b, const uint32_t *ip, uint32_t pc, size_t epilogue) {
+	EMIT(b, 0x48, 0x8B, 0x83); /* mov rax, [rbx + env] */
+	emit_u32(b, offsetof(struct vm, env));
+	for (uint32_t depth = ip[0]; depth; --depth) {
+		EMIT(b, 0x48, 0x8B, 0x80); /* mov rax, [rax + parent] */
+		emit_u32(b, offsetof(struct env, parent));
+	}
+	EMIT(b, 0x48, 0x8B, 0x80); /* mov rax, [rax + slots[slot]] */
+	emit_u32(b, (uint32_t)(offsetof(struct frame, slots) + ip[1] * sizeof(struct obj *)));
+	EMIT(b, 0x48, 0x85, 0xC0); /* test rax, rax */
+	size_t defined = jump8(b, 0x75); /* jnz */
+	exit_at(b, pc, epilogue);
+	land(b, defined);
+	push_rax(b);
+}
+
+/* The same check getglobal starts with, then getglobal itself if it fails */
+static void emit_global(struct asm_buf *b, uint32_t k, uint32_t pc, size_t epilogue) {
+	load_const(b, RSI_R13, k);
+	EMIT(b, 0x48, 0x8B, 0x86); /* mov rax, [rsi + epoch] */
+	emit_u32(b, offsetof(struct global_ref, epoch));
+	EMIT(b, 0x48, 0xB9); /* mov rcx, &global_epoch */
+	emit_u64(b, (uintptr_t)&global_epoch);
+	EMIT(b, 0x48, 0x3B, 0x01); /* cmp rax, [rcx] */
+	size_t stale = jump8(b, 0x75); /* jne */
+	EMIT(b, 0x48, 0x8B, 0x86); /* mov rax, [rsi + value] */
+	emit_u32(b, offsetof(struct global_ref, value));
+	size_t cached = jump8(b, 0xEB); /* jmp */
+	land(b, stale);
+	EMIT(b, 0x48, 0x8B, 0xBB); /* mov rdi, [rbx + env] */
+	emit_u32(b, offsetof(struct vm, env));
+	emit_call(b, (void *)getglobal);
+	EMIT(b, 0x48, 0x85, 0xC0); /* test rax, rax */
+	size_t found = jump8(b, 0x75); /* jnz */
+	exit_at(b, pc, epilogue);
+	land(b, cached);
+	land(b, found);
+	push_rax(b);
+}
+
+/* Where native code goes after a call or a return that switched code: to
+ * `entry' if the JIT made native code for it, otherwise back out of jit_run
+ * with `pc' */
+struct jit_next {
+	const unsigned char *entry;
+	uint64_t pc;
+};
+
+static uint32_t jit_run(struct vm *vm, struct obj ***sp, uint32_t pc);
+
+static struct jit_next carry_on(struct vm *vm, uint32_t pc) {
+	const struct native_code *native = vm->code->native;
+	if (!native || native->run != jit_run) {
+		struct jit_next next = { NULL, pc | NATIVE_SWITCHED };
+		return next;
+	}
+	struct jit_code *jit = (struct jit_code *)native;
+	struct jit_next next = { jit->native + jit->offsets[pc], pc };
+	return next;
+}
+
+static struct jit_next leave(struct vm *vm, struct obj *result, struct contn *to) {
+	struct jit_next next = { NULL, NATIVE_LEAVE };
+	vm->leaving = result;
+	vm->leave_to = to;
+	return next;
+}
+
+/* OP_CALL or OP_TAIL_CALL of anything but a builtin function. Calls to
+ * bytecode lambdas happen here, the rest are up to the interpreter. */
+static struct jit_next call_other(struct vm *vm, struct obj ***top, uint32_t nargs, uint32_t tail, uint32_t pc) {
+	uint32_t base = (uint32_t)(*top - vm->stack) - nargs - 1;
+	struct obj *fn = vm->stack[base];
+	if (TYPE(fn) != LAMBDA || TYPE(AS_CLOSURE(fn)->code) != BYTECODE) {
+		struct jit_next next = { NULL, pc - 2 };
+		return next;
+	}
+	if (!vm_enter(vm, base, nargs, tail, pc)) return leave(vm, NIL, &cfail);
+	*top = vm->stack;
+	return carry_on(vm, 0);
+}
+
+static struct jit_next return_from(struct vm *vm, struct obj ***top) {
+	struct obj *val = *--*top;
+	uint32_t sp, pc;
+	if (!vm_return(vm, val, &sp, &pc)) return leave(vm, val, vm->next);
+	*top = vm->stack + sp;
+	return carry_on(vm, pc);
+}
+
+/* Call fn(vm, &top, ...) with the top of the stack in memory where fn can
+ * change it (the other arguments are already in place) */
+static void call_with_stack(struct asm_buf *b, void *fn) {
+	EMIT(b, 0x4D, 0x89, 0x26); /* mov [r14], r12 */
+	EMIT(b, 0x48, 0x89, 0xDF); /* mov rdi, rbx */
+	EMIT(b, 0x4C, 0x89, 0xF6); /* mov rsi, r14 */
+	emit_call(b, fn);
+	EMIT(b, 0x4D, 0x8B, 0x26); /* mov r12, [r14] */
+	load_consts(b);
+}
+
+/* Go where the struct jit_next in rax:rdx says */
+static void emit_carry_on(struct asm_buf *b, size_t epilogue) {
+	EMIT(b, 0x48, 0x85, 0xC0); /* test rax, rax */
+	EMIT(b, 0x74, 0x02); /* jz over the next instruction */
+	EMIT(b, 0xFF, 0xE0); /* jmp rax */
+	EMIT(b, 0x89, 0xD0); /* mov eax, edx */
+	EMIT(b, 0xE9); /* jmp epilogue */
+	emit_u32(b, 0);
+	patch32(b, b->len - 4, epilogue);
+}
+
+/* A builtin function call from native code. Returns its value, or NULL if it's
+ * going somewhere else and execute has to leave. */
+static struct obj *call_builtin(struct vm *vm, struct obj **top, uint32_t nargs, uint32_t tail, uint32_t pc) {
+	uint32_t base = (uint32_t)(top - vm->stack) - nargs - 1;
+	struct obj *result;
+	if (vm_call_builtin(vm, base, nargs, tail, pc, &result, &vm->leave_to)) return result;
+	vm->leaving = result;
+	return NULL;
+}
+
+/*
+ * Builtins we do ourselves when they get two integers. When a call looks like
+ * (+ x y) we check that the function really is that builtin and the arguments
+ * are both fixnums, then do the arithmetic or comparison right there. Anything
+ * else (like a result that doesn't fit) goes through the builtin as usual.
+ */
+struct int_builtin {
+	const char *name;
+	/* add or sub r/m64, r64 for arithmetic */
+	unsigned char arith;
+	/* the cmovcc that picks #t for comparisons */
+	unsigned char cmov;
+};
+static const struct int_builtin int_builtins[] = {
+	{ "+", 0x01, 0 },
+	{ "-", 0x29, 0 },
+	{ "=", 0, 0x44 },
+	{ "<", 0, 0x4C },
+	{ ">", 0, 0x4F },
+	{ "<=", 0, 0x4E },
+	{ ">=", 0, 0x4D },
+};
+
+/* The builtin the function for a call with two arguments is probably going to
+ * be: if the instruction that pushed it looks like OP_GLOBAL, whatever that
+ * global is right now. `fn_pc' may be wrong, which just means a check fails. */
+static struct fn *guess_int_builtin(struct bytecode *code, uint32_t fn_pc, const struct int_builtin **ib) {
+	const uint32_t *words = BYTECODE_WORDS(code);
+	if (words[fn_pc] != OP_GLOBAL) return NULL;
+	struct obj *val = AS_GLOBAL_REF(code->consts[words[fn_pc + 1]])->value;
+	if (!val || TYPE(val) != FN) return NULL;
+	for (size_t i = 0; i < sizeof(int_builtins) / sizeof(int_builtins[0]); ++i) {
+		if (strcmp(AS_FN(val)->fnname, int_builtins[i].name) == 0) {
+			*ib = &int_builtins[i];
+			return AS_FN(val);
+		}
+	}
+	return NULL;
+}
+
+/* rax = AS_INT(rax), rcx = AS_INT(rcx) */
+static void untag_ints(struct asm_buf *b) {
+	EMIT(b, 0x48, 0xC1, 0xE0, 64 - FIXNUM_BITS); /* shl rax */
+	EMIT(b, 0x48, 0xC1, 0xF8, 64 - FIXNUM_BITS); /* sar rax */
+	EMIT(b, 0x48, 0xC1, 0xE1, 64 - FIXNUM_BITS); /* shl rcx */
+	EMIT(b, 0x48, 0xC1, 0xF9, 64 - FIXNUM_BITS); /* sar rcx */
+}
+
+/* Do `fn' inline if the stack has it and two fixnums on top. Returns where the
+ * jumps to the slow path (if not) are, and where it jumps once it's done. */
+static void emit_int_builtin(struct asm_buf *b, struct fn *fn, const struct int_builtin *ib, size_t slow[6], size_t *done) {
+	int n = 0;
+	EMIT(b, 0x49, 0x8B, 0x44, 0x24, 0xE8); /* mov rax, [r12 - 24] */
+	EMIT(b, 0x48, 0xB9); /* mov rcx, NUM_OFFSET */
+	emit_u64(b, NUM_OFFSET);
+	EMIT(b, 0x48, 0x39, 0xC8); /* cmp rax, rcx */
+	slow[n++] = jump32(b, JAE);
+	EMIT(b, 0x83, 0x38, FN); /* cmp dword [rax + type], FN */
+	slow[n++] = jump32(b, JNE);
+	EMIT(b, 0x48, 0xB9); /* mov rcx, fn->call */
+	emit_u64(b, (uintptr_t)fn->call);
+	EMIT(b, 0x48, 0x39, 0x88); /* cmp [rax + call], rcx */
+	emit_u32(b, offsetof(struct fn, call));
+	slow[n++] = jump32(b, JNE);
+	EMIT(b, 0x49, 0x8B, 0x44, 0x24, 0xF0); /* mov rax, [r12 - 16] */
+	EMIT(b, 0x49, 0x8B, 0x4C, 0x24, 0xF8); /* mov rcx, [r12 - 8] */
+	EMIT(b, 0x48, 0xBA); /* mov rdx, FIXNUM_TAG */
+	emit_u64(b, FIXNUM_TAG);
+	EMIT(b, 0x48, 0x39, 0xD0); /* cmp rax, rdx */
+	slow[n++] = jump32(b, JB);
+	EMIT(b, 0x48, 0x39, 0xD1); /* cmp rcx, rdx */
+	slow[n++] = jump32(b, JB);
+	untag_ints(b);
+	if (ib->arith) {
+		EMIT(b, 0x48, ib->arith, 0xC8); /* add/sub rax, rcx */
+		/* make sure it's still a fixnum, like make_int would */
+		EMIT(b, 0x48, 0x89, 0xC1); /* mov rcx, rax */
+		EMIT(b, 0x48, 0xC1, 0xE1, 64 - FIXNUM_BITS); /* shl rcx */
+		EMIT(b, 0x48, 0xC1, 0xF9, 64 - FIXNUM_BITS); /* sar rcx */
+		EMIT(b, 0x48, 0x39, 0xC1); /* cmp rcx, rax */
+		slow[n++] = jump32(b, JNE);
+		EMIT(b, 0x48, 0x09, 0xD0); /* or rax, rdx */
+	} else {
+		EMIT(b, 0x48, 0x39, 0xC8); /* cmp rax, rcx */
+		EMIT(b, 0x48, 0xB8); /* mov rax, FALSE */
+		emit_u64(b, (uintptr_t)FALSE);
+		EMIT(b, 0x48, 0xBA); /* mov rdx, TRUE */
+		emit_u64(b, (uintptr_t)TRUE);
+		EMIT(b, 0x48, 0x0F, ib->cmov, 0xC2); /* cmovcc rax, rdx */
+		slow[n++] = 0;
+	}
+	EMIT(b, 0x49, 0x89, 0x44, 0x24, 0xE8); /* mov [r12 - 24], rax */
+	EMIT(b, 0x49, 0x83, 0xEC, 0x10); /* sub r12, 16 */
+	*done = jump32(b, JMP);
+}
+
+/* OP_CALL or OP_TAIL_CALL. `fn_pc' is our best guess at where the function
+ * was pushed. */
+static void emit_call_op(struct asm_buf *b, struct bytecode *code, uint32_t fn_pc, uint32_t nargs, _Bool tail, uint32_t pc, size_t epilogue) {
+	const struct int_builtin *ib;
+	struct fn *guess = nargs == 2 ? guess_int_builtin(code, fn_pc, &ib) : NULL;
+	size_t slow[6], fast_done = 0;
+	if (guess) {
+		emit_int_builtin(b, guess, ib, slow, &fast_done);
+		for (int i = 0; i < 6; ++i) {
+			if (slow[i]) land32(b, slow[i]);
+		}
+	}
+	uint32_t size = (nargs + 1) * sizeof(struct obj *);
+	EMIT(b, 0x49, 0x8B, 0x84, 0x24); /* mov rax, [r12 - size] */
+	emit_u32(b, (uint32_t)-size);
+	EMIT(b, 0x48, 0xB9); /* mov rcx, NUM_OFFSET */
+	emit_u64(b, NUM_OFFSET);
+	EMIT(b, 0x48, 0x39, 0xC8); /* cmp rax, rcx */
+	size_t is_num = jump8(b, 0x73); /* jae */
+	EMIT(b, 0x83, 0x38, FN); /* cmp dword [rax + type], FN */
+	size_t not_fn = jump8(b, 0x75); /* jne */
+	EMIT(b, 0x48, 0x89, 0xDF); /* mov rdi, rbx */
+	EMIT(b, 0x4C, 0x89, 0xE6); /* mov rsi, r12 */
+	EMIT(b, 0xBA); /* mov edx, nargs */
+	emit_u32(b, nargs);
+	EMIT(b, 0xB9); /* mov ecx, tail */
+	emit_u32(b, tail);
+	EMIT(b, 0x41, 0xB8); /* mov r8d, the pc after this */
+	emit_u32(b, pc + 2);
+	emit_call(b, (void *)call_builtin);
+	load_consts(b);
+	EMIT(b, 0x48, 0x85, 0xC0); /* test rax, rax */
+	size_t came_back = jump8(b, 0x75); /* jnz */
+	exit_at(b, NATIVE_LEAVE, epilogue);
+	land(b, came_back);
+	EMIT(b, 0x49, 0x81, 0xEC); /* sub r12, size */
+	emit_u32(b, size);
+	push_rax(b);
+	size_t done = jump8(b, 0xEB); /* jmp */
+	land(b, is_num);
+	land(b, not_fn);
+	EMIT(b, 0xBA); /* mov edx, nargs */
+	emit_u32(b, nargs);
+	EMIT(b, 0xB9); /* mov ecx, tail */
+	emit_u32(b, tail);
+	EMIT(b, 0x41, 0xB8); /* mov r8d, the pc after this */
+	emit_u32(b, pc + 2);
+	call_with_stack(b, (void *)call_other);
+	emit_carry_on(b, epilogue);
+	land(b, done);
+	if (guess) land32(b, fast_done);
+}
+
+struct fixup {
+	size_t at;
+	uint32_t target;
+};
+
+static void add_to_perf_map(struct jit_code *jit, struct string *name) {
+	static FILE *perf_map;
+	static _Bool tried;
+	if (!tried) {
+		char path[64];
+		tried = 1;
+		snprintf(path, sizeof(path), "/tmp/perf-%ld.map", (long)getpid());
+		perf_map = fopen(path, "w");
+	}
+	if (!perf_map) return;
+	fprintf(perf_map, "%" PRIxPTR " %zx ", (uintptr_t)jit->native, jit->size);
+	if (name) {
+		print_str(perf_map, name);
+	} else {
+		fputs("lambda", perf_map);
+	}
+	fputc('\n', perf_map);
+	fflush(perf_map);
+}
+
+/* Copy b into memory we can run */
+static unsigned char *make_executable(struct asm_buf *b) {
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t size = (b->len + page - 1) / page * page;
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) return NULL;
+	memcpy(mem, b->bytes, b->len);
+	if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(mem, size);
+		return NULL;
+	}
+	return mem;
+}
+
+void jit_compile(struct bytecode *code, struct string *name) {
+	const uint32_t *words = BYTECODE_WORDS(code);
+	struct jit_code *jit = malloc(offsetof(struct jit_code, offsets) + code->len * sizeof(uint32_t));
+	struct fixup *fixups = malloc(code->len * sizeof(struct fixup));
+	if (!jit || !fixups) {
+		fputs("Out of memory\n", stderr);
+		abort();
+	}
+	size_t nfixups = 0;
+	struct asm_buf b = { NULL, 0, 0 };
+
+	/* Prologue: save what we use (five pushes keep the stack aligned for
+	 * calls), set up the registers and go to `entry' */
+	EMIT(&b, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); /* push rbx, r12-r15 */
+	EMIT(&b, 0x48, 0x89, 0xFB); /* mov rbx, rdi */
+	EMIT(&b, 0x49, 0x89, 0xF6); /* mov r14, rsi */
+	EMIT(&b, 0x4C, 0x8B, 0x26); /* mov r12, [rsi] */
+	load_consts(&b);
+	EMIT(&b, 0xFF, 0xE2); /* jmp rdx */
+	/* Epilogue: the pc to go on from is already in eax */
+	size_t epilogue = b.len;
+	EMIT(&b, 0x4D, 0x89, 0x26); /* mov [r14], r12 */
+	EMIT(&b, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B); /* pop r15-r12, rbx */
+	EMIT(&b, 0xC3); /* ret */
+
+	/* the last three instructions, for emit_call_op */
+	uint32_t prev[3] = { 0, 0, 0 };
+	for (uint32_t pc = 0; pc < code->len;) {
+		const uint32_t *ip = &words[pc + 1];
+		jit->offsets[pc] = (uint32_t)b.len;
+		uint32_t this_pc = pc;
+		switch (words[pc]) {
+		case OP_CONST:
+			load_const(&b, RAX_R13, ip[0]);
+			push_rax(&b);
+			pc += 2;
+			break;
+		case OP_LOCAL:
+			emit_local(&b, ip, pc, epilogue);
+			pc += 4;
+			break;
+		case OP_GLOBAL:
+			emit_global(&b, ip[0], pc, epilogue);
+			pc += 2;
+			break;
+		case OP_DEFINE:
+			call_with_top(&b, (void *)vm_define, ip[0]);
+			replace_top_with_nil(&b);
+			pc += 2;
+			break;
+		case OP_SET: {
+			/* the interpreter says what went wrong */
+			call_with_top(&b, (void *)vm_set, ip[0]);
+			EMIT(&b, 0x84, 0xC0); /* test al, al */
+			size_t ok = jump8(&b, 0x75); /* jnz */
+			exit_at(&b, pc, epilogue);
+			land(&b, ok);
+			replace_top_with_nil(&b);
+			pc += 2;
+			break;
+		}
+		case OP_CLOSURE:
+			EMIT(&b, 0x48, 0x89, 0xDF); /* mov rdi, rbx */
+			load_const(&b, RSI_R13, ip[0]);
+			emit_call(&b, (void *)vm_closure);
+			load_consts(&b);
+			push_rax(&b);
+			pc += 2;
+			break;
+		case OP_POP:
+			EMIT(&b, 0x49, 0x83, 0xEC, 0x08); /* sub r12, 8 */
+			pc += 1;
+			break;
+		case OP_JUMP:
+			EMIT(&b, 0xE9, 0, 0, 0, 0);
+			fixups[nfixups++] = (struct fixup){ b.len - 4, ip[0] };
+			pc += 2;
+			break;
+		case OP_JUMP_IF_FALSE:
+			EMIT(&b, 0x49, 0x83, 0xEC, 0x08); /* sub r12, 8 */
+			EMIT(&b, 0x49, 0x8B, 0x04, 0x24); /* mov rax, [r12] */
+			EMIT(&b, 0x48, 0xB9); /* mov rcx, FALSE */
+			emit_u64(&b, (uintptr_t)FALSE);
+			EMIT(&b, 0x48, 0x39, 0xC8); /* cmp rax, rcx */
+			EMIT(&b, 0x0F, 0x84, 0, 0, 0, 0); /* je */
+			fixups[nfixups++] = (struct fixup){ b.len - 4, ip[0] };
+			pc += 2;
+			break;
+		case OP_CALL:
+		case OP_TAIL_CALL:
+			emit_call_op(&b, code, prev[0], ip[0], words[pc] == OP_TAIL_CALL, pc, epilogue);
+			pc += 2;
+			break;
+		case OP_RETURN:
+			call_with_stack(&b, (void *)return_from);
+			emit_carry_on(&b, epilogue);
+			pc += 1;
+			break;
+		case OP_EVAL:
+			exit_at(&b, pc, epilogue);
+			pc += 2;
+			break;
+		}
+		prev[0] = prev[1];
+		prev[1] = prev[2];
+		prev[2] = this_pc;
+	}
+	for (size_t i = 0; i < nfixups; ++i) {
+		patch32(&b, fixups[i].at, jit->offsets[fixups[i].target]);
+	}
+	free(fixups);
+
+	jit->native = make_executable(&b);
+	jit->size = b.len;
+	free(b.bytes);
+	if (!jit->native) {
+		/* carry on interpreting it */
+		free(jit);
+		return;
+	}
+	add_to_perf_map(jit, name);
+	jit->header.run = jit_run;
+	code->native = &jit->header;
+}
+
+static uint32_t jit_run(struct vm *vm, struct obj ***sp, uint32_t pc) {
+	struct jit_code *jit = (struct jit_code *)vm->code->native;
+	native_fn run = (native_fn)(uintptr_t)jit->native;
+	return run(vm, sp, jit->native + jit->offsets[pc]);
+}
+
+#else
+
+void jit_compile(struct bytecode *code, struct string *name) {
+	(void)code;
+	(void)name;
+}
+
+#endif
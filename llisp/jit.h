@@ -0,0 +1,19 @@
+#pragma once
+#include "obj.h"
+
+/* Native code is x86-64 for a System V-style ABI with mmap */
+#if (defined(__x86_64__) || defined(__amd64__)) && defined(__unix__)
+#define HAVE_JIT
+#endif
+
+/* Whether the VM compiles lambdas to native code once they've been called
+ * JIT_THRESHOLD times (--jit) */
+extern _Bool use_jit;
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100
+#endif
+
+/* Give code, the body of the lambda called `name' (or NULL), native code if we
+ * can (see struct native_code in vm-private.h). Doesn't allocate anything the
+ * collector knows about. */
+void jit_compile(struct bytecode *code, struct string *name);
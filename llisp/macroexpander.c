@@ -24,19 +24,30 @@ static struct obj *defmacro_in_env(CPS_ARGS) {
 	definesym(self->env, AS_SYMBOL(sym), NIL);
 
 	/* return `(define ,var-or-prototype ,@macroexpanded-body) */
+	struct obj *rest = cons(self->data, obj);
+	GC_PROTECT(rest);
+	struct obj *define = intern_symbol(str_from_string_lit("define"));
+	GC_UNPROTECT(1);
 	*ret = self->next;
-	return cons(intern_symbol(str_from_string_lit("define")), cons(self->data, obj));
+	return cons(define, rest);
 }
 
 static struct obj *macroexpand_rebuildlambda(CPS_ARGS) {
+	struct obj *rest = cons(self->data, obj);
+	GC_PROTECT(rest);
+	struct obj *lambda = intern_symbol(str_from_string_lit("lambda"));
+	GC_UNPROTECT(1);
 	*ret = self->next;
-	return cons(intern_symbol(str_from_string_lit("lambda")), cons(self->data, obj));
+	return cons(lambda, rest);
 }
 
 /* Before calling this you must set up *ret to be a mutable contn with the correct next field. */
 static struct obj *do_lambda(struct obj *args, struct obj *body, struct env *env, struct contn **ret) {
-	struct env *newenv = make_env(env);
 	struct obj *curarg = args;
+	GC_PROTECT(curarg);
+	GC_PROTECT(body);
+	struct env *newenv = make_env(env);
+	GC_PROTECT(newenv);
 	while (1) {
 		if (TYPE(curarg) == CELL) {
 			if (TYPE(CAR(curarg)) == SYMBOL) {
@@ -55,6 +66,7 @@ static struct obj *do_lambda(struct obj *args, struct obj *body, struct env *env
 	(*ret)->data = NIL;
 	(*ret)->env = newenv;
 	(*ret)->fn = macroexpand_list;
+	GC_UNPROTECT(3);
 	return body;
 }
 
@@ -71,13 +83,18 @@ static struct obj *do_macroexpand(CPS_ARGS) {
 		struct contn *lambdacons = dupcontn(self);
 		lambdacons->data = CAR(CDR(obj));
 		lambdacons->fn = macroexpand_rebuildlambda;
+		GC_PROTECT(lambdacons);
 		*ret = dupcontn(self);
+		GC_UNPROTECT(1);
 		(*ret)->next = lambdacons;
 		return do_lambda(CAR(CDR(obj)), CDR(CDR(obj)), self->env, ret);
 	}
 	struct contn *next = self->next;
+	GC_PROTECT(obj);
+	GC_PROTECT(next);
 	if (is_real_define(CAR(obj), self->env) && (TYPE(CDR(obj)) == CELL)) {
 		struct obj *var = CAR(CDR(obj));
+		GC_PROTECT(var);
 
 		next = dupcontn(self);
 		next->data = var;
@@ -87,20 +104,25 @@ static struct obj *do_macroexpand(CPS_ARGS) {
 			// do_lambda, then (given the body) call defmacro_in_env, then do next
 			*ret = dupcontn(self);
 			(*ret)->next = next;
+			GC_UNPROTECT(3);
 			return do_lambda(CDR(var), CDR(CDR(obj)), self->env, ret);
 		}
+		GC_UNPROTECT(1);
 
 		// It's a normal, non-function define - just process the definition & then defmacro_in_env
 		obj = CDR(CDR(obj));
 	}
 	struct obj *fn = get_if_macro(CAR(obj), self->env);
 	if (fn) {
+		GC_PROTECT(fn);
 		struct contn *redo_macroexpand = dupcontn(self);
 		redo_macroexpand->next = next;
+		GC_PROTECT(redo_macroexpand);
 		*ret = dupcontn(self);
 		(*ret)->data = fn;
 		(*ret)->fn = apply_closure;
 		(*ret)->next = redo_macroexpand;
+		GC_UNPROTECT(4);
 		return CDR(obj);
 	}
 
@@ -109,6 +131,7 @@ static struct obj *do_macroexpand(CPS_ARGS) {
 	(*ret)->data = NIL;
 	(*ret)->fn = macroexpand_list;
 	(*ret)->next = next;
+	GC_UNPROTECT(2);
 	return obj;
 }
 
@@ -124,7 +147,9 @@ static struct obj *macroexpand_list(CPS_ARGS) {
 	tailcons->data = CDR(obj);
 	tailcons->fn = macroexpand_list_tailcons;
 
+	GC_PROTECT(tailcons);
 	*ret = dupcontn(self);
+	GC_UNPROTECT(1);
 	(*ret)->next = tailcons;
 	(*ret)->fn = do_macroexpand;
 	return CAR(obj);
@@ -138,7 +163,9 @@ static struct obj *macroexpand_list_tailcons(CPS_ARGS) {
 	docons->data = obj;
 	docons->fn = macroexpand_list_cons;
 
+	GC_PROTECT(docons);
 	*ret = dupcontn(self);
+	GC_UNPROTECT(1);
 	(*ret)->data = NIL;
 	(*ret)->next = docons;
 	(*ret)->fn = macroexpand_list;
@@ -151,17 +178,226 @@ static struct obj *macroexpand_list_cons(CPS_ARGS) {
 	return cons(self->data, obj);
 }
 
+/* Lexical addressing
+ *
+ * Once a form is fully expanded we know every variable a lambda can bind:
+ * its parameters plus the names its body `define's. Each of those gets a
+ * slot in a flat frame, and every reference to one is replaced with a
+ * LOCALREF holding (depth, slot) so eval doesn't have to hash the name.
+ * Lambdas with no variables don't get a frame and don't count as a level.
+ * Other variables become GLOBALREFs, which remember what they found (see
+ * getglobal). The names of special forms and macros, and variables that are
+ * being `define'd or `set!', stay symbols. So do the bodies of `defmacro's,
+ * which run at expansion time. */
+struct lexical_scope {
+	struct lexical_scope *parent;
+	struct obj *names; /* in reverse slot order */
+	size_t nslots;
+};
+
+/* Index of sym in scope, or -1. Later bindings shadow earlier ones. */
+static long scope_index(struct lexical_scope *scope, struct obj *sym) {
+	long i = (long)scope->nslots;
+	for (struct obj *cur = scope->names; cur != NIL; cur = CDR(cur)) {
+		--i;
+		if (CAR(cur) == sym) return i;
+	}
+	return -1;
+}
+
+static _Bool find_local(struct lexical_scope *scope, struct obj *sym, uint32_t *depth, uint32_t *slot) {
+	uint32_t d = 0;
+	for (; scope; scope = scope->parent) {
+		if (scope->nslots == 0) continue;
+		long i = scope_index(scope, sym);
+		if (i >= 0) {
+			*depth = d;
+			*slot = (uint32_t)i;
+			return 1;
+		}
+		++d;
+	}
+	return 0;
+}
+
+static void add_local(struct lexical_scope *scope, struct obj *sym) {
+	scope->names = cons(sym, scope->names);
+	scope->nslots++;
+}
+
+/* Is obj the head of a real special form, i.e. not shadowed by a local? */
+static _Bool is_form(struct obj *head, struct lexical_scope *scope, struct env *env, _Bool (*is_real)(struct obj *, struct env *)) {
+	uint32_t depth, slot;
+	if (TYPE(head) != SYMBOL) return 0;
+	if (find_local(scope, head, &depth, &slot)) return 0;
+	return is_real(head, env);
+}
+
+/* Add every name `define'd in obj (but not in nested lambdas) to scope */
+static void collect_defines(struct obj *obj, struct lexical_scope *scope, struct env *env) {
+	GC_PROTECT(obj);
+	while (TYPE(obj) == CELL) {
+		struct obj *form = CAR(obj);
+		obj = CDR(obj);
+		if (TYPE(form) != CELL) continue;
+		struct obj *head = CAR(form);
+		if (is_form(head, scope, env, is_real_quote) ||
+			is_form(head, scope, env, is_real_lambda) ||
+			is_form(head, scope, env, is_real_defmacro)) {
+			continue;
+		}
+		if (is_form(head, scope, env, is_real_define) && TYPE(CDR(form)) == CELL) {
+			struct obj *var = CAR(CDR(form));
+			_Bool is_prototype = TYPE(var) == CELL;
+			if (is_prototype) var = CAR(var);
+			if (TYPE(var) == SYMBOL && scope_index(scope, var) < 0) {
+				GC_PROTECT(form);
+				add_local(scope, var);
+				GC_UNPROTECT(1);
+			}
+			if (is_prototype) continue;
+			form = CDR(CDR(form));
+		}
+		collect_defines(form, scope, env);
+	}
+	GC_UNPROTECT(1);
+}
+
+static struct obj *resolve(struct obj *obj, struct lexical_scope *scope, struct env *env);
+
+/* Build a fresh list of the resolved elements of list */
+static struct obj *resolve_list(struct obj *list, struct lexical_scope *scope, struct env *env) {
+	struct obj *head = NIL;
+	struct obj *tail = NIL;
+	GC_PROTECT(list);
+	GC_PROTECT(head);
+	GC_PROTECT(tail);
+	while (TYPE(list) == CELL) {
+		struct obj *item = resolve(CAR(list), scope, env);
+		item = cons(item, NIL);
+		if (tail == NIL) {
+			head = item;
+		} else {
+			gc_write_barrier(tail);
+			CDR(tail) = item;
+		}
+		tail = item;
+		list = CDR(list);
+	}
+	if (list != NIL) {
+		struct obj *rest = resolve(list, scope, env);
+		if (tail == NIL) {
+			head = rest;
+		} else {
+			gc_write_barrier(tail);
+			CDR(tail) = rest;
+		}
+	}
+	GC_UNPROTECT(3);
+	return head;
+}
+
+/* Returns (<scope> . resolved-body), or NULL if params aren't all symbols */
+static struct obj *resolve_lambda(struct obj *params, struct obj *body, struct lexical_scope *parent, struct env *env) {
+	struct lexical_scope scope = { parent, NIL, 0 };
+	GC_PROTECT(params);
+	GC_PROTECT(body);
+	GC_PROTECT(scope.names);
+	struct obj *cur = params;
+	GC_PROTECT(cur);
+	for (; TYPE(cur) == CELL; cur = CDR(cur)) {
+		if (TYPE(CAR(cur)) != SYMBOL) break;
+		add_local(&scope, CAR(cur));
+	}
+	if (TYPE(cur) == SYMBOL) {
+		add_local(&scope, cur);
+	} else if (cur != NIL) {
+		GC_UNPROTECT(4);
+		return NULL;
+	}
+	collect_defines(body, &scope, env);
+	body = resolve_list(body, &scope, env);
+	struct obj *scope_obj = make_scope(params, scope.nslots);
+	GC_UNPROTECT(4);
+	return cons(scope_obj, body);
+}
+
+/* The variable `define'd or `set!' by a form */
+static struct obj *resolve_target(struct obj *sym, struct lexical_scope *scope) {
+	uint32_t depth, slot;
+	if (TYPE(sym) == SYMBOL && find_local(scope, sym, &depth, &slot)) {
+		return make_local_ref(AS_SYMBOL(sym), depth, slot);
+	}
+	return sym;
+}
+
+static _Bool is_syntax(struct obj *sym, struct env *env) {
+	struct obj *val = getsym(env, AS_SYMBOL(sym));
+	return val && (TYPE(val) == SPECFORM || TYPE(val) == MACRO);
+}
+
+static struct obj *resolve(struct obj *obj, struct lexical_scope *scope, struct env *env) {
+	if (TYPE(obj) == SYMBOL) {
+		struct obj *ref = resolve_target(obj, scope);
+		if (ref != obj || is_syntax(obj, env)) return ref;
+		return make_global_ref(AS_SYMBOL(obj));
+	}
+	if (TYPE(obj) != CELL) return obj;
+
+	struct obj *head = CAR(obj);
+	if (is_form(head, scope, env, is_real_quote) || is_form(head, scope, env, is_real_defmacro)) {
+		return obj;
+	}
+	if (is_form(head, scope, env, is_real_lambda) && TYPE(CDR(obj)) == CELL) {
+		GC_PROTECT(obj);
+		GC_PROTECT(head);
+		struct obj *rest = resolve_lambda(CAR(CDR(obj)), CDR(CDR(obj)), scope, env);
+		GC_UNPROTECT(2);
+		return rest ? cons(head, rest) : obj;
+	}
+	if (is_form(head, scope, env, is_real_define) && TYPE(CDR(obj)) == CELL && TYPE(CAR(CDR(obj))) == CELL) {
+		/* (define (name . params) . body) -> (define (name' . <scope>) . body') */
+		struct obj *proto = CAR(CDR(obj));
+		GC_PROTECT(obj);
+		GC_PROTECT(head);
+		struct obj *lambda = resolve_lambda(CDR(proto), CDR(CDR(obj)), scope, env);
+		if (!lambda) {
+			GC_UNPROTECT(2);
+			return obj;
+		}
+		GC_PROTECT(lambda);
+		struct obj *name = resolve_target(CAR(CAR(CDR(obj))), scope);
+		proto = cons(name, CAR(lambda));
+		lambda = cons(proto, CDR(lambda));
+		GC_UNPROTECT(3);
+		return cons(head, lambda);
+	}
+	if ((is_form(head, scope, env, is_real_define) || is_form(head, scope, env, is_real_set)) &&
+		TYPE(CDR(obj)) == CELL) {
+		/* (define var . rest) -> (define var' . rest') */
+		GC_PROTECT(obj);
+		GC_PROTECT(head);
+		struct obj *rest = resolve_list(CDR(CDR(obj)), scope, env);
+		GC_PROTECT(rest);
+		struct obj *var = resolve_target(CAR(CDR(obj)), scope);
+		rest = cons(var, rest);
+		GC_UNPROTECT(3);
+		return cons(head, rest);
+	}
+	return resolve_list(obj, scope, env);
+}
+
 struct obj *macroexpand_cps(struct obj *obj, struct env *env) {
+	GC_PROTECT(obj);
+	GC_PROTECT(env);
 	struct contn *cur = make_empty_contn();
 	cur->env = make_env(env); /* don't mess with the actual environment passed in */
 	cur->fn = do_macroexpand;
-	struct contn *next = NULL;
-	while (cur != &cend && cur != &cfail) {
-		obj = cur->fn(cur, obj, &next);
-		cur = next;
-	}
-	if (cur == &cfail) {
+	_Bool failed;
+	obj = trampoline(cur, obj, &failed);
+	GC_UNPROTECT(2);
+	if (failed) {
 		return NULL;
 	}
-	return obj;
+	return resolve(obj, NULL, env);
 }
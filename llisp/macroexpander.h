@@ -3,5 +3,6 @@
 
 /* Expand macros in obj in env in a continuation-passing style
  * Suitable for calling at the top-level outside of any other
- * llisp computation */
+ * llisp computation. References to local variables in the
+ * result are resolved to frame slots. */
 struct obj *macroexpand_cps(struct obj *obj, struct env *env);
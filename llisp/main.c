@@ -1,20 +1,23 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "cps.h"
 #include "env.h"
 #include "gc.h"
 #include "globals.h"
+#include "jit.h"
 #include "obj.h"
 #include "parse.h"
 #include "print.h"
 #include "stdlib.h"
+#include "vm.h"
 
 static int repl_done = 0;
-static struct obj *fn_quit(CPS_ARGS) {
+static struct obj *fn_quit(FN_ARGS) {
 	(void)self;
 	repl_done = 1;
 	*ret = &cend;
-	return obj;
+	return NIL;
 }
 
 void read_line(struct string_builder *current) {
@@ -29,11 +32,18 @@ void read_line(struct string_builder *current) {
 }
 
 void repl(struct env *globals) {
-	definesym(globals, str_from_string_lit("quit"), make_fn(FN, fn_quit, "quit"));
-	struct obj *obj;
+	struct obj *quit = make_fn(fn_quit, 0, ANY_ARGS, "quit");
+	GC_PROTECT(quit);
+	definesym(globals, AS_SYMBOL(intern_symbol(str_from_string_lit("quit"))), quit);
+	GC_UNPROTECT(1);
+	struct obj *obj = NIL;
+	GC_PROTECT(obj);
 
 	struct string_builder line;
 	struct buf linebuf;
+	line.buf = NULL;
+	/* linebuf points into it */
+	GC_PROTECT(line.buf);
 
 	while (!repl_done) {
 		init_string_builder(&line);
@@ -71,8 +81,9 @@ void repl(struct env *globals) {
 
 			obj = CDR(obj);
 		}
-		gc_collect();
+		gc_idle();
 	}
+	GC_UNPROTECT(2);
 }
 
 void run_file(char *filename, struct env *globals) {
@@ -86,6 +97,8 @@ void run_file(char *filename, struct env *globals) {
 	rewind(fp);
 
 	struct string *file_contents = unsafe_make_uninitialized_str(file_size);
+	/* buf points into it */
+	GC_PROTECT(file_contents);
 	size_t bytes_read = 0;
 	while (bytes_read < file_size) {
 		size_t this_read = fread(file_contents->str + bytes_read, 1, file_size - bytes_read, fp);
@@ -100,10 +113,12 @@ void run_file(char *filename, struct env *globals) {
 	struct buf buf;
 	init_buf(file_contents->str, file_contents->len, &buf);
 
-	struct obj *obj;
+	struct obj *obj = NIL;
+	GC_PROTECT(obj);
 	enum parse_result parse_res = parse(&buf, &obj);
 	if (parse_res == PARSE_EMPTY) {
 		/* I don't know why you'd do this, but I guess it's fine */
+		GC_UNPROTECT(2);
 		return;
 	}
 	if (parse_res != PARSE_OK) {
@@ -116,34 +131,120 @@ void run_file(char *filename, struct env *globals) {
 		run_cps(CAR(obj), globals, NULL /*failed*/);
 		obj = CDR(obj);
 	}
+	GC_UNPROTECT(2);
+}
+
+static int usage(char *argv0) {
+	fprintf(stderr, "Usage: %s [--gc-pause=USEC] [--gc-threads=N] [--gc-conservative] [--gc-compact] [--gc-growth=FACTOR] [--gc-max-heap=MB] [--vm] [--jit] [file]\n", argv0);
+	return 1;
+}
+
+/* Whether `arg' is `name' followed by a number, which gets stored in `val' */
+static _Bool numeric_option(char *arg, const char *name, unsigned long *val) {
+	size_t len = strlen(name);
+	if (strncmp(arg, name, len) != 0 || arg[len] == '\0') return 0;
+	char *end;
+	*val = strtoul(arg + len, &end, 10);
+	return *end == '\0';
+}
+/* Same, but for a number that doesn't have to be whole */
+static _Bool real_option(char *arg, const char *name, double *val) {
+	size_t len = strlen(name);
+	if (strncmp(arg, name, len) != 0 || arg[len] == '\0') return 0;
+	char *end;
+	*val = strtod(arg + len, &end);
+	return *end == '\0';
 }
 
 _declspec(noinline)
 int realmain(int argc, char *argv[]) {
+	char *threads = getenv("LLISP_GC_THREADS");
+	if (threads) {
+		gc_set_mark_threads(strtoul(threads, NULL, 10));
+	}
+
+	int argi = 1;
+	for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; ++argi) {
+		unsigned long val;
+		double real;
+		if (numeric_option(argv[argi], "--gc-pause=", &val)) {
+			gc_set_pause_budget(val);
+		} else if (numeric_option(argv[argi], "--gc-threads=", &val)) {
+			gc_set_mark_threads(val);
+		} else if (strcmp(argv[argi], "--gc-conservative") == 0) {
+			gc_set_conservative_roots(1);
+		} else if (strcmp(argv[argi], "--gc-compact") == 0) {
+			gc_set_compaction(1);
+		} else if (strcmp(argv[argi], "--vm") == 0) {
+			use_vm = 1;
+		} else if (strcmp(argv[argi], "--jit") == 0) {
+#ifdef HAVE_JIT
+			use_vm = use_jit = 1;
+#else
+			fputs("warning: --jit isn't supported here, using --vm\n", stderr);
+			use_vm = 1;
+#endif
+		} else if (real_option(argv[argi], "--gc-growth=", &real)) {
+			if (!gc_set_heap_growth(real)) {
+				fputs("--gc-growth: factor must be more than 1\n", stderr);
+				return 1;
+			}
+		} else if (numeric_option(argv[argi], "--gc-max-heap=", &val)) {
+			if (!gc_set_max_heap((size_t)val << 20)) {
+				fprintf(stderr, "--gc-max-heap: %lu MB is too small\n", val);
+				return 1;
+			}
+		} else {
+			return usage(argv[0]);
+		}
+	}
+
 	struct env *globals = make_env(NULL);
+	GC_PROTECT(globals);
 	add_globals(globals);
 	add_stdlib(globals);
 
-	if (argc == 1) {
+	if (argi == argc) {
 		repl(globals);
-	} else if (argc == 2) {
-		run_file(argv[1], globals);
+	} else if (argi == argc - 1) {
+		run_file(argv[argi], globals);
 	} else {
-		fprintf(stderr, "Usage: %s [file]\n", argv[0]);
-		return 1;
+		return usage(argv[0]);
 	}
+	GC_UNPROTECT(1);
 
 #ifdef GC_STATS
 	puts("\n");
 	printf("Total allocations:               %llu\n", gc_total_allocs);
 	printf("Total frees (before collection): %llu\n", gc_total_frees);
+	printf("Heap size:                       %zu\n", gc_heap_bytes);
+	/* Don't count the pause for this last collection */
+	unsigned long long pauses[GC_PAUSE_BUCKETS];
+	memcpy(pauses, gc_pause_histogram, sizeof(pauses));
+	double max_pause = gc_max_pause;
+	double total_pause = gc_total_pause;
 	memset(&interned_symbols, 0, sizeof(interned_symbols));
 	gc_collect();
 	printf("Total frees (after collection):  %llu\n", gc_total_frees);
 	printf("Leaked memory:                   %llu\n", gc_total_allocs - gc_total_frees);
 	printf("Time rootfinding:                %f\n", time_rootfinding);
 	printf("Time marking:                    %f\n", time_marking);
-	printf("Time sweeping:                   %f\n", time_sweeping);
+	printf("Time sweeping in collections:    %f\n", time_sweeping);
+	printf("Time sweeping lazily:            %f\n", time_lazy_sweeping);
+	printf("Minor collections:               %llu\n", gc_minor_collections);
+	printf("Bytes promoted:                  %llu\n", gc_bytes_promoted);
+	printf("Time in minor collections:       %f\n", time_minor);
+	printf("Time compacting:                 %f\n", time_compacting);
+	for (int i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+		if (pauses[i] == 0) continue;
+		if (i == GC_PAUSE_BUCKETS - 1) {
+			printf("Pauses of %6luus or more:      %llu\n", GC_PAUSE_BUCKET_LIMIT(i - 1), pauses[i]);
+		} else {
+			printf("Pauses under %6luus:           %llu\n", GC_PAUSE_BUCKET_LIMIT(i), pauses[i]);
+		}
+	}
+	printf("Longest pause:                   %f\n", max_pause);
+	printf("Time in pauses:                  %f\n", total_pause);
 #endif
 
 	return 0;
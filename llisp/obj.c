@@ -13,41 +13,113 @@ struct builtin false_ = STATIC_BUILTIN("#f");
 struct hashtab interned_symbols = EMPTY_HASHTAB;
 
 struct obj *intern_symbol(struct string *sym) {
+	if (interned_symbols.cap == 0) {
+		GC_PROTECT(sym);
+		init_weak_hashtab(&interned_symbols);
+		GC_UNPROTECT(1);
+	}
 	struct obj *existing = hashtab_get(&interned_symbols, sym);
 	if (existing) {
+		gc_read_weak(existing);
 		return existing;
 	} else {
 		struct obj *sym_as_obj = (struct obj *) sym;
-		TYPE(sym_as_obj) = SYMBOL;
+		sym->hash = string_hash(sym);
+		sym_as_obj->type = SYMBOL;
 		hashtab_put(&interned_symbols, sym, sym_as_obj);
 		return sym_as_obj;
 	}
 }
+#ifndef IMMEDIATE_NUMS
 struct obj *make_num(double val) {
 	/* n.b. we have this sort of awkward casting instead of using AS_NUM to try to make
 	 * sure the num type appears in the debugging info. It tends to be optimized away. */
 	struct num *ret = (struct num *) gc_alloc(NUM, sizeof(struct num));
-	ret->num = val;
+	ret->exact = 0;
+	ret->as.d = val;
 	return (struct obj *) ret;
 }
-struct obj *make_fn(enum objtype type, struct obj *(*fn)(CPS_ARGS), const char *name) {
-	assert(type == FN || type == SPECFORM);
-	struct fn *ret = AS_FN(gc_alloc(type, sizeof(struct fn)));
+struct obj *make_int(int64_t val) {
+	struct num *ret = (struct num *) gc_alloc(NUM, sizeof(struct num));
+	ret->exact = 1;
+	ret->as.i = val;
+	return (struct obj *) ret;
+}
+#endif
+struct obj *make_fn(struct obj *(*call)(FN_ARGS), int min_args, int max_args, const char *name) {
+	assert(min_args >= 0 && (max_args == ANY_ARGS || max_args >= min_args));
+	struct fn *ret = AS_FN(gc_alloc(FN, sizeof(struct fn)));
+	ret->fn = NULL;
+	ret->call = call;
+	ret->min_args = min_args;
+	ret->max_args = max_args;
+	ret->fnname = name;
+	return (struct obj *)ret;
+}
+struct obj *make_specform(struct obj *(*fn)(CPS_ARGS), const char *name) {
+	struct fn *ret = AS_FN(gc_alloc(SPECFORM, sizeof(struct fn)));
 	ret->fn = fn;
+	ret->call = NULL;
+	ret->min_args = 0;
+	ret->max_args = ANY_ARGS;
 	ret->fnname = name;
 	return (struct obj *)ret;
 }
 struct obj *make_closure(enum objtype type, struct obj *args, struct obj *code, struct env *env) {
 	assert(type == LAMBDA || type == MACRO);
+	GC_PROTECT(args);
+	GC_PROTECT(code);
+	GC_PROTECT(env);
 	struct obj *ret = gc_alloc(type, sizeof(struct closure));
+	GC_UNPROTECT(3);
 	AS_CLOSURE(ret)->args = args;
 	AS_CLOSURE(ret)->code = code;
 	AS_CLOSURE(ret)->env = env;
 	return ret;
 }
 
+struct obj *make_local_ref(struct string *name, uint32_t depth, uint32_t slot) {
+	GC_PROTECT(name);
+	struct local_ref *ret = AS_LOCAL_REF(gc_alloc(LOCALREF, sizeof(struct local_ref)));
+	GC_UNPROTECT(1);
+	ret->name = name;
+	ret->depth = depth;
+	ret->slot = slot;
+	return (struct obj *)ret;
+}
+
+struct obj *make_global_ref(struct string *name) {
+	GC_PROTECT(name);
+	struct global_ref *ret = AS_GLOBAL_REF(gc_alloc(GLOBALREF, sizeof(struct global_ref)));
+	GC_UNPROTECT(1);
+	ret->name = name;
+	ret->value = NULL;
+	ret->epoch = 0;
+	return (struct obj *)ret;
+}
+
+struct obj *make_scope(struct obj *params, size_t nslots) {
+	GC_PROTECT(params);
+	struct scope *ret = AS_SCOPE(gc_alloc(SCOPE, sizeof(struct scope)));
+	GC_UNPROTECT(1);
+	ret->params = params;
+	ret->nslots = nslots;
+	return (struct obj *)ret;
+}
+
+struct obj *make_weak_table() {
+	struct weak_table *ret = AS_WEAK_TABLE(gc_alloc(WEAKTABLE, sizeof(struct weak_table)));
+	GC_PROTECT(ret);
+	init_weak_hashtab(&ret->table);
+	GC_UNPROTECT(1);
+	return (struct obj *)ret;
+}
+
 struct obj *cons(struct obj *l, struct obj *r) {
+	GC_PROTECT(l);
+	GC_PROTECT(r);
 	struct cell *ret = (struct cell *)gc_alloc(CELL, sizeof(struct cell));
+	GC_UNPROTECT(2);
 	ret->head = l;
 	ret->tail = r;
 	return (struct obj *)ret;
@@ -60,7 +132,10 @@ struct string *unsafe_make_uninitialized_str(size_t len) {
 	return s;
 }
 struct string *make_str_from_ptr_len(const char *c, size_t len) {
+	/* `c' might be inside another string */
+	GC_PROTECT(c);
 	struct string *ret = unsafe_make_uninitialized_str(len);
+	GC_UNPROTECT(1);
 	memcpy(ret->str, c, len);
 	return ret;
 }
@@ -124,7 +199,9 @@ void string_builder_append(struct string_builder *sb, char ch) {
 	assert(sb && sb->buf);
 	size_t cap = sb->buf->len;
 	if (sb->used == cap) {
+		GC_PROTECT(sb->buf);
 		struct string *newdata = unsafe_make_uninitialized_str(cap + cap / 2);
+		GC_UNPROTECT(1);
 		memcpy(newdata->str, sb->buf->str, sb->used);
 		sb->buf = newdata;
 	}
@@ -139,7 +216,9 @@ void string_builder_append_str(struct string_builder *sb, const char *s, size_t
 		if (needed > newcap) {
 			newcap = needed;
 		}
+		GC_PROTECT(sb->buf);
 		struct string *newdata = unsafe_make_uninitialized_str(newcap);
+		GC_UNPROTECT(1);
 		memcpy(newdata->str, sb->buf->str, sb->used);
 		sb->buf = newdata;
 	}
@@ -151,7 +230,9 @@ struct string *finish_string_builder(struct string_builder *sb) {
 	if (sb->used == sb->buf->len) {
 		ret = sb->buf;
 	} else {
+		GC_PROTECT(sb->buf);
 		ret = make_str_from_ptr_len(sb->buf->str, sb->used);
+		GC_UNPROTECT(1);
 	}
 	sb->buf = NULL;
 	sb->used = 0;
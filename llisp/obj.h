@@ -1,4 +1,5 @@
 #pragma once
+#include <stdint.h>
 #include <stdio.h>
 #include "env.h"
 #include "hashtab.h"
@@ -15,19 +16,34 @@ enum objtype {
 	MACRO,
 	CONTN,
 	ENV,
-	HASHTABARR
+	HASHTABARR,
+	WEAKHASHTABARR,
+	WEAKTABLE,
+	LOCALREF,
+	GLOBALREF,
+	SCOPE,
+	FRAME,
+	BYTECODE,
+	VMSTATE,
+	/* Only seen by the GC while it's moving objects out of the nursery */
+	FORWARDED
 };
 
+/* One word. The GC keeps its mark bits off to the side. */
 struct obj {
-	struct obj *marknext;
 	enum objtype type;
-	_Bool marked;
+	/* print's own mark, so it can find cycles */
+	_Bool printing;
 };
 
-#define TYPE(o) ((o)->type)
+/* Numbers may not point at a real object, see below */
+#define TYPE(o) obj_type(o)
 
 struct contn;
 #define CPS_ARGS struct contn *self, struct obj *obj, struct contn **ret
+/* A builtin function's arguments are the `argc' values in `argv', which is only
+ * good until it returns. Otherwise it's a step like any other. */
+#define FN_ARGS struct contn *self, int argc, struct obj **argv, struct contn **ret
 
 
 /*
@@ -45,15 +61,72 @@ struct obj *cons(struct obj *l, struct obj *r);
 
 
 /*
- * A number. Always a double, we don't support the numerical tower.
+ * A number. Either an exact integer or a double, we don't support the rest of
+ * the numerical tower. Integers too big to be exact turn into doubles.
+ *
+ * Where pointers are 64 bits, numbers aren't objects at all. A double's bits
+ * are stored in the pointer itself, offset by NUM_OFFSET. Real objects all live
+ * below that: user space pointers only use 47 or 48 bits. Every NaN gets folded
+ * into one, which leaves the top of the address space free for integers that
+ * fit in FIXNUM_BITS bits. With 32-bit pointers there's no room, so numbers are
+ * boxed in a struct num.
+ *
+ * IS_INT and AS_INT only work on numbers. AS_NUM works on either kind.
  */
 struct num {
 	struct obj o;
+	_Bool exact;
+	union {
+		double d;
+		int64_t i;
+	} as;
+};
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define IMMEDIATE_NUMS
+#define NUM_OFFSET ((uint64_t)1 << 49)
+#define CANONICAL_NAN 0x7FF8000000000000u
+#define FIXNUM_BITS 49
+#define FIXNUM_TAG (~(uint64_t)0 << FIXNUM_BITS)
+#define FIXNUM_MIN (-((int64_t)1 << (FIXNUM_BITS - 1)))
+#define FIXNUM_MAX (((int64_t)1 << (FIXNUM_BITS - 1)) - 1)
+union num_bits {
+	uint64_t bits;
 	double num;
 };
-#define AS_NUM(o) (((struct num*)(o))->num)
+#define IS_NUM(o) ((uintptr_t)(o) >= NUM_OFFSET)
+#define IS_INT(o) ((uintptr_t)(o) >= FIXNUM_TAG)
+/* shift the tag out and sign extend */
+#define AS_INT(o) ((int64_t)((uint64_t)(uintptr_t)(o) << (64 - FIXNUM_BITS)) >> (64 - FIXNUM_BITS))
+#define AS_DOUBLE(o) (((union num_bits){ .bits = (uintptr_t)(o) - NUM_OFFSET }).num)
+
+static inline struct obj *make_num(double val) {
+	union num_bits u = { .num = val };
+	if (val != val) u.bits = CANONICAL_NAN;
+	return (struct obj *)(uintptr_t)(u.bits + NUM_OFFSET);
+}
+static inline struct obj *make_int(int64_t val) {
+	if (val < FIXNUM_MIN || val > FIXNUM_MAX) return make_num((double)val);
+	return (struct obj *)(uintptr_t)(FIXNUM_TAG | ((uint64_t)val & ~FIXNUM_TAG));
+}
+#else
+#define IS_NUM(o) 0
+#define IS_INT(o) (((struct num*)(o))->exact)
+#define AS_INT(o) (((struct num*)(o))->as.i)
+#define AS_DOUBLE(o) (((struct num*)(o))->as.d)
 
 struct obj *make_num(double val);
+struct obj *make_int(int64_t val);
+#endif
+
+static inline double num_value(struct obj *o) {
+	return IS_INT(o) ? (double)AS_INT(o) : AS_DOUBLE(o);
+}
+#define AS_NUM(o) num_value(o)
+
+static inline enum objtype obj_type(struct obj *o) {
+	return IS_NUM(o) ? NUM : o->type;
+}
 
 
 /*
@@ -64,7 +137,7 @@ struct builtin {
 	const char *name;
 };
 #define AS_BUILTIN(o) ((struct builtin*)(o))
-#define STATIC_BUILTIN(name) { { NULL, BUILTIN, 0 }, name }
+#define STATIC_BUILTIN(name) { { BUILTIN, 0 }, name }
 
 
 /*
@@ -73,6 +146,8 @@ struct builtin {
 struct string {
 	struct obj o;
 	size_t len;
+	/* Only filled in for symbols, see intern_symbol */
+	uint32_t hash;
 	char str[1];
 };
 #define AS_SYMBOL(o) ((struct string*)(o))
@@ -111,16 +186,25 @@ void print_string_builder_escaped(FILE *f, struct string_builder *sb);
 
 
 /*
- * A function/special form implemented in C instead of lisp.
+ * A function/special form implemented in C instead of lisp. A special form gets
+ * its arguments as they are, in a list, through `fn'. A function gets them
+ * evaluated, in an array, through `call', and it's only ever called with
+ * between `min_args' and `max_args' of them (any number more if that's
+ * ANY_ARGS).
  */
+#define ANY_ARGS -1
 struct fn {
 	struct obj o;
 	struct obj *(*fn)(CPS_ARGS);
+	struct obj *(*call)(FN_ARGS);
+	int min_args;
+	int max_args;
 	const char *fnname;
 };
 #define AS_FN(o) ((struct fn*)(o))
 
-struct obj *make_fn(enum objtype type, struct obj *(*fn)(CPS_ARGS), const char *name);
+struct obj *make_fn(struct obj *(*call)(FN_ARGS), int min_args, int max_args, const char *name);
+struct obj *make_specform(struct obj *(*fn)(CPS_ARGS), const char *name);
 
 
 /*
@@ -129,6 +213,8 @@ struct obj *make_fn(enum objtype type, struct obj *(*fn)(CPS_ARGS), const char *
  * scope). Also remembers the first symbol that it is assigned to for help debugging.
  * For example, (define my_func (lambda () ...)) will associate 'my_func with
  * the lambda. Even (let ((my_func (lambda () ...))) ...) will do the same.
+ * Lambdas that went through the expander have a struct scope instead of a plain
+ * list of argument names.
  */
 struct closure {
 	struct obj o;
@@ -142,6 +228,88 @@ struct closure {
 struct obj *make_closure(enum objtype type, struct obj *args, struct obj *code, struct env *env);
 
 
+/*
+ * A reference to a lambda's variable, found by the expander (see "Lexical
+ * addressing" in macroexpander.c). The variable lives in slot `slot' of the
+ * frame `depth' frames up from the current one. Only ever seen in expanded
+ * code, never as a value.
+ */
+struct local_ref {
+	struct obj o;
+	struct string *name;
+	uint32_t depth;
+	uint32_t slot;
+};
+#define AS_LOCAL_REF(o) ((struct local_ref*)(o))
+
+struct obj *make_local_ref(struct string *name, uint32_t depth, uint32_t slot);
+
+/*
+ * A reference to a global variable in expanded code. It remembers the value it
+ * found last time, which is good for as long as the global epoch hasn't moved
+ * on from `epoch' (see getglobal).
+ */
+struct global_ref {
+	struct obj o;
+	struct string *name;
+	struct obj *value;
+	size_t epoch;
+};
+#define AS_GLOBAL_REF(o) ((struct global_ref*)(o))
+
+struct obj *make_global_ref(struct string *name);
+
+/*
+ * Takes the place of an expanded lambda's argument list: the arguments, plus how
+ * many slots its frames need for them and everything the body defines.
+ */
+struct scope {
+	struct obj o;
+	struct obj *params;
+	size_t nslots;
+};
+#define AS_SCOPE(o) ((struct scope*)(o))
+
+struct obj *make_scope(struct obj *params, size_t nslots);
+
+
+/*
+ * A lambda body or top-level form compiled by compile.c. `scope' is the lambda's
+ * struct scope, or () for a top-level form. The constants are followed by `len'
+ * words of instructions (see bytecode.h), and running them never needs more than
+ * `maxstack' stack slots. With --jit, a lambda body that's been called often
+ * enough also gets native code (see jit.c), and a program compiled to C has
+ * native code for all of its bytecode (see aot.c).
+ */
+struct native_code;
+struct bytecode {
+	struct obj o;
+	struct obj *scope;
+	uint32_t nconsts;
+	uint32_t len;
+	uint32_t maxstack;
+	uint32_t calls;
+	const struct native_code *native;
+	struct obj *consts[1];
+};
+#define AS_BYTECODE(o) ((struct bytecode*)(o))
+#define BYTECODE_WORDS(b) ((uint32_t *)&(b)->consts[(b)->nconsts])
+
+/*
+ * Where some bytecode was when it called something else: what was on its stack
+ * and the instruction to pick up at when the result comes back. Never changes
+ * once it's made, so continuations can resume it more than once.
+ */
+struct vm_state {
+	struct obj o;
+	struct bytecode *code;
+	uint32_t pc;
+	uint32_t sp;
+	struct obj *stack[1];
+};
+#define AS_VM_STATE(o) ((struct vm_state*)(o))
+
+
 /*
  * A continuation expects to be given a simple llisp value. This is the obj pointer.
  * Instead of returning, the continuation invokes another continuation, giving it
@@ -150,6 +318,10 @@ struct obj *make_closure(enum objtype type, struct obj *args, struct obj *code,
  *
  * A continuation may have some associated data and an environment. It knows what to
  * do next and how to fail in the proper way.
+ *
+ * New continuations go on the control stack rather than in the heap, and are
+ * gone once control returns past them. Anything that wants to keep one has to
+ * use capture_contn (see cps.c).
  */
 struct contn {
 	struct obj o;
@@ -165,6 +337,22 @@ struct contn *make_empty_contn();
 struct contn *dupcontn(struct contn *c);
 
 
+/*
+ * A hash table from symbols to values that doesn't keep its keys alive. Once
+ * nothing else refers to a key its entry disappears; until then the entry keeps
+ * its value alive. The GC uses the links to keep track of the tables it's seen.
+ */
+struct weak_table {
+	struct obj o;
+	struct hashtab table;
+	struct weak_table *next_minor;
+	struct weak_table *next_major;
+};
+#define AS_WEAK_TABLE(o) ((struct weak_table*)(o))
+
+struct obj *make_weak_table();
+
+
 /* Builtins */
 #define NIL ((struct obj*)&nil)
 #define TRUE ((struct obj*)&true_)
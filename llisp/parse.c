@@ -1,9 +1,11 @@
 #include <ctype.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "gc.h"
 #include "obj.h"
 #include "parse.h"
 
@@ -53,6 +55,7 @@ enum token_type {
 	TT_DOT,
 	TT_IDENT,
 	TT_STRING,
+	TT_INTEGER,
 	TT_NUMBER,
 	TT_SHARPT,
 	TT_SHARPF,
@@ -65,6 +68,7 @@ struct token {
 	enum token_type type;
 	union {
 		struct string *str;
+		int64_t integer;
 		double num;
 	} as;
 	int line;
@@ -253,7 +257,17 @@ static void read_token(struct buf *buf) {
 		return;
 	}
 	if (can_begin_num(sb.buf->str[0])) {
+		/* strtoll and strtod need it nul-terminated */
+		string_builder_append(&sb, '\0');
+		--sb.used;
 		char* endp;
+		errno = 0;
+		long long ival = strtoll(sb.buf->str, &endp, 10);
+		if (endp == sb.buf->str + sb.used && errno != ERANGE) {
+			curtok.type = TT_INTEGER;
+			curtok.as.integer = ival;
+			return;
+		}
 		double val = strtod(sb.buf->str, &endp);
 		if (endp == sb.buf->str + sb.used) {
 			curtok.type = TT_NUMBER;
@@ -314,6 +328,9 @@ static void print_curtok(FILE *f) {
 		print_str_escaped(f, curtok.as.str);
 		fputc('"', f);
 		break;
+	case TT_INTEGER:
+		fprintf(f, "%" PRId64, curtok.as.integer);
+		break;
 	case TT_NUMBER:
 		fprintf(f, "%f", curtok.as.num);
 		break;
@@ -356,15 +373,20 @@ static enum parse_result parse_list(struct buf *buf, struct obj **result) {
 		SEEN_DOT,
 		DOT_AND_SYMBOL,
 	} dot_status = NO_DOT;
+	enum parse_result status;
+	GC_PROTECT(list);
+	GC_PROTECT(cur);
 	for (;;) {
 		read_token(buf);
 		if (curtok.type == TT_DOT) {
 			if (dot_status == SEEN_DOT) {
 				error("too many dots");
-				return PARSE_INVALID;
+				status = PARSE_INVALID;
+				break;
 			} else if (list == NIL) {
 				error("illegal dot - no first element");
-				return PARSE_INVALID;
+				status = PARSE_INVALID;
+				break;
 			}
 			dot_status = SEEN_DOT;
 			continue;
@@ -372,34 +394,44 @@ static enum parse_result parse_list(struct buf *buf, struct obj **result) {
 		if (curtok.type == TT_RPAREN) {
 			if (dot_status == SEEN_DOT) {
 				error("illegal dot - no final element");
-				return PARSE_INVALID;
+				status = PARSE_INVALID;
+				break;
 			}
 			*result = list;
-			return PARSE_OK;
+			status = PARSE_OK;
+			break;
 		}
 		if (dot_status == DOT_AND_SYMBOL) {
 			error("too many elements after last dot");
-			return PARSE_INVALID;
+			status = PARSE_INVALID;
+			break;
 		}
 
 		struct obj *obj;
 		enum parse_result ret = parse_one(buf, &obj);
 		if (ret == PARSE_EMPTY) {
-			return PARSE_PARTIAL;
+			status = PARSE_PARTIAL;
+			break;
 		} else if (ret != PARSE_OK) {
-			return ret;
+			status = ret;
+			break;
 		}
 
 		if (dot_status == SEEN_DOT) {
+			gc_write_barrier(cur);
 			CDR(cur) = obj;
 			dot_status = DOT_AND_SYMBOL;
 		} else if (list == NIL) {
 			list = cur = cons(obj, NIL);
 		} else {
-			CDR(cur) = cons(obj, NIL);
-			cur = CDR(cur);
+			struct obj *tail = cons(obj, NIL);
+			gc_write_barrier(cur);
+			CDR(cur) = tail;
+			cur = tail;
 		}
 	}
+	GC_UNPROTECT(2);
+	return status;
 }
 
 static enum parse_result parse_one(struct buf *buf, struct obj **result) {
@@ -409,7 +441,11 @@ static enum parse_result parse_one(struct buf *buf, struct obj **result) {
 			struct obj *quoted; \
 			enum parse_result ret = parse_one(buf, &quoted); \
 			if (ret == PARSE_OK) { \
-				*result = cons(intern_symbol(str_from_string_lit(#name)), cons(quoted, NIL)); \
+				struct obj *rest = cons(quoted, NIL); \
+				GC_PROTECT(rest); \
+				struct obj *sym = intern_symbol(str_from_string_lit(#name)); \
+				GC_UNPROTECT(1); \
+				*result = cons(sym, rest); \
 			} \
 			return ret; \
 		}
@@ -427,6 +463,9 @@ static enum parse_result parse_one(struct buf *buf, struct obj **result) {
 		case TT_STRING:
 			*result = (struct obj *)curtok.as.str;
 			return PARSE_OK;
+		case TT_INTEGER:
+			*result = make_int(curtok.as.integer);
+			return PARSE_OK;
 		case TT_NUMBER:
 			*result = make_num(curtok.as.num);
 			return PARSE_OK;
@@ -459,16 +498,21 @@ enum parse_result parse(struct buf *buf, struct obj **result) {
 	*result = NIL;
 	struct obj **next = result;
 	struct obj *cur;
+	gc_push_root(result);
+	GC_PROTECT(next);
 	for (;;) {
 		read_token(buf);
 		ret = parse_one(buf, &cur);
 		if (ret == PARSE_OK) {
-			*next = cons(cur, NIL);
+			struct obj *tail = cons(cur, NIL);
+			gc_write_barrier(next);
+			*next = tail;
 			next = &CDR(*next);
 		} else {
 			break;
 		}
 	}
+	GC_UNPROTECT(2);
 	if (ret == PARSE_EMPTY && *result != NIL) {
 		/* The call to parse_one after we have parsed the last form will
 		 * return PARSE_EMPTY. But the overall parse succeeded. */
@@ -1,14 +1,12 @@
-#include <limits.h>
-#include <math.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
-#include "gc-private.h"
 #include "obj.h"
 #include "print.h"
 
-#define OBJ_MARKED(o) ISMARKED(o)
-#define MARK_OBJ(o) ADDMARK(o)
-#define DEL_OBJMARK(o) DELMARK(o)
+#define OBJ_MARKED(o) ((o)->printing)
+#define MARK_OBJ(o) ((o)->printing = 1)
+#define DEL_OBJMARK(o) ((o)->printing = 0)
 
 void print(struct obj *obj) { print_on(stdout, obj, 1); }
 void display(struct obj *obj) { print_on(stdout, obj, 0); }
@@ -18,19 +16,25 @@ static void print_on_helper(FILE *f, struct obj *obj, _Bool verbose) {
 	default:
 		fprintf(stderr, "<#unknown type %d>", TYPE(obj));
 		break;
-	case NUM: {
-		double d = AS_NUM(obj);
-		if (d == round(d) && d >= LONG_MIN && d <= LONG_MAX) {
-			/* if d is integral, print it as such */
-			fprintf(f, "%ld", (long)d);
+	case NUM:
+		if (IS_INT(obj)) {
+			fprintf(f, "%" PRId64, AS_INT(obj));
 		} else {
 			fprintf(f, "%f", AS_NUM(obj));
 		}
 		break;
-	}
 	case SYMBOL:
 		print_str(f, AS_SYMBOL(obj));
 		break;
+	case LOCALREF:
+		print_str(f, AS_LOCAL_REF(obj)->name);
+		break;
+	case GLOBALREF:
+		print_str(f, AS_GLOBAL_REF(obj)->name);
+		break;
+	case SCOPE:
+		print_on_helper(f, AS_SCOPE(obj)->params, verbose);
+		break;
 	case STRING:
 		if (verbose) {
 			putc('"', f);
@@ -70,7 +74,7 @@ static void print_on_helper(FILE *f, struct obj *obj, _Bool verbose) {
 		fputs(AS_BUILTIN(obj)->name, f);
 		break;
 	case CELL: {
-		// We appropriate the GC marking to avoid printing cyclic objects
+		// Mark cells as we go to avoid printing cyclic objects
 		if (OBJ_MARKED(obj)) {
 			fprintf(f, "...");
 			return;
@@ -99,6 +103,9 @@ static void print_on_helper(FILE *f, struct obj *obj, _Bool verbose) {
 	case CONTN:
 		fputs("<#continuation>", f);
 		break;
+	case WEAKTABLE:
+		fputs("<#weak-hash-table>", f);
+		break;
 	}
 }
 
@@ -108,6 +115,9 @@ static void clear_marks(struct obj *obj) {
 	case MACRO:
 		clear_marks(AS_CLOSURE(obj)->args);
 		break;
+	case SCOPE:
+		clear_marks(AS_SCOPE(obj)->params);
+		break;
 	case CELL:
 		if (OBJ_MARKED(obj)) {
 			DEL_OBJMARK(obj);
@@ -120,6 +130,6 @@ static void clear_marks(struct obj *obj) {
 
 void print_on(FILE *f, struct obj *obj, _Bool verbose) {
 	print_on_helper(f, obj, verbose);
-	// Now that we've printed, let's clear all the marks to avoid messing up the GC
+	// Now that we've printed, let's clear all the marks for next time
 	clear_marks(obj);
 }
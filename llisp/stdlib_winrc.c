@@ -7,6 +7,7 @@
 #undef FALSE
 
 #include "cps.h"
+#include "gc.h"
 #include "parse.h"
 #include "stdlib.h"
 
@@ -22,7 +23,8 @@ void add_stdlib(struct env *env) {
 	struct buf stdlib;
 	init_buf(stdlibData, stdlibLen, &stdlib);
 
-	struct obj *obj;
+	struct obj *obj = NIL;
+	GC_PROTECT(obj);
 	if (parse(&stdlib, &obj) != PARSE_OK) {
 		abort();
 	}
@@ -30,4 +32,5 @@ void add_stdlib(struct env *env) {
 		run_cps(CAR(obj), env, NULL /*failed*/);
 		obj = CDR(obj);
 	}
+	GC_UNPROTECT(1);
 }
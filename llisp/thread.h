@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+
+/* Just enough threading for the parallel marker */
+
+struct thread;
+struct semaphore;
+struct mutex;
+
+struct thread *thread_start(void (*fn)(void *), void *arg);
+void thread_join(struct thread *t);
+
+struct semaphore *semaphore_create();
+void semaphore_wait(struct semaphore *s);
+void semaphore_post(struct semaphore *s);
+
+struct mutex *mutex_create();
+void mutex_lock(struct mutex *m);
+void mutex_unlock(struct mutex *m);
+
+/* Set `bit' in `*word'. Returns whether it was clear before. */
+_Bool atomic_set_bit(volatile uint64_t *word, uint64_t bit);
+long atomic_increment(volatile long *val);
+long atomic_decrement(volatile long *val);
+void thread_yield();
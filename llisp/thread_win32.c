@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include "thread.h"
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+struct thread {
+	HANDLE handle;
+	void (*fn)(void *);
+	void *arg;
+};
+
+static DWORD WINAPI thread_main(LPVOID param) {
+	struct thread *t = param;
+	t->fn(t->arg);
+	return 0;
+}
+
+struct thread *thread_start(void (*fn)(void *), void *arg) {
+	struct thread *t = malloc(sizeof(*t));
+	if (!t) return NULL;
+	t->fn = fn;
+	t->arg = arg;
+	t->handle = CreateThread(NULL, 0, thread_main, t, 0, NULL);
+	if (!t->handle) {
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+void thread_join(struct thread *t) {
+	WaitForSingleObject(t->handle, INFINITE);
+	CloseHandle(t->handle);
+	free(t);
+}
+
+struct semaphore *semaphore_create() {
+	return (struct semaphore *)CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+}
+void semaphore_wait(struct semaphore *s) {
+	WaitForSingleObject((HANDLE)s, INFINITE);
+}
+void semaphore_post(struct semaphore *s) {
+	ReleaseSemaphore((HANDLE)s, 1, NULL);
+}
+
+struct mutex {
+	SRWLOCK lock;
+};
+struct mutex *mutex_create() {
+	struct mutex *m = malloc(sizeof(*m));
+	if (m) InitializeSRWLock(&m->lock);
+	return m;
+}
+void mutex_lock(struct mutex *m) {
+	AcquireSRWLockExclusive(&m->lock);
+}
+void mutex_unlock(struct mutex *m) {
+	ReleaseSRWLockExclusive(&m->lock);
+}
+
+_Bool atomic_set_bit(volatile uint64_t *word, uint64_t bit) {
+	return (InterlockedOr64((volatile LONG64 *)word, (LONG64)bit) & bit) == 0;
+}
+long atomic_increment(volatile long *val) {
+	return InterlockedIncrement(val);
+}
+long atomic_decrement(volatile long *val) {
+	return InterlockedDecrement(val);
+}
+void thread_yield() {
+	SwitchToThread();
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "bytecode.h"
+#include "vm.h"
+
+/*
+ * Running some bytecode. There's one of these for each trip out of the
+ * trampoline in run_cps. Calls and returns between bytecode functions happen
+ * right here without going back out; we only leave for things that need a real
+ * continuation, like a call to a lambda that eval_cps made or to a builtin like
+ * apply or call/cc.
+ *
+ * A non-tail call saves the caller's part of the stack in a struct vm_state for
+ * the continuation it passes along, and the callee starts over at the bottom.
+ * Nothing else can see the values on the stack, so its slots are registered as
+ * roots, as many as the hungriest bytecode so far has needed.
+ */
+struct vm {
+	struct bytecode *code;
+	struct env *env;
+	struct contn *next;
+	/* What we pass as `self' to builtins in non-tail and tail position. Made
+	 * when they're first needed. See call_self. */
+	struct contn *call;
+	struct contn *tail_call;
+	uint32_t nrooted;
+	/* Where native code wants us to go when it returns NATIVE_LEAVE */
+	struct obj *leaving;
+	struct contn *leave_to;
+	struct obj *stack[VM_STACK_SIZE];
+};
+
+/* What OP_DEFINE, OP_SET and OP_CLOSURE do, for the interpreter and native
+ * code alike. vm_set returns 0 if var doesn't exist, without complaining. */
+void vm_define(struct vm *vm, struct obj *var, struct obj *value);
+_Bool vm_set(struct vm *vm, struct obj *var, struct obj *value);
+struct obj *vm_closure(struct vm *vm, struct obj *code);
+
+/* The same goes for calls and returns. `pc' is the instruction after the call.
+ *
+ * Start a call to the bytecode lambda in stack[base] with the `nargs' values
+ * above it, for OP_CALL or OP_TAIL_CALL (`tail'). The caller then goes to
+ * instruction 0 with an empty stack. Returns 0 if the arguments are wrong. */
+_Bool vm_enter(struct vm *vm, uint32_t base, uint32_t nargs, _Bool tail, uint32_t pc);
+/* Call the builtin in stack[base] with the `nargs' values above it. Returns 1
+ * with its value in *result if it comes straight back. Otherwise it's going to
+ * *ret with *result, which carries on after the call if it isn't a tail call. */
+_Bool vm_call_builtin(struct vm *vm, uint32_t base, uint32_t nargs, _Bool tail, uint32_t pc, struct obj **result, struct contn **ret);
+/* Give val to the bytecode waiting for it in vm->next, if that's what's next,
+ * and return 1 with the stack and instruction to carry on with. */
+_Bool vm_return(struct vm *vm, struct obj *val, uint32_t *sp, uint32_t *pc);
+
+/* Native code for some bytecode, from jit.c or from a program compiled to C by
+ * aot.c. `run' runs vm->code from instruction `pc', with the top of the stack at
+ * *sp, until it gets to an instruction it leaves to the interpreter. It returns
+ * that instruction's pc and updates *sp, or returns NATIVE_LEAVE if it's time to
+ * leave execute for vm->leave_to with vm->leaving. A call or return that
+ * switches vm->code can also return NATIVE_SWITCHED | pc, to carry on from pc
+ * in the new code with its own native code if it has some. */
+struct native_code {
+	uint32_t (*run)(struct vm *vm, struct obj ***sp, uint32_t pc);
+};
+#define NATIVE_LEAVE UINT32_MAX
+#define NATIVE_SWITCHED 0x80000000u
@@ -0,0 +1,502 @@
+#include <stdio.h>
+#include <string.h>
+#include "bytecode.h"
+#include "cps.h"
+#include "env-private.h"
+#include "gc.h"
+#include "jit.h"
+#include "obj.h"
+#include "print.h"
+#include "vm-private.h"
+
+_Bool use_vm = 0;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
+
+/* code, env, next, call and tail_call */
+#define VM_ROOTS 5
+
+static void root_stack(struct vm *vm) {
+	while (vm->nrooted < vm->code->maxstack) {
+		vm->stack[vm->nrooted] = NULL;
+		GC_PROTECT(vm->stack[vm->nrooted]);
+		++vm->nrooted;
+	}
+}
+
+/* Switch to state's code and stack, with value pushed on top. Returns the new sp. */
+static uint32_t restore(struct vm *vm, struct vm_state *state, struct obj *value) {
+	vm->code = state->code;
+	root_stack(vm);
+	memcpy(vm->stack, state->stack, state->sp * sizeof(struct obj *));
+	vm->stack[state->sp] = value;
+	return state->sp + 1;
+}
+
+/* Save the bottom `sp' values of the stack, to pick up again at `pc' */
+static struct obj *save_state(struct vm *vm, uint32_t sp, uint32_t pc) {
+	struct vm_state *state = AS_VM_STATE(gc_alloc(VMSTATE, offsetof(struct vm_state, stack) + sp * sizeof(struct obj *)));
+	state->code = vm->code;
+	state->pc = pc;
+	state->sp = sp;
+	memcpy(state->stack, vm->stack, sp * sizeof(struct obj *));
+	return &state->o;
+}
+
+/* A continuation that carries on from here once it gets a value */
+static struct contn *make_resume(struct vm *vm, uint32_t sp, uint32_t pc) {
+	struct obj *state = save_state(vm, sp, pc);
+	GC_PROTECT(state);
+	struct contn *ret = make_empty_contn();
+	GC_UNPROTECT(1);
+	ret->data = state;
+	ret->env = vm->env;
+	ret->next = vm->next;
+	ret->fn = vm_resume;
+	return ret;
+}
+
+/* Builtins almost always just return to self->next. For a call in non-tail
+ * position, that's a blank continuation we only fill in (see OP_CALL) if the
+ * builtin turns out to want more than that. Otherwise we can keep using it.
+ * Builtins like `eval' look at our environment, so it has to be up to date. */
+static struct contn *call_self(struct vm *vm) {
+	if (!vm->call || vm->call->env != vm->env || vm->call->next->next != vm->next) {
+		struct contn *blank = make_empty_contn();
+		blank->env = vm->env;
+		blank->next = vm->next;
+		vm->call = make_empty_contn();
+		vm->call->env = vm->env;
+		vm->call->next = blank;
+	}
+	return vm->call;
+}
+
+/* In tail position, builtins return straight to our continuation */
+static struct contn *tail_call_self(struct vm *vm) {
+	if (!vm->tail_call || vm->tail_call->next != vm->next || vm->tail_call->env != vm->env) {
+		vm->tail_call = make_empty_contn();
+		vm->tail_call->env = vm->env;
+		vm->tail_call->next = vm->next;
+	}
+	return vm->tail_call;
+}
+
+/* The continuations on the control stack newer than vm->next belonged to code
+ * that's finished now */
+static void pop_finished(struct vm *vm) {
+	pop_contns(vm->next);
+	vm->call = NULL;
+	vm->tail_call = NULL;
+}
+
+static struct obj *list_args(struct obj **args, uint32_t nargs) {
+	struct obj *ret = NIL;
+	GC_PROTECT(ret);
+	while (nargs--) {
+		ret = cons(args[nargs], ret);
+	}
+	GC_UNPROTECT(1);
+	return ret;
+}
+
+static void print_closure_name(struct closure *cl) {
+	if (cl->closurename) {
+		print_str(stderr, cl->closurename);
+	} else {
+		fputs("apply", stderr);
+	}
+}
+
+/* The frame for calling the bytecode closure in args[-1], like apply_closure would
+ * make. NULL if there aren't enough arguments. */
+static struct env *bind_args(struct obj **args, uint32_t nargs) {
+	struct closure *cl = AS_CLOSURE(args[-1]);
+	struct obj *params = AS_SCOPE(cl->args)->params;
+	uint32_t npositional = 0;
+	for (; TYPE(params) == CELL; params = CDR(params)) ++npositional;
+	_Bool has_rest = params != NIL;
+	if (nargs < npositional) {
+		print_closure_name(cl);
+		fputs(": too few arguments given\n", stderr);
+		return NULL;
+	}
+	if (nargs > npositional && !has_rest) {
+		fputs("warning: ", stderr);
+		print_closure_name(cl);
+		fputs(": too many arguments given\n", stderr);
+	}
+	size_t nslots = AS_SCOPE(cl->args)->nslots;
+	if (nslots == 0) return cl->env;
+
+	struct obj *rest = NIL;
+	GC_PROTECT(rest);
+	if (has_rest) rest = list_args(args + npositional, nargs - npositional);
+	struct env *frame = make_frame(AS_CLOSURE(args[-1])->env, nslots);
+	GC_UNPROTECT(1);
+	/* it may have moved */
+	cl = AS_CLOSURE(args[-1]);
+	size_t slot = 0;
+	for (params = AS_SCOPE(cl->args)->params; TYPE(params) == CELL; params = CDR(params)) {
+		initslot(frame, slot, AS_SYMBOL(CAR(params)), args[slot]);
+		++slot;
+	}
+	if (has_rest) initslot(frame, slot, AS_SYMBOL(params), rest);
+	return frame;
+}
+
+void vm_define(struct vm *vm, struct obj *var, struct obj *value) {
+	if (TYPE(var) == LOCALREF) {
+		defineslot(vm->env, AS_LOCAL_REF(var), value);
+	} else {
+		definesym(vm->env, AS_SYMBOL(var), value);
+	}
+}
+
+_Bool vm_set(struct vm *vm, struct obj *var, struct obj *value) {
+	if (TYPE(var) == LOCALREF) {
+		return setslot(vm->env, AS_LOCAL_REF(var), value);
+	}
+	return setsym(vm->env, AS_SYMBOL(var), value);
+}
+
+struct obj *vm_closure(struct vm *vm, struct obj *code) {
+	return make_closure(LAMBDA, AS_BYTECODE(code)->scope, code, vm->env);
+}
+
+_Bool vm_call_builtin(struct vm *vm, uint32_t base, uint32_t nargs, _Bool tail, uint32_t pc, struct obj **result, struct contn **ret) {
+	struct obj **stack = vm->stack;
+	/* builtin functions take their arguments straight off the stack */
+	struct obj *arglist = TYPE(stack[base]) == SPECFORM ? list_args(&stack[base + 1], nargs) : NIL;
+	GC_PROTECT(arglist);
+	struct contn *self = tail ? tail_call_self(vm) : call_self(vm);
+	struct contn *k;
+	struct obj *val = TYPE(stack[base]) == FN ?
+		call_fn(self, AS_FN(stack[base]), (int)nargs, &stack[base + 1], &k) :
+		AS_FN(stack[base])->fn(self, arglist, &k);
+	GC_UNPROTECT(1);
+	*result = val;
+	/* the builtin may have moved it */
+	self = tail ? vm->tail_call : vm->call;
+	if (k == self->next) return 1;
+	if (k != &cfail && !tail) {
+		/* It wants a real continuation, so give it one after the fact */
+		GC_PROTECT(*result);
+		GC_PROTECT(k);
+		struct obj *state = save_state(vm, base, pc);
+		GC_UNPROTECT(2);
+		struct contn *blank = vm->call->next;
+		blank->data = state;
+		blank->fn = vm_resume;
+	}
+	*ret = k;
+	return 0;
+}
+
+_Bool vm_enter(struct vm *vm, uint32_t base, uint32_t nargs, _Bool tail, uint32_t pc) {
+	struct closure *cl = AS_CLOSURE(vm->stack[base]);
+	struct bytecode *callee = AS_BYTECODE(cl->code);
+	if (use_jit && !callee->native && ++callee->calls == JIT_THRESHOLD) {
+		jit_compile(callee, cl->closurename);
+	}
+	struct env *env = bind_args(&vm->stack[base + 1], nargs);
+	if (!env) return 0;
+	if (!tail) {
+		GC_PROTECT(env);
+		struct contn *resume = make_resume(vm, base, pc);
+		GC_UNPROTECT(1);
+		vm->next = resume;
+	} else {
+		pop_finished(vm);
+	}
+	vm->env = env;
+	vm->code = AS_BYTECODE(AS_CLOSURE(vm->stack[base])->code);
+	root_stack(vm);
+	gc_step();
+	return 1;
+}
+
+_Bool vm_return(struct vm *vm, struct obj *val, uint32_t *sp, uint32_t *pc) {
+	struct contn *next = vm->next;
+	if (next->fn != vm_resume) return 0;
+	/* back to some bytecode: carry on there */
+	struct vm_state *state = AS_VM_STATE(next->data);
+	vm->env = next->env;
+	vm->next = next->next;
+	pop_finished(vm);
+	*sp = restore(vm, state, val);
+	*pc = state->pc;
+	return 1;
+}
+
+static void unknown_symbol(struct string *name) {
+	fputs("eval: unknown symbol \"", stderr);
+	print_str_escaped(stderr, name);
+	fputs("\"\n", stderr);
+}
+
+/* Run native code from `pc' for as long as there's native code to run, from
+ * one bytecode to the next. See struct native_code. */
+static uint32_t run_native(struct vm *vm, struct obj ***top, uint32_t pc) {
+	do {
+		pc = vm->code->native->run(vm, top, pc);
+		if (pc == NATIVE_LEAVE || !(pc & NATIVE_SWITCHED)) return pc;
+		pc &= ~NATIVE_SWITCHED;
+	} while (vm->code->native);
+	return pc;
+}
+
+/* Run vm->code from the start, or from where `resume' left off with `value' */
+static struct obj *execute(struct vm *vm, struct vm_state *resume, struct obj *value, struct contn **ret) {
+	struct obj **stack = vm->stack;
+	uint32_t sp = 0;
+	const uint32_t *ip;
+	struct obj **consts;
+	struct obj *result;
+	_Bool tail;
+
+	GC_PROTECT(vm->code);
+	GC_PROTECT(vm->env);
+	GC_PROTECT(vm->next);
+	GC_PROTECT(vm->call);
+	GC_PROTECT(vm->tail_call);
+	vm->nrooted = 0;
+
+#define JUMP_TO(pc) (ip = BYTECODE_WORDS(vm->code) + (pc), consts = vm->code->consts)
+#define PC() ((uint32_t)(ip - BYTECODE_WORDS(vm->code)))
+/* If vm->code has been compiled to native code, let it take over until it
+ * gets to something it leaves to us */
+#define RUN_NATIVE() \
+	if (vm->code->native) { \
+		struct obj **top = stack + sp; \
+		uint32_t pc = run_native(vm, &top, PC()); \
+		if (pc == NATIVE_LEAVE) { \
+			result = vm->leaving; \
+			*ret = vm->leave_to; \
+			goto leave; \
+		} \
+		JUMP_TO(pc); \
+		sp = (uint32_t)(top - stack); \
+	}
+	if (resume) {
+		sp = restore(vm, resume, value);
+		JUMP_TO(resume->pc);
+	} else {
+		root_stack(vm);
+		JUMP_TO(0);
+	}
+	RUN_NATIVE();
+
+#ifdef COMPUTED_GOTO
+	static void *const dispatch[NUM_OPCODES] = {
+		[OP_CONST] = &&op_OP_CONST,
+		[OP_LOCAL] = &&op_OP_LOCAL,
+		[OP_GLOBAL] = &&op_OP_GLOBAL,
+		[OP_DEFINE] = &&op_OP_DEFINE,
+		[OP_SET] = &&op_OP_SET,
+		[OP_CLOSURE] = &&op_OP_CLOSURE,
+		[OP_POP] = &&op_OP_POP,
+		[OP_JUMP] = &&op_OP_JUMP,
+		[OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+		[OP_CALL] = &&op_OP_CALL,
+		[OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+		[OP_RETURN] = &&op_OP_RETURN,
+		[OP_EVAL] = &&op_OP_EVAL,
+	};
+#define TARGET(op) op_##op
+#define DISPATCH() goto *dispatch[*ip++]
+	DISPATCH();
+#else
+#define TARGET(op) case op
+#define DISPATCH() continue
+	for (;;) switch (*ip++) {
+#endif
+	TARGET(OP_CONST):
+		stack[sp++] = consts[*ip++];
+		DISPATCH();
+
+	TARGET(OP_LOCAL): {
+		struct env *env = vm->env;
+		for (uint32_t depth = ip[0]; depth; --depth) env = env->parent;
+		struct obj *val = AS_FRAME(env)->slots[ip[1]];
+		if (!val) {
+			unknown_symbol(AS_LOCAL_REF(consts[ip[2]])->name);
+			goto fail;
+		}
+		ip += 3;
+		stack[sp++] = val;
+		DISPATCH();
+	}
+
+	TARGET(OP_GLOBAL): {
+		struct global_ref *ref = AS_GLOBAL_REF(consts[*ip++]);
+		struct obj *val = getglobal(vm->env, ref);
+		if (!val) {
+			unknown_symbol(ref->name);
+			goto fail;
+		}
+		stack[sp++] = val;
+		DISPATCH();
+	}
+
+	TARGET(OP_DEFINE):
+		vm_define(vm, consts[*ip++], stack[sp - 1]);
+		stack[sp - 1] = NIL;
+		DISPATCH();
+
+	TARGET(OP_SET): {
+		struct obj *var = consts[*ip++];
+		if (!vm_set(vm, var, stack[sp - 1])) {
+			fputs("set!: symbol \"", stderr);
+			print_str_escaped(stderr, TYPE(var) == LOCALREF ? AS_LOCAL_REF(var)->name : AS_SYMBOL(var));
+			fputs("\" does not exist\n", stderr);
+			goto fail;
+		}
+		stack[sp - 1] = NIL;
+		DISPATCH();
+	}
+
+	TARGET(OP_CLOSURE): {
+		struct obj *closure = vm_closure(vm, consts[*ip++]);
+		stack[sp++] = closure;
+		DISPATCH();
+	}
+
+	TARGET(OP_POP):
+		--sp;
+		DISPATCH();
+
+	TARGET(OP_JUMP):
+		JUMP_TO(*ip);
+		DISPATCH();
+
+	TARGET(OP_JUMP_IF_FALSE): {
+		uint32_t target = *ip++;
+		if (stack[--sp] == FALSE) JUMP_TO(target);
+		DISPATCH();
+	}
+
+	TARGET(OP_CALL):
+		tail = 0;
+		goto call;
+	TARGET(OP_TAIL_CALL):
+		tail = 1;
+	call: {
+		uint32_t nargs = *ip++;
+		/* where the function is. It stays there (so it's rooted) until we're done. */
+		uint32_t base = sp - nargs - 1;
+		struct obj *fn = stack[base];
+		struct obj **args = &stack[base + 1];
+		switch (TYPE(fn)) {
+		case LAMBDA:
+			if (TYPE(AS_CLOSURE(fn)->code) == BYTECODE) {
+				if (!vm_enter(vm, base, nargs, tail, PC())) goto fail;
+				sp = 0;
+				JUMP_TO(0);
+				RUN_NATIVE();
+				DISPATCH();
+			}
+			/* fallthrough */
+		case MACRO: {
+			/* made by eval_cps, so apply_closure has to run it */
+			struct obj *arglist = list_args(args, nargs);
+			GC_PROTECT(arglist);
+			struct contn *next = tail ? vm->next : make_resume(vm, base, PC());
+			GC_PROTECT(next);
+			*ret = make_empty_contn();
+			(*ret)->data = stack[base];
+			(*ret)->env = vm->env;
+			(*ret)->next = next;
+			(*ret)->fn = apply_closure;
+			GC_UNPROTECT(2);
+			result = arglist;
+			goto leave;
+		}
+		case FN:
+		case SPECFORM:
+			sp = base;
+			if (vm_call_builtin(vm, base, nargs, tail, PC(), &result, ret)) {
+				stack[sp++] = result;
+				RUN_NATIVE();
+				DISPATCH();
+			}
+			goto leave;
+		case CONTN:
+			if (nargs > 1) {
+				fputs("warning: apply: too many arguments given\n", stderr);
+			}
+			result = nargs ? args[0] : NIL;
+			*ret = AS_CONTN(fn);
+			goto leave;
+		default:
+			fprintf(stderr, "apply: unable to apply non-function ");
+			print_on(stderr, fn, 1 /*verbose*/);
+			fputc('\n', stderr);
+			goto fail;
+		}
+	}
+
+	TARGET(OP_RETURN): {
+		struct obj *val = stack[--sp];
+		uint32_t pc;
+		if (!vm_return(vm, val, &sp, &pc)) {
+			*ret = vm->next;
+			result = val;
+			goto leave;
+		}
+		JUMP_TO(pc);
+		RUN_NATIVE();
+		DISPATCH();
+	}
+
+	TARGET(OP_EVAL): {
+		uint32_t k = *ip++;
+		/* in tail position it can return straight to our continuation */
+		struct contn *next = *ip == OP_RETURN ? vm->next : make_resume(vm, sp, PC());
+		GC_PROTECT(next);
+		*ret = make_empty_contn();
+		GC_UNPROTECT(1);
+		(*ret)->env = vm->env;
+		(*ret)->next = next;
+		(*ret)->fn = eval_cps;
+		result = consts[k];
+		goto leave;
+	}
+#ifndef COMPUTED_GOTO
+	}
+#endif
+#undef RUN_NATIVE
+#undef JUMP_TO
+#undef PC
+
+fail:
+	*ret = &cfail;
+	result = NIL;
+leave:
+	GC_UNPROTECT(VM_ROOTS + vm->nrooted);
+	return result;
+}
+
+struct obj *vm_run(CPS_ARGS) {
+	(void)obj;
+	struct vm vm;
+	vm.code = AS_BYTECODE(self->data);
+	vm.env = self->env;
+	vm.next = self->next;
+	vm.call = NULL;
+	vm.tail_call = NULL;
+	return execute(&vm, NULL, NULL, ret);
+}
+
+struct obj *vm_resume(CPS_ARGS) {
+	struct vm_state *state = AS_VM_STATE(self->data);
+	struct vm vm;
+	vm.code = state->code;
+	vm.env = self->env;
+	vm.next = self->next;
+	vm.call = NULL;
+	vm.tail_call = NULL;
+	return execute(&vm, state, obj, ret);
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include "obj.h"
+
+/* Whether run_cps compiles each form to bytecode and runs that (--vm) instead
+ * of walking the expanded forms with eval_cps */
+extern _Bool use_vm;
+
+/* Compile obj, which must already have gone through macroexpand_cps, into a
+ * struct bytecode that runs it in an environment like env. Never fails: the
+ * VM hands anything it can't compile back to eval_cps. */
+struct obj *compile(struct obj *obj, struct env *env);
+
+/* self->data = bytecode, self->env = the frame it runs in. Call self->next
+ * with the result */
+struct obj *vm_run(CPS_ARGS);
+/* obj = result, self->data = vm_state that was waiting for it */
+struct obj *vm_resume(CPS_ARGS);
@@ -0,0 +1,78 @@
+from pathlib import Path
+from dataclasses import dataclass
+from typing import Optional
+import re
+import shlex
+import subprocess
+import sys
+import time
+
+# Run each benchmark against each command given on the commandline (an executable,
+# maybe with some flags) and report how long it took. Executables built with
+# GC_STATS also report how much each allocation cost, the longest GC pause and how
+# much memory the heap was holding at the end.
+BENCHMARK_PATH = Path(__file__).parent / 'benchmarks'
+
+NAME_WIDTH = 32
+RUNS = 3
+
+STAT_PATTERN = re.compile(r'^([A-Z][^:]*):\s+([0-9.]+)$', re.MULTILINE)
+
+@dataclass
+class Result:
+    seconds: float
+    stats: dict[str, float]
+
+    def allocations(self) -> Optional[float]:
+        return self.stats.get('Total allocations')
+
+    def longest_pause(self) -> Optional[float]:
+        return self.stats.get('Longest pause')
+
+    def heap_size(self) -> Optional[float]:
+        return self.stats.get('Heap size')
+
+def run_benchmark(cmd: list[str], bench: Path) -> Result:
+    best: Optional[Result] = None
+    for _ in range(RUNS):
+        start = time.perf_counter()
+        res = subprocess.run(cmd + [str(bench)], capture_output=True, text=True)
+        elapsed = time.perf_counter() - start
+        if res.returncode != 0:
+            raise RuntimeError(f'{shlex.join(cmd)} {bench.name} exited with {res.returncode}:\n{res.stderr}')
+        stats = {k: float(v) for k, v in STAT_PATTERN.findall(res.stdout)}
+        if best is None or elapsed < best.seconds:
+            best = Result(elapsed, stats)
+    assert best is not None
+    return best
+
+def describe(result: Result) -> str:
+    desc = f'{result.seconds:8.3f}s'
+    allocs = result.allocations()
+    if allocs:
+        desc += f' {result.seconds / allocs * 1e9:8.1f}ns/alloc'
+    pause = result.longest_pause()
+    if pause is not None:
+        desc += f' {pause * 1e3:8.3f}ms longest pause'
+    heap = result.heap_size()
+    if heap is not None:
+        desc += f' {heap / (1 << 20):8.1f}MiB heap'
+    return desc
+
+if __name__ == '__main__':
+    cmds = [shlex.split(arg) for arg in sys.argv[1:]]
+    if not cmds:
+        print(f'usage: {sys.argv[0]} "EXECUTABLE [FLAGS...]"...', file=sys.stderr)
+        sys.exit(1)
+    for cmd in cmds:
+        exe = Path(cmd[0])
+        if not exe.is_file():
+            print(f'Executable {exe} is not a valid file.', file=sys.stderr)
+            sys.exit(1)
+        cmd[0] = str(exe.resolve())
+
+    for bench in sorted(BENCHMARK_PATH.glob('*.llisp')):
+        print(f'{bench.stem}:')
+        for arg, cmd in zip(sys.argv[1:], cmds):
+            print(f'    {arg.ljust(NAME_WIDTH)} {describe(run_benchmark(cmd, bench))}')
+        print()
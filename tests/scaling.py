@@ -0,0 +1,33 @@
+from pathlib import Path
+import sys
+
+from bench import BENCHMARK_PATH, run_benchmark
+
+# Run a benchmark with 1 through N mark threads and report how marking time
+# scales. Needs an executable built with GC_STATS.
+DEFAULT_BENCHMARK = BENCHMARK_PATH / 'live-heap.llisp'
+
+if __name__ == '__main__':
+    if len(sys.argv) not in (3, 4):
+        print(f'usage: {sys.argv[0]} EXECUTABLE MAX_THREADS [BENCHMARK]', file=sys.stderr)
+        sys.exit(1)
+    exe = Path(sys.argv[1])
+    if not exe.is_file():
+        print(f'Executable {exe} is not a valid file.', file=sys.stderr)
+        sys.exit(1)
+    max_threads = int(sys.argv[2])
+    bench = Path(sys.argv[3]) if len(sys.argv) == 4 else DEFAULT_BENCHMARK
+
+    print(f'{bench.stem}:')
+    print(f'    {"threads":>7} {"total":>9} {"marking":>9} {"speedup":>8}')
+    base = None
+    for threads in range(1, max_threads + 1):
+        result = run_benchmark([str(exe.resolve()), f'--gc-threads={threads}'], bench)
+        marking = result.stats.get('Time marking')
+        if marking is None:
+            print(f'{exe} doesn\'t report GC stats; build it with GC_STATS.', file=sys.stderr)
+            sys.exit(1)
+        if base is None:
+            base = marking
+        speedup = base / marking if marking else float('inf')
+        print(f'    {threads:>7} {result.seconds:8.3f}s {marking:8.3f}s {speedup:7.2f}x')
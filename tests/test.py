@@ -9,6 +9,8 @@ import sys
 # TODO: add the ability to specify which tests to run on the commandline
 TESTCASE_PATH = Path(__file__).parent / 'testcases'
 EXECUTABLE_PATH = Path(__file__).parent.parent / 'x64/Debug/llisp.exe'
+# Passed to the executable before each testcase, e.g. --vm
+FLAGS: list[str] = []
 
 NAME_WIDTH = 60
 
@@ -36,7 +38,7 @@ def find_tests() -> Iterator[Testcase]:
 
 
 def run_test(test: Testcase) -> list[str]:
-    res = subprocess.run([EXECUTABLE_PATH, test.file], capture_output=True, text=True)
+    res = subprocess.run([EXECUTABLE_PATH, *FLAGS, test.file], capture_output=True, text=True)
     failures: list[str] = []
     if res.returncode != 0:
         failures.append(f'Exited with {res.returncode}')
@@ -57,6 +59,7 @@ def run_test(test: Testcase) -> list[str]:
 if __name__ == '__main__':
     if len(sys.argv) > 1:
         EXECUTABLE_PATH = Path(sys.argv[1])
+        FLAGS = sys.argv[2:]
 
     if not EXECUTABLE_PATH.is_file():
         print(f'Executable {EXECUTABLE_PATH} is not a valid file.', file=sys.stderr)